@@ -132,10 +132,10 @@ See also `prolac-font-lock-extra-types'.")
 	  (regexp-opt
 	   '("all" "allstatic" "catch" "constructor"
 	     "defaultinline" "else" "elseif" "end"
-	     "has" "hide" "if" "in" "inline" "let"
+	     "has" "hide" "if" "in" "inline" "layout" "let" "likely"
 	     "noinline" "notusing" "outline" "pathinline"
 	     "rename" "self" "show" "super" "then"
-	     "using") t)))
+	     "unlikely" "using") t)))
        ;;
        ;; These are immediately followed by an object name.
        (prolac-minor-types
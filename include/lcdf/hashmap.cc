@@ -184,4 +184,241 @@ _HashMap_const_iterator<K, V>::operator++(int)
 	;
 }
 
+
+// FlatHashMap
+
+template <class K, class V>
+FlatHashMap<K, V>::FlatHashMap()
+    : _capacity(0), _grow_limit(0), _n(0), _ctrl(0), _e(0), _default_value()
+{
+    increase(-1);
+}
+
+template <class K, class V>
+FlatHashMap<K, V>::FlatHashMap(const V &def)
+    : _capacity(0), _grow_limit(0), _n(0), _ctrl(0), _e(0), _default_value(def)
+{
+    increase(-1);
+}
+
+template <class K, class V>
+FlatHashMap<K, V>::FlatHashMap(const FlatHashMap<K, V> &m)
+    : _capacity(0), _grow_limit(0), _n(0), _ctrl(0), _e(0),
+      _default_value(m._default_value)
+{
+    copy_from(m);
+}
+
+template <class K, class V>
+void
+FlatHashMap<K, V>::copy_from(const FlatHashMap<K, V> &m)
+{
+    int nctrl = m._capacity + _FlatHashMap_group::size;
+    signed char *new_ctrl = new signed char[nctrl];
+    Pair *new_e = new Pair[m._capacity];
+    for (int i = 0; i < nctrl; i++)
+	new_ctrl[i] = m._ctrl[i];
+    for (int i = 0; i < m._capacity; i++)
+	if (m._ctrl[i] >= 0)
+	    new_e[i] = m._e[i];
+    delete[] _ctrl;
+    delete[] _e;
+    _ctrl = new_ctrl;
+    _e = new_e;
+    _capacity = m._capacity;
+    _grow_limit = m._grow_limit;
+    _n = m._n;
+}
+
+template <class K, class V>
+FlatHashMap<K, V> &
+FlatHashMap<K, V>::operator=(const FlatHashMap<K, V> &o)
+{
+    if (&o != this) {
+	copy_from(o);
+	_default_value = o._default_value;
+    }
+    return *this;
+}
+
+template <class K, class V>
+inline void
+FlatHashMap<K, V>::set_ctrl(int i, signed char c)
+{
+    _ctrl[i] = c;
+    if (i < _FlatHashMap_group::size)
+	_ctrl[_capacity + i] = c;
+}
+
+// Returns the first empty slot on h's probe sequence.
+template <class K, class V>
+inline int
+FlatHashMap<K, V>::empty_slot(unsigned h) const
+{
+    int mask = _capacity - 1;
+    int pos = (h >> 7) & mask;
+    while (1) {
+	unsigned m = _FlatHashMap_group(_ctrl + pos).match_empty();
+	if (m)
+	    return (pos + _FlatHashMap_group::first(m)) & mask;
+	pos = (pos + _FlatHashMap_group::size) & mask;
+    }
+}
+
+template <class K, class V>
+void
+FlatHashMap<K, V>::increase(int min_size)
+{
+    int ncap = (_capacity < 2 * _FlatHashMap_group::size ? 2 * _FlatHashMap_group::size : _capacity * 2);
+    while (((7 * ncap) >> 3) <= min_size && ncap > 0)
+	ncap *= 2;
+    if (ncap <= 0)		// want too many elements
+	return;
+
+    signed char *octrl = _ctrl;
+    Pair *oe = _e;
+    int ocap = _capacity;
+    _ctrl = new signed char[ncap + _FlatHashMap_group::size];
+    _e = new Pair[ncap];
+    _capacity = ncap;
+    _grow_limit = (7 * _capacity) >> 3;
+    for (int i = 0; i < ncap + _FlatHashMap_group::size; i++)
+	_ctrl[i] = _FlatHashMap_group::empty;
+
+    for (int i = 0; i < ocap; i++)
+	if (octrl[i] >= 0) {
+	    unsigned h = hash(hashcode(oe[i].key));
+	    int j = empty_slot(h);
+	    set_ctrl(j, h & 0x7F);
+	    _e[j] = oe[i];
+	}
+
+    delete[] octrl;
+    delete[] oe;
+}
+
+template <class K, class V>
+bool
+FlatHashMap<K, V>::insert(const K &key, const V &val)
+{
+    assert(key);
+    unsigned h = hash(hashcode(key));
+    int i = slot(key, h);
+    if (i >= 0) {
+	_e[i].value = val;
+	return false;
+    }
+    if (_n >= _grow_limit)
+	increase(-1);
+    i = empty_slot(h);
+    set_ctrl(i, h & 0x7F);
+    _e[i].key = key;
+    _e[i].value = val;
+    _n++;
+    return true;
+}
+
+template <class K, class V>
+V &
+FlatHashMap<K, V>::find_force(const K &key)
+{
+    assert(key);
+    unsigned h = hash(hashcode(key));
+    int i = slot(key, h);
+    if (i < 0) {
+	if (_n >= _grow_limit)
+	    increase(-1);
+	i = empty_slot(h);
+	set_ctrl(i, h & 0x7F);
+	_e[i].key = key;
+	_e[i].value = _default_value;
+	_n++;
+    }
+    return _e[i].value;
+}
+
+// Removes key's pair. Each later pair in the run of full slots moves back
+// into the hole if that keeps it at or after its home slot, so every pair
+// stays reachable without tombstones.
+template <class K, class V>
+bool
+FlatHashMap<K, V>::remove(const K &key)
+{
+    assert(key);
+    int i = slot(key, hash(hashcode(key)));
+    if (i < 0)
+	return false;
+
+    int mask = _capacity - 1;
+    for (int j = (i + 1) & mask; _ctrl[j] >= 0; j = (j + 1) & mask) {
+	int home = (hash(hashcode(_e[j].key)) >> 7) & mask;
+	if (((j - home) & mask) >= ((j - i) & mask)) {
+	    _e[i] = _e[j];
+	    set_ctrl(i, _ctrl[j]);
+	    i = j;
+	}
+    }
+
+    _e[i] = Pair();
+    set_ctrl(i, _FlatHashMap_group::empty);
+    _n--;
+    return true;
+}
+
+template <class K, class V>
+void
+FlatHashMap<K, V>::clear()
+{
+    delete[] _ctrl;
+    delete[] _e;
+    _ctrl = 0;
+    _e = 0;
+    _capacity = _grow_limit = _n = 0;
+    increase(-1);
+}
+
+template <class K, class V>
+void
+FlatHashMap<K, V>::swap(FlatHashMap<K, V> &o)
+{
+    int capacity = _capacity;
+    int grow_limit = _grow_limit;
+    int n = _n;
+    signed char *ctrl = _ctrl;
+    Pair *e = _e;
+    V default_value = _default_value;
+    _capacity = o._capacity;
+    _grow_limit = o._grow_limit;
+    _n = o._n;
+    _ctrl = o._ctrl;
+    _e = o._e;
+    _default_value = o._default_value;
+    o._capacity = capacity;
+    o._grow_limit = grow_limit;
+    o._n = n;
+    o._ctrl = ctrl;
+    o._e = e;
+    o._default_value = default_value;
+}
+
+template <class K, class V>
+_FlatHashMap_const_iterator<K, V>::_FlatHashMap_const_iterator(const FlatHashMap<K, V> *hm, int pos)
+    : _hm(hm), _pos(pos)
+{
+    const signed char *ctrl = _hm->_ctrl;
+    int capacity = _hm->_capacity;
+    while (_pos < capacity && ctrl[_pos] < 0)
+	_pos++;
+}
+
+template <class K, class V>
+void
+_FlatHashMap_const_iterator<K, V>::operator++(int)
+{
+    const signed char *ctrl = _hm->_ctrl;
+    int capacity = _hm->_capacity;
+    for (_pos++; _pos < capacity && ctrl[_pos] < 0; _pos++)
+	;
+}
+
 #endif
@@ -1,6 +1,10 @@
 #ifndef LCDF_HASHMAP_HH
 #define LCDF_HASHMAP_HH
 #include <assert.h>
+#include <lcdf/inttypes.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 // K AND V REQUIREMENTS:
 //
@@ -16,6 +20,36 @@
 //		V::V()
 // V &		V::operator=(const V &)
 
+inline unsigned
+hashcode(int i)
+{
+    return static_cast<unsigned>(i);
+}
+
+inline unsigned
+hashcode(unsigned u)
+{
+    return u;
+}
+
+inline unsigned
+hashcode(long l)
+{
+    return static_cast<unsigned>(l);
+}
+
+inline unsigned
+hashcode(unsigned long ul)
+{
+    return static_cast<unsigned long>(ul);
+}
+
+inline unsigned
+hashcode(const void *p)
+{
+    return static_cast<unsigned>(reinterpret_cast<uintptr_t>(p));
+}
+
 template <class K, class V> class _HashMap_const_iterator;
 template <class K, class V> class _HashMap_iterator;
 
@@ -196,28 +230,283 @@ _HashMap_const_iterator<K, V>::operator!=(const const_iterator &i) const
     return _hm != i._hm || _pos != i._pos;
 }
 
+// FlatHashMap<K, V> has HashMap's interface and requirements, and is meant
+// for maps that are searched far more often than they change. It is laid
+// out like a Swiss table: besides its array of pairs, it keeps an array of
+// control bytes, one per slot, that say whether the slot is empty and, if
+// not, hold 7 bits of its key's hash. A lookup compares a whole group of
+// control bytes at once (16 with SSE2) and looks at keys only where the
+// hash bits match. Probing is linear, so remove() shifts later pairs back
+// rather than leaving tombstones. Iteration order is unrelated to
+// HashMap's; don't use FlatHashMap where iteration order affects output.
+//
+// find_as() and findp_as() look up a key of another type KK without
+// constructing a K. hashcode(kk) must equal hashcode(K(kk)), and k == kk
+// must be defined.
+
+template <class K, class V> class _FlatHashMap_const_iterator;
+template <class K, class V> class _FlatHashMap_iterator;
+
+class _FlatHashMap_group { public:
+
+    enum { empty = -128 };
+#ifdef __SSE2__
+    enum { size = 16 };
+
+    explicit _FlatHashMap_group(const signed char *c)
+	: _g(_mm_loadu_si128(reinterpret_cast<const __m128i *>(c))) { }
+
+    // Bit i is set if control byte i equals h2.
+    unsigned match(signed char h2) const {
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_g, _mm_set1_epi8(h2)));
+    }
+    unsigned match_empty() const	{ return _mm_movemask_epi8(_g); }
+
+  private:
+    __m128i _g;
+#else
+    enum { size = 8 };
+
+    explicit _FlatHashMap_group(const signed char *c) : _c(c) { }
+
+    unsigned match(signed char h2) const {
+	unsigned m = 0;
+	for (int i = 0; i < size; i++)
+	    m |= (unsigned)(_c[i] == h2) << i;
+	return m;
+    }
+    unsigned match_empty() const	{ return match(empty); }
+
+  private:
+    const signed char *_c;
+#endif
+
+  public:
+
+    static int first(unsigned m) {
+#ifdef __GNUC__
+	return __builtin_ctz(m);
+#else
+	int i = 0;
+	for (; !(m & 1); m >>= 1)
+	    i++;
+	return i;
+#endif
+    }
+
+};
+
+template <class K, class V>
+class FlatHashMap { public:
+    
+    FlatHashMap();
+    explicit FlatHashMap(const V&);
+    FlatHashMap(const FlatHashMap<K, V>&);
+    ~FlatHashMap()			{ delete[] _e; delete[] _ctrl; }
+
+    int size() const			{ return _n; }
+    bool empty() const			{ return _n == 0; }
+    int capacity() const		{ return _capacity; }
+    const V& default_value() const	{ return _default_value; }
+    void set_default_value(const V& v)	{ _default_value = v; }
+
+    typedef _FlatHashMap_const_iterator<K, V> const_iterator;
+    typedef _FlatHashMap_iterator<K, V> iterator;
+
+    inline const_iterator begin() const;
+    inline iterator begin();
+    inline const_iterator end() const;
+    inline iterator end();
+
+    inline const V& find(const K&) const;
+    inline V* findp(const K&) const;
+    inline const V& operator[](const K& k) const;
+    V& find_force(const K&);
+    template <class KK> inline const V& find_as(const KK&) const;
+    template <class KK> inline V* findp_as(const KK&) const;
+
+    bool insert(const K&, const V&);
+    bool remove(const K&);
+    void clear();
+
+    FlatHashMap<K, V>& operator=(const FlatHashMap<K, V>&);
+    void swap(FlatHashMap<K, V>&);
+
+    void resize(int size)		{ increase(size); }
+
+    typedef typename HashMap<K, V>::Pair Pair;
+
+  private:
+
+    int _capacity;
+    int _grow_limit;
+    int _n;
+    signed char* _ctrl;		// _capacity + group size bytes; the last
+				// group repeats the first
+    Pair* _e;
+    V _default_value;
+
+    static inline unsigned hash(unsigned hc);
+    template <class KK> inline int slot(const KK&, unsigned h) const;
+    inline int empty_slot(unsigned h) const;
+    inline void set_ctrl(int, signed char);
+    void increase(int);
+    void copy_from(const FlatHashMap<K, V>&);
+
+    friend class _FlatHashMap_const_iterator<K, V>;
+    friend class _FlatHashMap_iterator<K, V>;
+
+};
+
+template <class K, class V>
+class _FlatHashMap_const_iterator { public:
+    typedef _FlatHashMap_const_iterator const_iterator;
+    typedef typename FlatHashMap<K, V>::Pair Pair;
+    
+    operator bool() const		{ return _pos < _hm->_capacity; }
+    bool operator!() const		{ return _pos >= _hm->_capacity; }
+    
+    void operator++(int);
+    void operator++()			{ (*this)++; }
+    
+    const K& key() const		{ return _hm->_e[_pos].key; }
+    const V& value() const		{ return _hm->_e[_pos].value; }
+    const Pair& pair() const		{ return _hm->_e[_pos]; }
+
+    inline bool operator==(const const_iterator&) const;
+    inline bool operator!=(const const_iterator&) const;
+
+  private:
+    const FlatHashMap<K, V>* _hm;
+    int _pos;
+    _FlatHashMap_const_iterator(const FlatHashMap<K, V>*, int);
+    friend class FlatHashMap<K, V>;
+    friend class _FlatHashMap_iterator<K, V>;
+};
+
+template <class K, class V>
+class _FlatHashMap_iterator : public _FlatHashMap_const_iterator<K, V> { public:
+    typedef _FlatHashMap_iterator iterator;
+    
+    V& value() const		{ return this->_hm->_e[this->_pos].value; }
+
+  private:
+    _FlatHashMap_iterator(const FlatHashMap<K, V>* hm, int pos) : _FlatHashMap_const_iterator<K, V>(hm, pos) { }
+    friend class FlatHashMap<K, V>;
+};
+
+
+// Scrambles a hashcode, which may be a pointer with its low bits clear. The
+// low 7 bits of the result go in the control byte; the rest pick the slot.
+template <class K, class V>
 inline unsigned
-hashcode(int i)
+FlatHashMap<K, V>::hash(unsigned hc)
 {
-    return static_cast<unsigned>(i);
+    hc *= 0x9E3779B1U;
+    return hc ^ (hc >> 15);
 }
 
-inline unsigned
-hashcode(unsigned u)
+template <class K, class V> template <class KK>
+inline int
+FlatHashMap<K, V>::slot(const KK& key, unsigned h) const
 {
-    return u;
+    int mask = _capacity - 1;
+    int pos = (h >> 7) & mask;
+    signed char h2 = h & 0x7F;
+    while (1) {
+	_FlatHashMap_group g(_ctrl + pos);
+	for (unsigned m = g.match(h2); m; m &= m - 1) {
+	    int i = (pos + _FlatHashMap_group::first(m)) & mask;
+	    if (_e[i].key == key)
+		return i;
+	}
+	if (g.match_empty())
+	    return -1;
+	pos = (pos + _FlatHashMap_group::size) & mask;
+    }
 }
 
-inline unsigned
-hashcode(long l)
+template <class K, class V>
+inline const V&
+FlatHashMap<K, V>::find(const K& key) const
 {
-    return static_cast<unsigned>(l);
+    assert(key);
+    int i = slot(key, hash(hashcode(key)));
+    return i >= 0 ? _e[i].value : _default_value;
 }
 
-inline unsigned
-hashcode(unsigned long ul)
+template <class K, class V>
+inline const V&
+FlatHashMap<K, V>::operator[](const K& key) const
 {
-    return static_cast<unsigned long>(ul);
+    return find(key);
+}
+
+template <class K, class V>
+inline V*
+FlatHashMap<K, V>::findp(const K& key) const
+{
+    assert(key);
+    int i = slot(key, hash(hashcode(key)));
+    return i >= 0 ? &_e[i].value : 0;
+}
+
+template <class K, class V> template <class KK>
+inline const V&
+FlatHashMap<K, V>::find_as(const KK& key) const
+{
+    int i = slot(key, hash(hashcode(key)));
+    return i >= 0 ? _e[i].value : _default_value;
+}
+
+template <class K, class V> template <class KK>
+inline V*
+FlatHashMap<K, V>::findp_as(const KK& key) const
+{
+    int i = slot(key, hash(hashcode(key)));
+    return i >= 0 ? &_e[i].value : 0;
+}
+
+template <class K, class V>
+inline _FlatHashMap_const_iterator<K, V>
+FlatHashMap<K, V>::begin() const
+{
+    return const_iterator(this, 0);
+}
+
+template <class K, class V>
+inline _FlatHashMap_const_iterator<K, V>
+FlatHashMap<K, V>::end() const
+{
+    return const_iterator(this, _capacity);
+}
+
+template <class K, class V>
+inline _FlatHashMap_iterator<K, V>
+FlatHashMap<K, V>::begin()
+{
+    return iterator(this, 0);
+}
+
+template <class K, class V>
+inline _FlatHashMap_iterator<K, V>
+FlatHashMap<K, V>::end()
+{
+    return iterator(this, _capacity);
+}
+
+template <class K, class V>
+inline bool
+_FlatHashMap_const_iterator<K, V>::operator==(const const_iterator &i) const
+{
+    return _hm == i._hm && _pos == i._pos;
+}
+
+template <class K, class V>
+inline bool
+_FlatHashMap_const_iterator<K, V>::operator!=(const const_iterator &i) const
+{
+    return _hm != i._hm || _pos != i._pos;
 }
 
 #include <lcdf/hashmap.cc>	// necessary to support GCC 3.3
@@ -39,11 +39,22 @@ class PermString { struct Doodad; public:
     friend PermString permcat(PermString, PermString);
     friend PermString permcat(PermString, PermString, PermString);  
 
+    // Figures on the intern table.
+    struct TableStats {
+	unsigned strings;
+	unsigned buckets;
+	unsigned collisions;	// strings that share a bucket with another
+	unsigned longest_chain;
+	unsigned resizes;
+    };
+    static TableStats table_stats();
+
   private:
   
     struct Doodad {
 	Doodad *next;
 	int length;
+	unsigned hash;
 	char data[2];
     };
   
@@ -55,8 +66,13 @@ class PermString { struct Doodad; public:
     friend struct PermString::Initializer;
     static void static_initialize();
 
-    enum { NHASH = 1024 };	// must be power of 2
-    static Doodad zero_char_doodad, one_char_doodad[256], *buckets[NHASH];
+    // The intern table grows as strings are added. Lookups take no lock;
+    // adding a string takes a lock that only writers contend for.
+    struct Table;
+    static Doodad zero_char_doodad, one_char_doodad[256];
+    static Table initial_table, *table;
+    static Doodad *intern(const char *, int);
+    static void grow_table();
   
 };
 
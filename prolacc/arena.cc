@@ -0,0 +1,118 @@
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include "arena.hh"
+#include <cstdlib>
+#include <new>
+
+#define ARENA_CHUNK_SIZE	65536
+
+Arena *Arena::current_arena;
+Arena *Arena::persistent_arena;
+size_t Arena::live_bytes;
+size_t Arena::peak_bytes;
+unsigned long Arena::total_allocations;
+unsigned long Arena::total_bytes;
+
+
+Arena::Arena(const char *name, bool transient)
+  : _name(name), _transient(transient), _chunks(0), _pos(0), _end(0),
+    _chunk_bytes(0)
+{
+}
+
+void *
+Arena::allocate_chunk(size_t size)
+{
+  // Big objects get a chunk of their own so the current chunk's free space
+  // isn't wasted.
+  size_t chunk_size = ARENA_CHUNK_SIZE;
+  bool own_chunk = (size > ARENA_CHUNK_SIZE / 4);
+  if (own_chunk)
+    chunk_size = size;
+
+  Chunk *c = (Chunk *)malloc(sizeof(Chunk) + chunk_size);
+  if (!c)
+    throw std::bad_alloc();
+  c->size = chunk_size;
+  _chunk_bytes += chunk_size;
+  live_bytes += chunk_size;
+  if (live_bytes > peak_bytes)
+    peak_bytes = live_bytes;
+
+  char *data = (char *)(c + 1);
+  if (own_chunk && _chunks) {
+    // Keep allocating from the current chunk.
+    c->next = _chunks->next;
+    _chunks->next = c;
+    return data;
+  }
+  c->next = _chunks;
+  _chunks = c;
+  _pos = data + size;
+  _end = data + chunk_size;
+  return data;
+}
+
+void
+Arena::release()
+{
+  while (Chunk *c = _chunks) {
+    _chunks = c->next;
+    live_bytes -= c->size;
+    free(c);
+  }
+  _pos = _end = 0;
+  _chunk_bytes = 0;
+}
+
+
+Arena *
+Arena::default_arena()
+{
+  // Objects made before main() enters an arena, such as static Nodes, live
+  // here.
+  static Arena arena("static");
+  return &arena;
+}
+
+Arena *
+Arena::persistent()
+{
+  return persistent_arena ? persistent_arena : default_arena();
+}
+
+Arena *
+Arena::enter(Arena *a)
+{
+  Arena *old = current_arena;
+  current_arena = a;
+  if (!a)
+    persistent_arena = 0;
+  else if (!a->_transient)
+    persistent_arena = a;
+  return old;
+}
+
+void *
+Arena::allocate_current(size_t size)
+{
+  Arena *a = (current_arena ? current_arena : default_arena());
+  return a->allocate(size);
+}
+
+size_t
+Arena::reset_peak()
+{
+  // Start measuring a nested peak; restore_peak() folds it back in.
+  size_t old_peak = peak_bytes;
+  peak_bytes = live_bytes;
+  return old_peak;
+}
+
+void
+Arena::restore_peak(size_t old_peak)
+{
+  if (old_peak > peak_bytes)
+    peak_bytes = old_peak;
+}
@@ -0,0 +1,78 @@
+#ifndef ARENA_HH
+#define ARENA_HH
+#include <cstddef>
+
+// Nodes, Exprs, Targets and Locations are allocated from the current Arena
+// and freed all at once when the Arena is released; deleting one of them
+// runs its destructor but frees no memory. Arenas entered while a rule is
+// compiled are transient: objects that must outlive the rule should be made
+// in Arena::persistent().
+
+class Arena {
+
+  struct Chunk {
+    Chunk *next;
+    size_t size;
+  };
+
+  const char *_name;
+  bool _transient;
+  Chunk *_chunks;
+  char *_pos;
+  char *_end;
+  size_t _chunk_bytes;
+
+  static Arena *current_arena;
+  static Arena *persistent_arena;
+  static size_t live_bytes;
+  static size_t peak_bytes;
+  static unsigned long total_allocations;
+  static unsigned long total_bytes;
+
+  void *allocate_chunk(size_t);
+  static Arena *default_arena();
+
+  Arena(const Arena &);
+  Arena &operator=(const Arena &);
+
+ public:
+
+  Arena(const char *name, bool transient = false);
+  ~Arena()				{ release(); }
+
+  const char *name() const		{ return _name; }
+  size_t chunk_bytes() const		{ return _chunk_bytes; }
+
+  inline void *allocate(size_t);
+  void release();
+
+  static Arena *current()		{ return current_arena; }
+  static Arena *persistent();
+  static Arena *enter(Arena *);
+  static void *allocate_current(size_t);
+
+  static unsigned long allocations()	{ return total_allocations; }
+  static unsigned long allocated_bytes() { return total_bytes; }
+  static size_t live()			{ return live_bytes; }
+  static size_t peak()			{ return peak_bytes; }
+  static size_t reset_peak();
+  static void restore_peak(size_t);
+
+};
+
+
+inline void *
+Arena::allocate(size_t size)
+{
+  size = (size + 7) & ~(size_t)7;
+  total_allocations++;
+  total_bytes += size;
+  if (size <= (size_t)(_end - _pos)) {
+    void *v = _pos;
+    _pos += size;
+    return v;
+  } else
+    return allocate_chunk(size);
+}
+
+#endif
@@ -0,0 +1,224 @@
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include "bench.hh"
+#include "token.hh"
+#include "codeblock.hh"
+#include "operator.hh"
+#include "pass.hh"
+#include "writer.hh"
+#include <lcdf/vector.hh>
+#include <lcdf/hashmap.hh>
+#include <cstdio>
+#include <cstring>
+
+static const double min_bench_time = 1.0;
+
+
+// Tokenizes the input as the parser would, reading code blocks where it
+// would, and counts the tokens.
+static unsigned long
+tokenize_once(Tokenizer &tize)
+{
+  unsigned long tokens = 0;
+  while (1) {
+    Token t = tize.get_token();
+    if (!t)
+      break;
+    tokens++;
+    if (t.is('{') || t.is(opLiteralCode))
+      delete tize.get_code_block(t.is(opLiteralCode));
+  }
+  return tokens;
+}
+
+static void
+bench_tokenizer(Tokenizer &tize, Writer &w)
+{
+  unsigned long tokens = 0;
+  unsigned rounds = 0;
+  double start = wall_time(), elapsed;
+  do {
+    tize.rewind();
+    tokens += tokenize_once(tize);
+    rounds++;
+    elapsed = wall_time() - start;
+  } while (elapsed < min_bench_time);
+  
+  double bytes = (double)tize.input_size() * rounds;
+  char buf[200];
+  sprintf(buf, "tokenizer: %lu bytes, %lu tokens, %u rounds in %.3f s: %.1f MB/s, %.1f Mtokens/s\n",
+	  (unsigned long)tize.input_size(), tokens / rounds, rounds, elapsed,
+	  bytes / elapsed / 1e6, tokens / elapsed / 1e6);
+  w << buf;
+}
+
+
+// Collects the input's tokens of two or more characters.
+static void
+collect_words(Tokenizer &tize, Vector<PermString> &words)
+{
+  while (1) {
+    Token t = tize.get_token();
+    if (!t)
+      break;
+    if (t.is('{') || t.is(opLiteralCode))
+      delete tize.get_code_block(t.is(opLiteralCode));
+    if (t.print_string().length() >= 2)
+      words.push_back(t.print_string());
+  }
+}
+
+// Interns the input's words again and again, which finds them in the table,
+// then interns variants of them, which adds them and grows the table.
+static void
+bench_intern(Tokenizer &tize, Writer &w)
+{
+  Vector<PermString> words;
+  collect_words(tize, words);
+  Vector<char> text;
+  Vector<int> offsets;
+  for (int i = 0; i < words.size(); i++) {
+    offsets.push_back(text.size());
+    for (const char *x = words[i].begin(); x < words[i].end(); x++)
+      text.push_back(*x);
+  }
+  offsets.push_back(text.size());
+  int nwords = offsets.size() - 1;
+  if (nwords == 0) {
+    w << "intern: no words in input\n";
+    return;
+  }
+  
+  unsigned long lookups = 0;
+  double start = wall_time(), elapsed;
+  do {
+    for (int i = 0; i < nwords; i++)
+      PermString(&text[offsets[i]], offsets[i+1] - offsets[i]);
+    lookups += nwords;
+    elapsed = wall_time() - start;
+  } while (elapsed < min_bench_time);
+  double lookup_rate = lookups / elapsed;
+  
+  const unsigned ninserts = 1000000;
+  char buf[200];
+  start = wall_time();
+  for (unsigned n = 0; n < ninserts; n++) {
+    int i = n % nwords, len = offsets[i+1] - offsets[i];
+    if (len > 100)
+      len = 100;
+    memcpy(buf, &text[offsets[i]], len);
+    len += sprintf(buf + len, "__%u", n);
+    PermString(buf, len);
+  }
+  double insert_rate = ninserts / (wall_time() - start);
+  
+  sprintf(buf, "intern: %d words, %.2f Mlookups/s, %.2f Minserts/s\n",
+	  nwords, lookup_rate / 1e6, insert_rate / 1e6);
+  w << buf;
+  write_intern_stats(w);
+}
+
+void
+write_intern_stats(Writer &w)
+{
+  PermString::TableStats stats = PermString::table_stats();
+  char buf[200];
+  sprintf(buf, "string table: %u strings, %u buckets, load factor %.2f, %u colliding, longest chain %u, %u resizes\n",
+	  stats.strings, stats.buckets, (double)stats.strings / stats.buckets,
+	  stats.collisions, stats.longest_chain, stats.resizes);
+  w << buf;
+}
+
+
+static volatile int bench_sink;
+
+// Returns lookups per second in a map holding `keys', half of the lookups
+// finding a key and half looking for one of `misses'.
+template <class M, class K>
+static double
+time_lookups(const Vector<K> &keys, const Vector<K> &misses)
+{
+  M m(-1);
+  for (int i = 0; i < keys.size(); i++)
+    m.insert(keys[i], i);
+  
+  unsigned long lookups = 0;
+  int sum = 0;
+  double start = wall_time(), elapsed;
+  do {
+    for (int r = 0; r < 64; r++)
+      for (int i = 0; i < keys.size(); i++)
+	sum += m.find(keys[i]) + m.find(misses[i]);
+    lookups += 128 * keys.size();
+    elapsed = wall_time() - start;
+  } while (elapsed < min_bench_time / 8);
+  bench_sink = sum;
+  return lookups / elapsed;
+}
+
+template <class K>
+static void
+bench_maps(const char *what, const Vector<K> &keys, const Vector<K> &misses,
+	   Writer &w)
+{
+  double hm = time_lookups<HashMap<K, int> >(keys, misses);
+  double fhm = time_lookups<FlatHashMap<K, int> >(keys, misses);
+  char buf[200];
+  sprintf(buf, "hashmap: %s keys, %d entries: HashMap %.1f, FlatHashMap %.1f Mlookups/s\n",
+	  what, keys.size(), hm / 1e6, fhm / 1e6);
+  w << buf;
+}
+
+// Compares HashMap with FlatHashMap for a namespace-sized map and larger ones,
+// with PermString keys taken from the input and with pointer keys.
+static void
+bench_hashmap(Tokenizer &tize, Writer &w)
+{
+  Vector<PermString> words;
+  collect_words(tize, words);
+  HashMap<PermString, int> seen(0);
+  Vector<PermString> unique;
+  for (int i = 0; i < words.size(); i++)
+    if (!seen[words[i]]) {
+      seen.insert(words[i], 1);
+      unique.push_back(words[i]);
+    }
+  
+  static const int sizes[] = { 16, 4096, 262144 };
+  for (int si = 0; si < 3; si++) {
+    int n = sizes[si];
+    Vector<PermString> keys, misses;
+    for (int i = 0; i < n; i++) {
+      if (i < unique.size())
+	keys.push_back(unique[i]);
+      else
+	keys.push_back(permprintf("key_%d", i));
+      misses.push_back(permprintf("miss_%d", i));
+    }
+    bench_maps("PermString", keys, misses, w);
+    
+    Vector<int> objects(2 * n, 0);
+    Vector<const int *> pkeys, pmisses;
+    for (int i = 0; i < n; i++) {
+      pkeys.push_back(&objects[2*i]);
+      pmisses.push_back(&objects[2*i + 1]);
+    }
+    bench_maps("pointer", pkeys, pmisses, w);
+  }
+}
+
+
+bool
+run_benchmark(PermString kind, Tokenizer &tize, Writer &w)
+{
+  if (kind == "tokenizer")
+    bench_tokenizer(tize, w);
+  else if (kind == "intern")
+    bench_intern(tize, w);
+  else if (kind == "hashmap")
+    bench_hashmap(tize, w);
+  else
+    return false;
+  return true;
+}
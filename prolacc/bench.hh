@@ -0,0 +1,16 @@
+#ifndef BENCH_HH
+#define BENCH_HH
+#include <lcdf/permstr.hh>
+class Tokenizer;
+class Writer;
+
+// Microbenchmarks of the front end, run by `--benchmark=KIND' in place of a
+// compilation. Each repeats its work on the input for about a second and
+// reports throughput. Returns false if KIND is unknown.
+
+bool run_benchmark(PermString kind, Tokenizer &, Writer &);
+
+// Prints the figures from PermString::table_stats().
+void write_intern_stats(Writer &);
+
+#endif
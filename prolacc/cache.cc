@@ -0,0 +1,207 @@
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include "cache.hh"
+#include "compiler.hh"
+#include "module.hh"
+#include "rule.hh"
+#include "node.hh"
+#include "writer.hh"
+#include <cstdio>
+#include <cstring>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/types.h>
+# include <sys/stat.h>
+#endif
+
+#ifndef VERSION
+# define VERSION "?"
+#endif
+
+#define CACHE_MAGIC	"prolacc cache 2\n"
+
+// A cache entry holds the generated C for one rule, keyed by a description
+// of its optimized body, its prototype, and the layout of its receiver
+// class. Callees' prototypes and exceptions are part of the body's
+// description. The entry's file name is a hash of the key; the entry holds
+// the whole key, so a hash collision just causes a miss.
+
+CompileCache::CompileCache(PermString dir, int max_inline_level)
+  : _dir(dir), _max_inline_level(max_inline_level), _block_placement(-1),
+    _rule_map(0)
+{
+#ifdef HAVE_SYS_STAT_H
+  mkdir(dir.c_str(), 0777);
+#endif
+}
+
+
+void
+CompileCache::add_rules(const Vector<Rule *> &rules)
+{
+  // Entries refer to rules by generated name. A name shared by several rules
+  // can't be looked up, so entries using it always miss.
+  for (int i = 0; i < rules.size(); i++) {
+    int &index = _rule_map.find_force(rule_name(rules[i]));
+    if (index == 0) {
+      _rules.push_back(rules[i]);
+      index = _rules.size();
+    } else if (index > 0 && _rules[index - 1] != rules[i])
+      index = -1;
+  }
+}
+
+PermString
+CompileCache::rule_name(Rule *rule)
+{
+  Vector<char> name;
+  Writer w(0);
+  w.set_capture(&name);
+  rule->gen_name(w);
+  w << wmendl;
+  return PermString(name.begin(), name.size() - 1);
+}
+
+
+void
+CompileCache::key(Rule *rule, Node *body, Vector<char> &key) const
+{
+  Writer w(0);
+  w.set_capture(&key);
+  w << CACHE_MAGIC << VERSION << " " << _max_inline_level;
+  // Block placement changes the code generated for the same body.
+  if (_block_placement >= 0)
+    w << " place " << _block_placement;
+  w << "\n";
+  rule->gen_prototype(w, false);
+  w << rule->all_exceptions() << wmendl;
+  rule->receiver_class()->write_layout(w);
+  body->write_cache_key(w);
+  w << wmendl;
+}
+
+PermString
+CompileCache::entry_filename(const Vector<char> &key) const
+{
+  unsigned h1 = 2166136261U;	// FNV-1a
+  unsigned h2 = 5381;		// djb2
+  for (int i = 0; i < key.size(); i++) {
+    unsigned char c = key[i];
+    h1 = ((h1 ^ c) * 16777619U) & 0xFFFFFFFFU;
+    h2 = (h2 * 33 + c) & 0xFFFFFFFFU;
+  }
+  char buf[20];
+  sprintf(buf, "%08x%08x", h1, h2);
+  return permprintf("%p/%s", _dir.capsule(), buf);
+}
+
+
+static bool
+read_rule_names(FILE *f, int n, const HashMap<PermString, int> &rule_map,
+		const Vector<Rule *> &rules, Vector<Rule *> &result)
+{
+  char buf[1024];
+  result.clear();
+  for (int i = 0; i < n; i++) {
+    if (!fgets(buf, sizeof(buf), f))
+      return false;
+    int len = strlen(buf);
+    if (len == 0 || buf[len - 1] != '\n')
+      return false;
+    int index = rule_map[PermString(buf, len - 1)];
+    if (index <= 0)
+      return false;
+    result.push_back(rules[index - 1]);
+  }
+  return true;
+}
+
+bool
+CompileCache::find(const Vector<char> &key, CompiledRule &cr) const
+{
+  FILE *f = fopen(entry_filename(key).c_str(), "rb");
+  if (!f)
+    return false;
+
+  char magic[sizeof(CACHE_MAGIC)];
+  int keylen, textlen, nprototyped, nmarked, nlines;
+  bool ok = fgets(magic, sizeof(magic), f)
+    && strcmp(magic, CACHE_MAGIC) == 0
+    && fscanf(f, "%d %d %d %d %d", &keylen, &textlen, &nprototyped,
+	      &nmarked, &nlines) == 5
+    && getc(f) == '\n'
+    && keylen == key.size()
+    && textlen >= 0;
+
+  if (ok) {
+    Vector<char> stored_key(keylen, 0);
+    ok = (fread(stored_key.begin(), 1, keylen, f) == (size_t)keylen
+	  && memcmp(stored_key.begin(), key.begin(), keylen) == 0);
+  }
+
+  ok = ok && read_rule_names(f, nprototyped, _rule_map, _rules, cr.prototyped)
+    && read_rule_names(f, nmarked, _rule_map, _rules, cr.marked);
+
+  cr.line_directives.clear();
+  int line;
+  for (int i = 0; ok && i < nlines; i++)
+    if (fscanf(f, "%d", &line) == 1)
+      cr.line_directives.push_back(line);
+    else
+      ok = false;
+  if (ok && nlines)
+    ok = (getc(f) == '\n');
+
+  cr.stats.assign(nCompileStats, 0);
+  for (int i = 0; ok && i < nCompileStats; i++)
+    ok = (fscanf(f, "%d", &cr.stats[i]) == 1);
+  if (ok)
+    ok = (getc(f) == '\n');
+
+  if (ok) {
+    cr.text.resize(textlen);
+    ok = (fread(cr.text.begin(), 1, textlen, f) == (size_t)textlen);
+  }
+
+  cr.errors = cr.warnings = 0;
+  fclose(f);
+  return ok;
+}
+
+void
+CompileCache::store(const Vector<char> &key, const CompiledRule &cr) const
+{
+  // Write to a temporary file, then rename it into place, so concurrent
+  // compilers sharing the directory never see partial entries.
+  PermString filename = entry_filename(key);
+#ifdef HAVE_UNISTD_H
+  PermString tmpname = permprintf("%p.%d", filename.capsule(), (int)getpid());
+#else
+  PermString tmpname = permprintf("%p.tmp", filename.capsule());
+#endif
+  FILE *f = fopen(tmpname.c_str(), "wb");
+  if (!f)
+    return;
+
+  fprintf(f, CACHE_MAGIC "%d %d %d %d %d\n", key.size(), cr.text.size(),
+	  cr.prototyped.size(), cr.marked.size(), cr.line_directives.size());
+  fwrite(key.begin(), 1, key.size(), f);
+  for (int i = 0; i < cr.prototyped.size(); i++)
+    fprintf(f, "%s\n", rule_name(cr.prototyped[i]).c_str());
+  for (int i = 0; i < cr.marked.size(); i++)
+    fprintf(f, "%s\n", rule_name(cr.marked[i]).c_str());
+  for (int i = 0; i < cr.line_directives.size(); i++)
+    fprintf(f, "%d\n", cr.line_directives[i]);
+  for (int i = 0; i < nCompileStats; i++)
+    fprintf(f, "%d%c", cr.stats[i], (i == nCompileStats - 1 ? '\n' : ' '));
+  fwrite(cr.text.begin(), 1, cr.text.size(), f);
+
+  bool ok = !ferror(f);
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok || rename(tmpname.c_str(), filename.c_str()) != 0)
+    remove(tmpname.c_str());
+}
@@ -0,0 +1,37 @@
+#ifndef CACHE_HH
+#define CACHE_HH
+#include <lcdf/permstr.hh>
+#include <lcdf/vector.hh>
+#include <lcdf/hashmap.hh>
+class Rule;
+class Node;
+struct CompiledRule;
+
+
+class CompileCache {
+
+  PermString _dir;
+  int _max_inline_level;
+  int _block_placement;
+
+  HashMap<PermString, int> _rule_map;
+  Vector<Rule *> _rules;
+
+  PermString entry_filename(const Vector<char> &) const;
+
+ public:
+
+  CompileCache(PermString dir, int max_inline_level);
+
+  void set_block_placement(int max_copy_cost)	{ _block_placement = max_copy_cost; }
+  
+  void add_rules(const Vector<Rule *> &);
+  static PermString rule_name(Rule *);
+
+  void key(Rule *, Node *, Vector<char> &) const;
+  bool find(const Vector<char> &key, CompiledRule &) const;
+  void store(const Vector<char> &key, const CompiledRule &) const;
+
+};
+
+#endif
@@ -84,10 +84,7 @@ CodeBlock::gen(Compiler *c, NodeOptimizer *opt)
   }
   
   // Switch the line number back to the right line number in the C code.
-  c->out << wmendl << wmtab(0) << "# " << c->out.output_line() + 1;
-  if (c->out["filename"])
-    c->out << " \"" << (const char *)c->out["filename"] << "\"";
-  c->out << "\n";
+  c->gen_output_line();
 }
 
 
@@ -145,6 +142,63 @@ CodeChunk::gen(Compiler *c, Node *self, NodeOptimizer *opt) const
 }
 
 
+void
+CodeBlock::write_cache_key(Writer &w) const
+{
+  w << "code " << _landmark.file() << ':' << _landmark.line()
+    << (_empty ? " empty\n" : "\n");
+  for (int i = 0; i < _chunks.size(); i++)
+    _chunks[i].write_cache_key(w);
+}
+
+// Appends the slots the block names to `slots'. Returns false if the block
+// names `self' itself.
+bool
+CodeBlock::self_slots(Vector<Field *> &slots) const
+{
+  for (int i = 0; i < _chunks.size(); i++)
+    if (_chunks[i].is_self())
+      return false;
+    else if (Field *f = _chunks[i].slot())
+      slots.push_back(f);
+  return true;
+}
+
+void
+CodeChunk::write_cache_key(Writer &w) const
+{
+  switch (_which) {
+    
+   case chOffset:
+    w << "offset " << _v.offset << "\n";
+    break;
+    
+   case chString:
+    w << "string " << _v.s.l << ' ';
+    w.write(_v.s.s, _v.s.l);
+    w << wmendl;
+    break;
+    
+   case chNode:
+    _v.node->write_cache_key(w);
+    break;
+    
+   case chSlot:
+    w << "slot " << _v.slot->compiled_name() << ' ' << _v.slot->offset()
+      << "\n";
+    break;
+    
+   case chSelf:
+    w << "self\n";
+    break;
+    
+   default:
+    break;
+    
+  }
+}
+
+
 /*****
  * Parsing it into code chunks
  **/
@@ -51,6 +51,10 @@ class CodeChunk {
   operator bool() const			{ return _which != chNone; }
   
   void gen(Compiler *, Node *, NodeOptimizer *) const;
+  void write_cache_key(Writer &) const;
+  
+  bool is_self() const			{ return _which == chSelf; }
+  Field *slot() const			{ return _which == chSlot ? _v.slot : 0; }
   
 };
 
@@ -85,8 +89,10 @@ class CodeBlock {
   
   void gen(Compiler *, NodeOptimizer *);
   void gen_outer(Compiler *);
+  void write_cache_key(Writer &) const;
 
   void add_chunk(const CodeChunk &cc)	{ _chunks.push_back(cc); }
+  bool self_slots(Vector<Field *> &) const;
   void parse(Module *, Namespace *, bool is_static);
   
 };
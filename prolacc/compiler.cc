@@ -8,10 +8,32 @@
 #include "rule.hh"
 #include "error.hh"
 #include "module.hh"
+#include "cache.hh"
+#include "arena.hh"
+#include "pass.hh"
+#include "profile.hh"
+#include "landmark.hh"
+#include <cstring>
+#include <cstdio>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+# include <sys/wait.h>
+#endif
 
 Compiler::Compiler(Writer &w, Writer &pw, int max_inline_level)
-  : _max_inline_level(max_inline_level), out(w), proto_out(pw)
+  : _max_inline_level(max_inline_level), _cache(0), _profile(0),
+    _rule_arenas(0), _rule_arena_bytes(0), _max_rule_arena_bytes(0),
+    _rule_stats(nCompileStats, 0), _stats(nCompileStats, 0),
+    _remark_kinds(0), _remark_json(false), _remark_out(0), _rule(0),
+    _fold(false), _fold_keys(false), _fold_index(-1), _folded_rules(0),
+    _folded_bytes(0), _place_blocks(false), _gen_queue(0),
+    out(w), proto_out(pw)
 {
+  // Temporaries introduced while compiling a rule are numbered from the same
+  // point for every rule, so a rule's code doesn't depend on which rules were
+  // compiled before it. Create the shared exception variable first.
+  exceptid_node();
+  _first_uniqueifier = VariableNode::uniqueifier_value();
 }
 
 void
@@ -21,10 +43,53 @@ Compiler::compile(Rule *rule, bool debug_node, bool debug_target,
   if (!rule->gen_if())
     return;
   
+  // The Nodes, Targets and Locations made while compiling a rule are used
+  // only by that rule, so they're allocated from an arena released when the
+  // rule is done.
+  Arena rule_arena("rule", true);
+  Arena *old_arena = Arena::enter(&rule_arena);
+  compile_body(rule, debug_node, debug_target, debug_loc);
+  Arena::enter(old_arena);
+  
+  count_pass_rule();
+  _rule_arenas++;
+  _rule_arena_bytes += rule_arena.chunk_bytes();
+  if (rule_arena.chunk_bytes() > _max_rule_arena_bytes)
+    _max_rule_arena_bytes = rule_arena.chunk_bytes();
+}
+
+// The fold key holds everything the rule's function depends on except its
+// name and receiver type: its signature, its exceptions, and its optimized
+// body, whose cache key includes the offsets of the fields it uses.
+static void
+make_fold_key(Rule *rule, Node *body, Vector<char> &key)
+{
+  Writer w(0);
+  w.set_capture(&key);
+  w << (rule->is_static() ? "static " : "dynamic ") << rule->heat() << ' '
+    << rule->return_type() << "\n";
+  for (int i = 0; i < rule->param_count(); i++)
+    w << rule->param_type(i) << ' ' << rule->param_name(i) << "\n";
+  w << rule->all_exceptions() << wmendl;
+  body->write_cache_key(w);
+  w << wmendl;
+}
+
+void
+Compiler::compile_body(Rule *rule, bool debug_node, bool debug_target,
+		       bool debug_loc)
+{
   _blocks.clear();
   _temporaries.clear();
   _marked_rules.clear();
+  _prototyped_rules.clear();
+  _line_directives.clear();
+  _rule_stats.assign(nCompileStats, 0);
+  _rule = rule;
+  _remarks.clear();
+  _first_line = out.output_line();
   _exception_handler = _rethrow_handler = 0;
+  VariableNode::set_uniqueifier(_first_uniqueifier);
   
   _body_root = rule->body();
   if (!_body_root) {
@@ -38,19 +103,45 @@ Compiler::compile(Rule *rule, bool debug_node, bool debug_target,
     errwriter << rule << "\n" << wmexpandnodes(1) << _body_root
 	      << wmexpandnodes(0) << "\n";
   
+  Node::begin_saving_states();
+  
   // Optimize the body
   _gen_modnames = rule->receiver_class()->default_modnames();
   Node *self = new SelfNode(_gen_modnames, *rule);
   InlineOptimizer inliner(self, inlineNo, _max_inline_level);
+  inliner.set_profile(_profile);
+  inliner.set_remarks(this);
   _body_root = _body_root->optimize(&inliner);
   
-  ConstOptimizer conster;
+  ConstOptimizer conster(this);
   _body_root = _body_root->optimize(&conster);
   
+  // Compute repeated values once.
+  CSEOptimizer cse;
+  _body_root = cse.optimize(_body_root);
+  
+  // Add profile counters, or outline rarely taken branches.
+  if (_profile) {
+    ProfileOptimizer profiler(_profile);
+    profiler.set_remarks(this);
+    _body_root = _body_root->optimize(&profiler);
+    if (_profile->instrumenting())
+      _body_root = ProfileOptimizer::count_rule(_profile, rule, _body_root);
+  }
+  
+  // Guard dynamic dispatches with a test for their likeliest receiver.
+  Devirtualizer devirtualizer(_profile);
+  _body_root = _body_root->optimize(&devirtualizer);
+  
   // Fix calls up. This includes exception handling
   CallFixer call_fixer(_gen_modnames);
   _body_root = _body_root->optimize(&call_fixer);
   
+  // Explain the calls and exceptions the lowered body still contains.
+  // Remarks are made before the cache lookup, so cached code gets them too.
+  if (_remark_kinds)
+    _body_root->remark_lowering(this);
+  
   Type *return_type = rule->return_type();
   if (return_type == void_type && rule->can_throw()) {
     _body_root = new SemistrictNode
@@ -61,6 +152,41 @@ Compiler::compile(Rule *rule, bool debug_node, bool debug_target,
   _body_root = new UnaryNode(_body_root, opCopy, return_type,
 			     _body_root->betweenliner(), *_body_root);
   _body_root->fix_outline();
+  
+  // A rule whose optimized body matches an earlier rule's, as they can when
+  // modules inherit a rule unchanged, becomes an alias for its function.
+  if (_fold || _fold_keys) {
+    _fold_key.clear();
+    make_fold_key(rule, _body_root, _fold_key);
+  }
+  if (_fold) {
+    int fold = find_fold(_fold_key);
+    if (fold >= 0 && gen_alias(rule, fold)) {
+      Node::restore_states();
+      write_remarks(_remarks);
+      return;
+    }
+  }
+  
+  // Reuse cached code if this rule's optimized body has been compiled
+  // before.
+  Vector<char> cache_key;
+  CompiledRule cached;
+  bool use_cache = _cache && !debug_node && !debug_target && !debug_loc;
+  if (use_cache) {
+    _cache->key(rule, _body_root, cache_key);
+    if (_cache->find(cache_key, cached)) {
+      Node::restore_states();
+      cached.remarks = _remarks;
+      unsigned long bytes = replay(cached);
+      if (_fold)
+	add_fold(_fold_key, rule, bytes);
+      return;
+    }
+  }
+  int old_errors = num_errors;
+  int old_warnings = num_warnings;
+  
   _body_root->gen_prototypes(this);
 #ifdef CHECK_GEN
   _body_root->clear_gen_counts();
@@ -86,6 +212,9 @@ Compiler::compile(Rule *rule, bool debug_node, bool debug_target,
   // No-one can jump directly to block 0, so don't consider it.
   for (int i = 1; i < _blocks.size(); i++)
     _blocks[i]->decide_direct();
+  if (_place_blocks)
+    for (int i = 1; i < _blocks.size(); i++)
+      _blocks[i]->duplicate_tail();
   
   int labelno = 0;
   for (int i = 0; i < _blocks.size(); i++)
@@ -130,8 +259,28 @@ Compiler::compile(Rule *rule, bool debug_node, bool debug_target,
     if (_temporaries[i]->temporary() == exceptid_name)
       _temporaries[i]->change_type(any_type);
   
+  if (use_cache) {
+    cached.text.clear();
+    out.set_capture(&cached.text);
+  }
+  unsigned long first_byte = out.output_bytes();
   rule->gen_prototype(out, false);
   gen();
+  out.set_capture(0);
+  Node::restore_states();
+  if (_fold)
+    add_fold(_fold_key, rule, out.output_bytes() - first_byte);
+  write_remarks(_remarks);
+  for (int i = 0; i < nCompileStats; i++)
+    _stats[i] += _rule_stats[i];
+  
+  if (use_cache && num_errors == old_errors && num_warnings == old_warnings) {
+    cached.prototyped = _prototyped_rules;
+    cached.marked = _marked_rules;
+    cached.line_directives = _line_directives;
+    cached.stats = _rule_stats;
+    _cache->store(cache_key, cached);
+  }
 
 #ifdef CHECK_GEN
   set_error_context("While compiling `%r':", rule);
@@ -152,17 +301,61 @@ Compiler::gen()
   SelfNode::current_self_type = _gen_modnames;
   _blocks[0]->unreach();
   for (int i = 0; i < _blocks.size(); i++)
-    if (!_blocks[i]->reached())
+    if (!_blocks[i]->reached() && !(_place_blocks && i && _blocks[i]->cold()))
       _blocks[i]->gen(this);
+  // Cold blocks go at the end of the function.
+  if (_place_blocks)
+    for (int i = 1; i < _blocks.size(); i++)
+      if (!_blocks[i]->reached() && _blocks[i]->cold())
+	_blocks[i]->gen(this);
   
   out << wmindent(-2) << "}\n";
 }
 
+void
+Compiler::mark_gen(Rule *rule)
+{
+  if (_gen_queue && !rule->need_gen() && !rule->gen_done())
+    _gen_queue->push_back(rule);
+  rule->mark_gen();
+  _marked_rules.push_back(rule);
+}
+
+void
+Compiler::gen_prototype(Rule *rule)
+{
+  if (_gen_queue && !rule->need_gen() && !rule->gen_done())
+    _gen_queue->push_back(rule);
+  rule->mark_gen();
+  rule->gen_prototype(proto_out, true);
+  _prototyped_rules.push_back(rule);
+}
+
+void
+Compiler::gen_output_line()
+{
+  out << wmendl << wmtab(0);
+  _line_directives.push_back(out.output_line() - _first_line);
+  out << "# " << out.output_line() + 1;
+  if (out["filename"])
+    out << " \"" << (const char *)out["filename"] << "\"";
+  out << "\n";
+}
+
+void
+Compiler::set_place_blocks(bool place, int max_copy_cost)
+{
+  _place_blocks = place;
+  BlockLocation::set_placement(place, max_copy_cost);
+}
+
 void
 Compiler::make_rethrow_handler()
 {
   _rethrow_handler =
     exceptid_node()->compile(this, true, 0);
+  if (_place_blocks)
+    _rethrow_handler->make_cold();
 }
 
 void
@@ -183,3 +376,386 @@ Compiler::exception_handler()
     make_rethrow_handler();
   return _rethrow_handler;
 }
+
+
+/*****
+ * parallel compilation
+ **/
+
+// Each worker process gets a contiguous slice of the rules, compiles them
+// with its own copy of the program, and reports the generated text plus the
+// rules it marked or prototyped. Rule pointers are valid in the parent
+// because the worker is a fork()ed copy. The parent replays the results
+// with emit() in the order a serial compile would have used.
+
+void
+Compiler::compile_parallel(const Vector<Rule *> &rules, int njobs,
+			   Vector<CompiledRule> &result)
+{
+#ifdef HAVE_UNISTD_H
+  int per_job = (rules.size() + njobs - 1) / njobs;
+  Vector<int> pids;
+  Vector<FILE *> record_files;
+  Vector<FILE *> text_files;
+  
+  for (int begin = 0; begin < rules.size(); begin += per_job) {
+    int end = begin + per_job;
+    if (end > rules.size())
+      end = rules.size();
+    
+    FILE *rf = tmpfile();
+    FILE *tf = tmpfile();
+    pid_t pid = (rf && tf ? fork() : -1);
+    if (pid == 0) {
+      compile_slice(rules, begin, end, rf, tf);
+      _exit(0);
+    } else if (pid < 0) {
+      // Couldn't start a worker; the rules it would have compiled will be
+      // compiled serially instead.
+      if (rf) fclose(rf);
+      if (tf) fclose(tf);
+      break;
+    }
+    
+    pids.push_back(pid);
+    record_files.push_back(rf);
+    text_files.push_back(tf);
+  }
+  
+  for (int j = 0; j < pids.size(); j++) {
+    int status;
+    if (waitpid(pids[j], &status, 0) == pids[j]
+	&& WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      read_slice(record_files[j], text_files[j], result);
+    fclose(record_files[j]);
+    fclose(text_files[j]);
+  }
+#endif
+}
+
+void
+Compiler::compile_slice(const Vector<Rule *> &rules, int begin, int end,
+			FILE *rf, FILE *tf)
+{
+  FILE *null_f = fopen("/dev/null", "w");
+  if (!null_f)
+    return;
+  
+  Writer text_out(tf);
+  Writer null_out(null_f);
+  Compiler worker(text_out, null_out, _max_inline_level);
+  worker._first_uniqueifier = _first_uniqueifier;
+  worker._cache = _cache;
+  worker._profile = _profile;
+  worker._remark_kinds = _remark_kinds;
+  worker._remark_json = _remark_json;
+  worker._place_blocks = _place_blocks;
+  // Workers only compute fold keys; the parent, which sees every rule in
+  // order, decides what folds.
+  worker._fold_keys = _fold;
+  
+  for (int i = begin; i < end; i++) {
+    Rule *rule = rules[i];
+    int old_errors = num_errors;
+    int old_warnings = num_warnings;
+    long start = ftell(tf);
+    
+    worker._remarks.clear();
+    worker._fold_key.clear();
+    worker.compile(rule);
+    long length = ftell(tf) - start;
+    // The rule's remarks and fold key follow its text.
+    if (worker._remarks.size())
+      fwrite(worker._remarks.begin(), 1, worker._remarks.size(), tf);
+    if (worker._fold_key.size())
+      fwrite(worker._fold_key.begin(), 1, worker._fold_key.size(), tf);
+    
+    fprintf(rf, "%p %ld %d %d %d %d %d %d %d\n", (void *)rule, length,
+	    worker._prototyped_rules.size(), worker._marked_rules.size(),
+	    worker._line_directives.size(), worker._remarks.size(),
+	    worker._fold_key.size(),
+	    num_errors - old_errors, num_warnings - old_warnings);
+    for (int j = 0; j < worker._prototyped_rules.size(); j++)
+      fprintf(rf, "%p\n", (void *)worker._prototyped_rules[j]);
+    for (int j = 0; j < worker._marked_rules.size(); j++)
+      fprintf(rf, "%p\n", (void *)worker._marked_rules[j]);
+    for (int j = 0; j < worker._line_directives.size(); j++)
+      fprintf(rf, "%d\n", worker._line_directives[j]);
+    for (int j = 0; j < nCompileStats; j++)
+      fprintf(rf, "%d\n", worker._rule_stats[j]);
+  }
+  
+  fflush(rf);
+}
+
+void
+Compiler::read_slice(FILE *rf, FILE *tf, Vector<CompiledRule> &result)
+{
+  rewind(rf);
+  rewind(tf);
+  
+  void *p;
+  long length;
+  int nprototyped, nmarked, nlines, nremarks, nfold;
+  CompiledRule cr;
+  while (fscanf(rf, "%p %ld %d %d %d %d %d %d %d", &p, &length, &nprototyped,
+		&nmarked, &nlines, &nremarks, &nfold, &cr.errors,
+		&cr.warnings) == 9) {
+    cr.rule = (Rule *)p;
+    cr.text.resize(length);
+    if (length && fread(cr.text.begin(), 1, length, tf) != (size_t)length)
+      return;
+    cr.remarks.resize(nremarks);
+    if (nremarks
+	&& fread(cr.remarks.begin(), 1, nremarks, tf) != (size_t)nremarks)
+      return;
+    cr.fold_key.resize(nfold);
+    if (nfold && fread(cr.fold_key.begin(), 1, nfold, tf) != (size_t)nfold)
+      return;
+    
+    cr.prototyped.clear();
+    for (int i = 0; i < nprototyped && fscanf(rf, "%p", &p) == 1; i++)
+      cr.prototyped.push_back((Rule *)p);
+    cr.marked.clear();
+    for (int i = 0; i < nmarked && fscanf(rf, "%p", &p) == 1; i++)
+      cr.marked.push_back((Rule *)p);
+    cr.line_directives.clear();
+    int line;
+    for (int i = 0; i < nlines && fscanf(rf, "%d", &line) == 1; i++)
+      cr.line_directives.push_back(line);
+    cr.stats.assign(nCompileStats, 0);
+    for (int i = 0; i < nCompileStats && fscanf(rf, "%d", &line) == 1; i++)
+      cr.stats[i] = line;
+    
+    result.push_back(cr);
+  }
+}
+
+void
+Compiler::emit(const CompiledRule &cr)
+{
+  if (!cr.rule->gen_if())
+    return;
+  int fold = (_fold ? find_fold(cr.fold_key) : -1);
+  if (fold >= 0 && gen_alias(cr.rule, fold)) {
+    // The worker compiled the rule, but an earlier rule's function will do.
+    for (int i = 0; i < cr.marked.size(); i++)
+      mark_gen(cr.marked[i]);
+    write_remarks(cr.remarks);
+    num_errors += cr.errors;
+    num_warnings += cr.warnings;
+  } else {
+    unsigned long bytes = replay(cr);
+    if (_fold)
+      add_fold(cr.fold_key, cr.rule, bytes);
+  }
+  count_pass_rule();
+}
+
+// Returns the number of bytes the rule's function took.
+unsigned long
+Compiler::replay(const CompiledRule &cr)
+{
+  for (int i = 0; i < cr.prototyped.size(); i++)
+    gen_prototype(cr.prototyped[i]);
+  
+  // Copy the text, regenerating line directives that refer to the output
+  // file, since the worker didn't know where in the file its text would go.
+  _line_directives.clear();
+  _first_line = out.output_line();
+  unsigned long first_byte = out.output_bytes();
+  const char *s = cr.text.begin();
+  const char *end = cr.text.end();
+  int line = 0;
+  int directive = 0;
+  while (s < end) {
+    const char *nl = (const char *)memchr(s, '\n', end - s);
+    const char *next = (nl ? nl + 1 : end);
+    if (directive < cr.line_directives.size()
+	&& cr.line_directives[directive] == line) {
+      gen_output_line();
+      directive++;
+    } else
+      out.write(s, next - s);
+    s = next;
+    line++;
+  }
+  unsigned long bytes = out.output_bytes() - first_byte;
+  
+  for (int i = 0; i < cr.marked.size(); i++)
+    mark_gen(cr.marked[i]);
+  write_remarks(cr.remarks);
+  _rule_stats = cr.stats;
+  for (int i = 0; i < cr.stats.size(); i++)
+    _stats[i] += cr.stats[i];
+  num_errors += cr.errors;
+  num_warnings += cr.warnings;
+  return bytes;
+}
+
+
+/*****
+ * identical-code folding
+ **/
+
+// Returns the index of the earlier rule with fold key `key', or -1.
+int
+Compiler::find_fold(const Vector<char> &key) const
+{
+  if (!key.size())
+    return -1;
+  return _fold_index[PermString(key.begin(), key.size())];
+}
+
+// Records `rule', whose function took `bytes' bytes, as the function for
+// fold key `key'. Only the part after the prototype is kept, since an alias
+// repeats the prototype.
+void
+Compiler::add_fold(const Vector<char> &key, Rule *rule, unsigned long bytes)
+{
+  if (!key.size() || find_fold(key) >= 0)
+    return;
+  Writer proto(0);
+  rule->gen_prototype(proto, false);
+  _fold_index.insert(PermString(key.begin(), key.size()), _fold_rules.size());
+  _fold_rules.push_back(rule);
+  _fold_bytes.push_back(bytes - proto.output_bytes());
+}
+
+// Declares `rule' as an alias for the function generated for fold `fold', if
+// the alias is smaller than the function body it replaces. Returns true if
+// it did.
+bool
+Compiler::gen_alias(Rule *rule, int fold)
+{
+  static const char alias_begin[] = "PROLAC_ALIAS_BEGIN\n";
+  Vector<char> alias;
+  Writer w(0);
+  w.set_capture(&alias);
+  w << "  PROLAC_ALIAS(";
+  _fold_rules[fold]->gen_name(w);
+  w << ");\nPROLAC_ALIAS_END\n";
+  unsigned long alias_bytes = w.output_bytes() + sizeof(alias_begin) - 1;
+  if (alias_bytes >= _fold_bytes[fold])
+    return false;
+  
+  out << alias_begin;
+  rule->gen_prototype(out, false);
+  out.write(alias.begin(), alias.size());
+  _folded_rules++;
+  _folded_bytes += _fold_bytes[fold] - alias_bytes;
+  return true;
+}
+
+
+/*****
+ * optimization remarks
+ **/
+
+static const char * const remark_kind_names[] = {
+  "inline", "no-inline", "outline", "tail-call", "devirtualize", "fold",
+  "exception", "specialize"
+};
+
+// Returns the set of remark kinds named in a comma-separated list, where
+// `all' names every kind, or -1 if the list is bad.
+int
+Compiler::parse_remark_kinds(const char *s)
+{
+  int kinds = 0;
+  while (*s) {
+    const char *comma = strchr(s, ',');
+    int len = (comma ? comma - s : strlen(s));
+    if (len == 3 && memcmp(s, "all", 3) == 0)
+      kinds |= (1 << nRemarkKinds) - 1;
+    else {
+      int k = 0;
+      while (k < nRemarkKinds
+	     && (strlen(remark_kind_names[k]) != (size_t)len
+		 || memcmp(s, remark_kind_names[k], len) != 0))
+	k++;
+      if (k == nRemarkKinds)
+	return -1;
+      kinds |= 1 << k;
+    }
+    s += len;
+    if (*s)
+      s++;
+  }
+  return (kinds ? kinds : -1);
+}
+
+void
+Compiler::set_remarks(int kinds, bool json, Writer *w)
+{
+  _remark_kinds = kinds;
+  _remark_json = json;
+  _remark_out = w;
+}
+
+static void
+write_json_string(Writer &w, const char *s)
+{
+  w << '"';
+  for (; *s; s++)
+    if (*s == '"' || *s == '\\')
+      w << '\\' << *s;
+    else if ((unsigned char)*s < ' ') {
+      char buf[8];
+      sprintf(buf, "\\u%04x", *s);
+      w << buf;
+    } else
+      w << *s;
+  w << '"';
+}
+
+static void
+write_json_rule(Writer &w, const Rule *rule)
+{
+  Writer name_w(0);
+  name_w << rule;
+  char *name = name_w.steal_buf();
+  write_json_string(w, name);
+  delete[] name;
+}
+
+// Records a remark about the rule being compiled. `where' is the site the
+// remark is about, which may be in a rule inlined into this one; `callee' is
+// the rule called there, if any.
+void
+Compiler::remark(RemarkKind kind, const Landmark &where, Rule *callee,
+		 const char *message)
+{
+  if (!remarking(kind))
+    return;
+  
+  Writer w(0);
+  w.set_capture(&_remarks);
+  if (_remark_json) {
+    w << "{\"kind\": \"" << remark_kind_names[kind] << "\", \"rule\": ";
+    write_json_rule(w, _rule);
+    w << ", \"file\": ";
+    write_json_string(w, where.file().c_str());
+    w << ", \"line\": " << where.line() << ", \"callee\": ";
+    if (callee)
+      write_json_rule(w, callee);
+    else
+      w << "null";
+    w << ", \"message\": ";
+    write_json_string(w, message);
+    w << "}\n";
+  } else {
+    w << where << "remark: [" << remark_kind_names[kind] << "] " << _rule
+      << ": ";
+    if (callee)
+      w << "`" << callee << "': ";
+    w << message << "\n";
+  }
+}
+
+void
+Compiler::write_remarks(const Vector<char> &remarks)
+{
+  if (_remark_out && remarks.size())
+    _remark_out->write(remarks.begin(), remarks.size());
+}
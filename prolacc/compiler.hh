@@ -2,27 +2,114 @@
 #define COMPILER_HH
 #include "writer.hh"
 #include <lcdf/vector.hh>
+#include <lcdf/hashmap.hh>
 #include "rule.hh"
+#include <cstdio>
 class Target;
 class BlockLocation;
 class ModuleNames;
 class Node;
 class Rule;
+class CompileCache;
+class Profile;
+class Landmark;
+
+
+// Decisions made while compiling are counted for reports. A rule's counts
+// travel with its code through worker processes and the cache.
+enum CompileStat {
+  statDispatchResolved = 0,
+  statDispatchGuarded,
+  statDispatchIndirect,
+  nCompileStats
+};
+
+
+// Optimization remarks explain why the compiler made each decision. They
+// are collected per rule and, like the rule's code, printed in serial order.
+enum RemarkKind {
+  remarkInline = 0,
+  remarkNoInline,
+  remarkOutline,
+  remarkTailCall,
+  remarkDevirtualize,
+  remarkFold,
+  remarkException,
+  remarkSpecialize,
+  nRemarkKinds
+};
+
+
+struct CompiledRule {
+  
+  Rule *rule;
+  Vector<char> text;
+  Vector<Rule *> prototyped;
+  Vector<Rule *> marked;
+  Vector<int> line_directives;
+  Vector<int> stats;
+  Vector<char> remarks;
+  Vector<char> fold_key;
+  int errors;
+  int warnings;
+  
+};
 
 
 class Compiler {
 
   int _max_inline_level;
+  int _first_uniqueifier;
+  CompileCache *_cache;
+  Profile *_profile;
+  
+  int _rule_arenas;
+  size_t _rule_arena_bytes;
+  size_t _max_rule_arena_bytes;
+  
+  Vector<int> _rule_stats;
+  Vector<unsigned long> _stats;
+  
+  int _remark_kinds;
+  bool _remark_json;
+  Writer *_remark_out;
+  Rule *_rule;
+  Vector<char> _remarks;
+  
+  // Identical-code folding. Rules whose optimized bodies have the same fold
+  // key generate the same C, so all but the first become aliases.
+  bool _fold;
+  bool _fold_keys;
+  Vector<char> _fold_key;
+  HashMap<PermString, int> _fold_index;
+  Vector<Rule *> _fold_rules;
+  Vector<unsigned long> _fold_bytes;
+  int _folded_rules;
+  unsigned long _folded_bytes;
+  
+  bool _place_blocks;
   
   Node *_body_root;
   ModuleNames *_gen_modnames;
   Vector<BlockLocation *> _blocks;
   Vector<Node *> _temporaries;
   Vector<Rule *> _marked_rules;
+  Vector<Rule *> _prototyped_rules;
+  Vector<Rule *> *_gen_queue;
+  Vector<int> _line_directives;
+  unsigned _first_line;
   Target *_exception_handler;
   Target *_rethrow_handler;
 
   void make_rethrow_handler();
+  void compile_body(Rule *, bool, bool, bool);
+  void compile_slice(const Vector<Rule *> &, int, int, FILE *, FILE *);
+  static void read_slice(FILE *, FILE *, Vector<CompiledRule> &);
+  unsigned long replay(const CompiledRule &);
+  void write_remarks(const Vector<char> &);
+  int find_fold(const Vector<char> &) const;
+  void add_fold(const Vector<char> &, Rule *, unsigned long);
+  bool gen_alias(Rule *, int);
   
  public:
   
@@ -31,8 +118,42 @@ class Compiler {
   
   Compiler(Writer &, Writer &, int max_inline_level = inlinePath);
   
+  CompileCache *cache() const			{ return _cache; }
+  void set_cache(CompileCache *cache)		{ _cache = cache; }
+  Profile *profile() const			{ return _profile; }
+  void set_profile(Profile *profile)		{ _profile = profile; }
+  
+  int rule_arenas() const			{ return _rule_arenas; }
+  size_t rule_arena_bytes() const		{ return _rule_arena_bytes; }
+  size_t max_rule_arena_bytes() const		{ return _max_rule_arena_bytes; }
+  
+  void count_stat(CompileStat s)		{ _rule_stats[s]++; }
+  unsigned long stat(CompileStat s) const	{ return _stats[s]; }
+  
+  static int parse_remark_kinds(const char *);
+  void set_remarks(int kinds, bool json, Writer *);
+  bool remarking(RemarkKind k) const	{ return _remark_kinds & (1 << k); }
+  void remark(RemarkKind, const Landmark &, Rule *, const char *);
+  
+  void set_fold(bool fold)			{ _fold = fold; }
+  int folded_rules() const			{ return _folded_rules; }
+  unsigned long folded_bytes() const		{ return _folded_bytes; }
+  
+  bool placing_blocks() const			{ return _place_blocks; }
+  void set_place_blocks(bool, int max_copy_cost);
+  
   void compile(Rule *, bool debug_node = 0, bool debug_target = 0,
 	       bool debug_loc = 0);
+  void compile_parallel(const Vector<Rule *> &, int njobs,
+			Vector<CompiledRule> &);
+  void emit(const CompiledRule &);
+  
+  void mark_gen(Rule *);
+  void gen_prototype(Rule *);
+  void gen_output_line();
+  
+  // Rules first marked for generation are appended to the queue.
+  void set_gen_queue(Vector<Rule *> *q)		{ _gen_queue = q; }
   
   void add_block(BlockLocation *b)		{ _blocks.push_back(b); }
 
@@ -24,6 +24,18 @@ PermString constructor_string = "constructor";
  * your favorite constructors
  **/
 
+// A branching expression takes its landmark from its leftmost operand, so
+// several can share a line and even a landmark. Each gets the next branch
+// number on its line, in the order the parser builds them.
+void
+Expr::number_branch()
+{
+  static HashMap<PermString, int> last_branch(0);
+  int &b = last_branch.find_force
+    (permprintf("%p:%d", _landmark.file().capsule(), _landmark.line()));
+  _landmark = _landmark.with_branch(++b);
+}
+
 LetExpr::LetExpr(Expr *params, Expr *body)
   : Expr(*params), _params(params), _body(body)
 {
@@ -32,12 +44,16 @@ LetExpr::LetExpr(Expr *params, Expr *body)
 BinaryExpr::BinaryExpr(Expr *left, Operator op, Expr *right, Expr *opt)
   : Expr(*left), _op(op), _left(left), _right(right), _optional(opt)
 {
+  if (op == opLogAnd || op == opLogOr || op == opArrow
+      || op == opMinAssign || op == opMaxAssign)
+    number_branch();
 }
 
 
 FunctionishExpr::FunctionishExpr(Operator op, ListExpr *l)
   : Expr(*l), _op(op), _args(l)
 {
+  number_branch();
 }
 
 
@@ -60,6 +76,7 @@ UnaryExpr::UnaryExpr(Operator op, Expr *left, Expr *opt)
 ConditionalExpr::ConditionalExpr(Expr *t, Expr *y, Expr *n)
   : Expr(*t), _test(t), _yes(y), _no(n)
 {
+  number_branch();
 }
 
 CodeExpr::CodeExpr(CodeBlock *code)
@@ -1356,6 +1373,29 @@ UnaryExpr::resolve(ModuleNames *m, Namespace *ns, ResolveArgs res) const
      return l;
    }
    
+   case opLikely:
+   case opUnlikely: {
+     // Branches compare their arms' expectations with their own; see
+     // Node::arm_expect.
+     Betweenliner old = Node::cur_betweenliner;
+     Node::cur_betweenliner = old.expecting(_op == opLikely ? 1 : -1);
+     
+     l = _left->resolve(m, ns, res.clear());
+     
+     Node::cur_betweenliner = old;
+     return l;
+   }
+   
+   case opPure: {
+     // `pure {C}' promises the code block changes nothing the program can
+     // see, so values computed before it can be reused after it.
+     if (CodeNode *code = l->cast_code())
+       code->set_pure();
+     else
+       error(*this, "`pure' must be followed by a code block");
+     return l;
+   }
+   
    case opDeref: {
      if (l->simple_type()) {
        // This is the definition of a type `ptr-to X'.
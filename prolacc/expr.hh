@@ -4,6 +4,7 @@
 #include "literal.hh"
 #include "operator.hh"
 #include "resolvarg.hh"
+#include "arena.hh"
 class IdentExpr;
 class BinaryExpr;
 class ConditionalExpr;
@@ -25,10 +26,16 @@ class Expr {
   
   Landmark _landmark;
   
+ protected:
+  
+  void number_branch();
+  
  public:
   
   Expr(const Landmark &l)		: _landmark(l) { }
   virtual ~Expr()			{ }
+  void *operator new(size_t size)	{ return Arena::allocate_current(size); }
+  void operator delete(void *)		{ }
   
   operator const Landmark &() const	{ return _landmark; }
   const Landmark &landmark() const	{ return _landmark; }
@@ -13,7 +13,8 @@ Field::Field(FieldKind fk, PermString bn, PermString gn, ModuleID origin,
 	     Type *type, bool is_static, const Landmark &landmark)
   : Feature(bn, origin, landmark),
     _kind(fk), _gen_name(gn),
-    _type(type), _is_static(is_static), _offset(-1)
+    _type(type), _is_static(is_static), _pinned(false), _offset(-1),
+    _accesses(0), _access_group(-1), _access_group_weight(0)
 {
 }
 
@@ -56,6 +57,18 @@ Field *Field::the_no_field =
 new Field(fkNothing, PermString(), PermString(), 0, 0, false, Landmark());
 
 
+void
+Field::count_access(int group, unsigned long weight)
+{
+  _accesses += weight;
+  if (_access_group < 0 || weight > _access_group_weight
+      || (weight == _access_group_weight && group < _access_group)) {
+    _access_group = group;
+    _access_group_weight = weight;
+  }
+}
+
+
 PermString
 Field::description() const
 {
@@ -19,8 +19,13 @@ class Field : public Feature {
   
   Type *_type;
   bool _is_static;
+  bool _pinned;
   int _offset;
   
+  unsigned long _accesses;
+  int _access_group;
+  unsigned long _access_group_weight;
+  
   static Field *the_no_field;
   
   Field(FieldKind, PermString, PermString, ModuleID,
@@ -58,9 +63,18 @@ class Field : public Feature {
   int size() const			{ return _type->size(); }
   int align() const			{ return _type->align(); }
   int offset() const			{ return _offset; }
+  bool pinned() const			{ return _pinned; }
   
   void set_type(Type *t)		{ _type = t; }
   void set_offset(int o)		{ _offset = o; }
+  void pin_offset(int o)		{ _offset = o; _pinned = true; }
+  
+  // Accesses are counted for --layout=hot. A field's group is the heaviest
+  // rule that touches it.
+  unsigned long accesses() const	{ return _accesses; }
+  int access_group() const		{ return _access_group; }
+  unsigned long access_group_weight() const { return _access_group_weight; }
+  void count_access(int group, unsigned long weight);
   
   void write(Writer &) const;
   
@@ -23,13 +23,35 @@ Jumper::destroy()
 int
 Jumper::can_direct(int) const
 {
-  return (_outline_edge >= 5 ? -1 : 11) - _takeoff->outline_level();
+  // Among jumpers that could land directly, prefer ones that are not
+  // unlikely to be taken.
+  int score = (_outline_edge >= 5 ? -1 : 11) - _takeoff->outline_level();
+  if (_expect < 0 && score > 1)
+    score--;
+  
+  // When placing blocks, hot code falls into a cold block only if the block
+  // is cheap enough to copy, and a block is preferably entered directly from
+  // hot code along a likely edge.
+  if (BlockLocation::placing_blocks()) {
+    if (_landing->cold() && !_takeoff->cold()
+	&& _landing->copy_cost() > BlockLocation::max_tail_copy_cost())
+      return 0;
+    if (_expect > 0)
+      score++;
+    if (_takeoff->cold() && score > 1)
+      score--;
+  }
+  return score;
 }
 
 int
 Jumper::can_direct_copy(int) const
 {
-  return can_direct() > 0 && _landing->enter_count() <= 1;
+  // Landing blocks with other entrances must be copied, which is limited by
+  // their size.
+  return can_direct() > 0
+    && (_landing->enter_count() <= 1
+	|| _landing->copy_cost() <= BlockLocation::max_tail_copy_cost());
 }
 
 
@@ -77,6 +99,8 @@ Jumper::print()
     _landing->enter_count();
   if (_outline_edge >= 0)
     errwriter << "  out[" << _outline_edge << "]";
+  if (_expect)
+    errwriter << (_expect > 0 ? "  likely" : "  unlikely");
   errwriter << wmendl;
 }
 
@@ -39,16 +39,20 @@ class Jumper {
   BlockLocation *_landing;
   bool _direct;
   int _outline_edge;
+  int _expect;
   
   void redirect(BlockLocation *);
   
  public:
   
-  Jumper(BlockLocation *, BlockLocation *, int);
+  Jumper(BlockLocation *, BlockLocation *, int, int = 0);
+  void *operator new(size_t size)	{ return Arena::allocate_current(size); }
+  void operator delete(void *)		{ }
   void destroy();
   
   BlockLocation *landing() const	{ return _landing; }
   bool direct() const			{ return _direct; }
+  int expect() const			{ return _expect; }
   bool forced_goto() const		{ return !_direct; }
   
   void make_direct()			{ _direct = 1; }
@@ -76,8 +80,10 @@ Fork::must_gen_state() const
 }
 
 inline
-Jumper::Jumper(BlockLocation *from, BlockLocation *to, int outline_edge)
-  : _takeoff(from), _landing(to), _direct(0), _outline_edge(outline_edge)
+Jumper::Jumper(BlockLocation *from, BlockLocation *to, int outline_edge,
+	       int expect)
+  : _takeoff(from), _landing(to), _direct(0), _outline_edge(outline_edge),
+    _expect(expect)
 {
   to->add_enter(this);
 }
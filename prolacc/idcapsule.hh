@@ -78,4 +78,12 @@ operator!=(IDCapsule<C> c1, const C* c2)
   return c1._c != c2;
 }
 
+// Without this, IDCapsules would hash through operator bool, all to 1.
+template <class C>
+inline unsigned
+hashcode(IDCapsule<C> c)
+{
+  return c.hashcode();
+}
+
 #endif
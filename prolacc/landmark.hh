@@ -7,21 +7,35 @@ class Landmark {
   
   PermString _file;
   unsigned _line;
+  unsigned _branch;
   
  public:
 
-  Landmark()				: _file("<none>"), _line(0) { }
-  Landmark(PermString f, unsigned l)	: _file(f), _line(l) { }
+  Landmark()				: _file("<none>"), _line(0), _branch(0) { }
+  Landmark(PermString f, unsigned l)	: _file(f), _line(l), _branch(0) { }
 
   operator bool() const			{ return _line > 0; }
   
   PermString file() const		{ return _file; }
   unsigned line() const			{ return _line; }
   
+  // Branches on a line are numbered from 1, so profile counts can tell them
+  // apart. Other landmarks have branch 0.
+  unsigned branch() const		{ return _branch; }
+  Landmark with_branch(unsigned) const;
+  
   Landmark nextline() const		{ return Landmark(_file, _line + 1); }
   
   friend Writer &operator<<(Writer &, const Landmark &);
   
 };
 
+inline Landmark
+Landmark::with_branch(unsigned b) const
+{
+  Landmark l(*this);
+  l._branch = b;
+  return l;
+}
+
 #endif
@@ -48,6 +48,19 @@ Literal::operator bool() const
 }
 
 
+bool
+Literal::integer_value(long &l) const
+{
+  if (_is == Is_l)
+    l = _v.l;
+  else if (_is == Is_ul && (long)_v.ul >= 0)
+    l = (long)_v.ul;
+  else
+    return false;
+  return true;
+}
+
+
 void
 Literal::gen(Writer &w) const
 {
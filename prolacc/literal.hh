@@ -51,6 +51,7 @@ class Literal {
   Node *vnode() const		{ assert(_is == Is_node); return _v.node; }
   
   operator bool() const;
+  bool integer_value(long &) const;
   
   void gen(Writer &) const;
   
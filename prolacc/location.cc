@@ -4,15 +4,19 @@
 #include "location.hh"
 #include "fork.hh"
 #include "compiler.hh"
+#include <climits>
 
 
 int BlockLocation::last_id;
+bool BlockLocation::placing;
+int BlockLocation::max_copy_cost;
 
 
 BlockLocation::BlockLocation(Betweenliner b, int target_id, PermString label)
   : _id(++last_id), _label(label),
     _target_id(target_id),
     _reached(0), _did_better_logical(false), _have_label(false),
+    _cold(false),
     _exit_yes(0), _exit_no(0),
     _betweenliner(b)
 {
@@ -20,6 +24,17 @@ BlockLocation::BlockLocation(Betweenliner b, int target_id, PermString label)
 }
 
 
+// Block placement keeps cold blocks out of the hot path and puts them at the
+// end of the function. Blocks that return and cost at most `max_copy_cost'
+// are copied into the blocks that jump to them.
+void
+BlockLocation::set_placement(bool p, int max_cost)
+{
+  placing = p;
+  max_copy_cost = max_cost;
+}
+
+
 void
 BlockLocation::destroy()
 {
@@ -85,11 +100,36 @@ BlockLocation::remove_enter(Jumper *deleter)
 }
 
 
+// Returns the cost of copying this block, which is the number of
+// expressions in it, or INT_MAX if it can't be copied. Only blocks that
+// return, and need no state code, can be.
+int
+BlockLocation::copy_cost() const
+{
+  if (_exit_yes || _exit_no)
+    return INT_MAX;
+  for (int i = 0; i < _locs.size(); i++) {
+    Fork *fork = _locs[i]->cast_fork();
+    if (!fork || fork->must_gen_state())
+      return INT_MAX;
+  }
+  return _locs.size();
+}
+
 BlockLocation *
 BlockLocation::copy()
 {
-  assert(_enters.size() == 1);
-  return this;
+  if (_enters.size() == 1)
+    return this;
+  
+  assert(copy_cost() <= max_copy_cost);
+  BlockLocation *b = new BlockLocation(_betweenliner, _target_id, _label);
+  for (int i = 0; i < _locs.size(); i++) {
+    Fork *fork = _locs[i]->cast_fork();
+    b->append(new Fork(fork->node(), fork->gen_code(), fork->value_used()));
+  }
+  b->_cold = _cold;
+  return b;
 }
 
 
@@ -111,11 +151,11 @@ BlockLocation::make_jump(BlockLocation *l)
 }
 
 void
-BlockLocation::make_branch(BlockLocation *yes, BlockLocation *no)
+BlockLocation::make_branch(BlockLocation *yes, BlockLocation *no, int expect)
 {
   assert(!_exit_yes);
-  _exit_yes = new Jumper(this, yes, calc_outline_edge(this, yes));
-  _exit_no = new Jumper(this, no, calc_outline_edge(this, no));
+  _exit_yes = new Jumper(this, yes, calc_outline_edge(this, yes), expect);
+  _exit_no = new Jumper(this, no, calc_outline_edge(this, no), -expect);
 }
 
 void
@@ -216,6 +256,28 @@ BlockLocation::decide_direct()
 }
 
 
+// Replaces gotos to this block with copies of it, if it's cheap enough to
+// copy. A block no-one enters directly keeps one goto, so it's still
+// generated once.
+void
+BlockLocation::duplicate_tail()
+{
+  if (copy_cost() > max_copy_cost)
+    return;
+  
+  Vector<Jumper *> enters = _enters;
+  for (int i = 0; i < enters.size(); i++) {
+    Jumper *j = enters[i];
+    if (j->direct() || j->can_direct_copy() <= 0)
+      continue;
+    if (!reached() && _enters.size() == 1)
+      break;
+    j->make_direct_copy();
+    j->make_direct();
+  }
+}
+
+
 bool
 BlockLocation::need_label() const
 {
@@ -269,6 +331,129 @@ BlockLocation::make_temporaries()
 }
 
 
+/*****
+ * switches
+ **/
+
+// A chain of blocks that test one integer variable against constants, each
+// test's failure leading straight to the next test, is generated as a C
+// `switch'. That lets the C compiler dispatch with a jump table.
+
+static const int min_switch_arms = 3;
+
+static VariableNode *
+switch_variable(Node *n)
+{
+  // The first test might also set the variable, as in `(x = ..., x)'.
+  while (CastNode *cast = n->cast_cast())
+    n = cast->child();
+  SemistrictNode *ss = n->cast_semistrict();
+  if (ss && ss->op() == ',')
+    n = ss->right();
+  return n->cast_variable();
+}
+
+static bool
+same_switch_value(Node *a, Node *b)
+{
+  return a->type() == b->type()
+    && switch_variable(a)->temporary() == switch_variable(b)->temporary();
+}
+
+static bool
+grep_switch_cases(Location *loc, Node *&value, Vector<long> &cases)
+{
+  if (LogicalLocation *logical = loc->cast_logical())
+    return !logical->isand()
+      && grep_switch_cases(logical->left(), value, cases)
+      && grep_switch_cases(logical->right(), value, cases);
+  
+  if (BlockLocation *block = loc->cast_block())
+    return !block->must_gen_state()
+      && grep_switch_cases(block->back(), value, cases);
+  
+  Fork *fork = loc->cast_fork();
+  TestNode *test = (fork ? fork->node()->cast_test() : 0);
+  if (!test)
+    return false;
+  Node *n = test->test();
+  while (n->cast_cast() && n->type() == bool_type)
+    n = n->cast_cast()->child();
+  BinaryNode *compare = n->cast_binary();
+  if (!compare || compare->op() != opEq)
+    return false;
+  
+  LiteralNode *literal = compare->right()->cast_literal();
+  Node *v = compare->left();
+  if (!literal) {
+    literal = compare->left()->cast_literal();
+    v = compare->right();
+  }
+  long k;
+  // Case labels convert to the promoted type of the switch value, so stay
+  // within `int' to keep the comparison's meaning.
+  if (!literal || !literal->literal().integer_value(k)
+      || k > INT_MAX || k < INT_MIN || !v->type()->cast_arithmetic()
+      || v->type() == bool_type
+      || v->type()->size() > int_type->size() || !switch_variable(v))
+    return false;
+  if (value && !same_switch_value(value, v))
+    return false;
+  
+  for (int i = 0; i < cases.size(); i++)
+    if (cases[i] == k)
+      return false;
+  value = v;
+  cases.push_back(k);
+  return true;
+}
+
+bool
+BlockLocation::gen_switch(Compiler *c)
+{
+  Node *value = 0;
+  Vector<long> cases;
+  if (!grep_switch_cases(back(), value, cases))
+    return false;
+  
+  Vector<Jumper *> arms;
+  Vector<int> arm_cases;
+  arms.push_back(_exit_yes);
+  arm_cases.push_back(cases.size());
+  
+  // Later tests must run nothing else, and only after the previous test.
+  Jumper *rest = _exit_no;
+  while (rest->direct()) {
+    BlockLocation *next = rest->landing();
+    int ncases = cases.size();
+    if (next->enter_count() != 1 || !next->brancher() || next->_have_label
+	|| next->must_gen_state()
+	|| !grep_switch_cases(next->back(), value, cases)) {
+      cases.resize(ncases);
+      break;
+    }
+    arms.push_back(next->_exit_yes);
+    arm_cases.push_back(cases.size());
+    rest = next->_exit_no;
+  }
+  if (arms.size() < min_switch_arms)
+    return false;
+  
+  c->out << "switch (" << wmindent(4);
+  value->gen_value(c);
+  c->out << ") {\n" << wmindent(-2);
+  for (int i = 0, k = 0; i < arms.size(); i++) {
+    for (; k < arm_cases[i]; k++)
+      c->out << wmhang(1) << "case " << cases[k] << ":\n";
+    arms[i]->gen(c);
+  }
+  c->out << wmhang(1) << "default:\n";
+  rest->gen(c);
+  c->out << wmindent(-2) << "}\n";
+  return true;
+}
+
+
 /*****
  * gen
  **/
@@ -276,8 +461,11 @@ BlockLocation::make_temporaries()
 void
 BlockLocation::gen(Compiler *c)
 {
+  // Outlined code is usually entered by goto. Its label tells the C
+  // compiler to move it out of the hot part of the function.
   if (_have_label)
-    c->out << wmhang(1) << _label << ":\n";
+    c->out << wmhang(1) << _label
+	   << (_betweenliner.cold() ? ": PROLAC_COLD_LABEL;\n" : ":\n");
   
   int last_val = _locs.size() - 1;
   for (int i = 0; i < last_val; i++) {
@@ -287,13 +475,23 @@ BlockLocation::gen(Compiler *c)
   
   back()->gen_state(c);
   
-  if (_exit_no) {
+  if (_exit_no && gen_switch(c))
+    /* generated as a switch */;
+  else if (_exit_no) {
     assert(_exit_yes);
     
+    // Put a direct exit after the `if', so it falls through; when both are
+    // direct, put the likely one first. Expected branches are marked for
+    // the C compiler with __builtin_expect.
     Jumper *yes;
     Jumper *no;
+    bool swap = (_exit_yes->direct() && !_exit_no->direct())
+      || (_exit_yes->direct() && _exit_yes->expect() < 0);
+    int expect = (swap ? _exit_no->expect() : _exit_yes->expect());
     c->out << "if (" << wmindent(4);
-    if (_exit_yes->direct() && !_exit_no->direct()) {
+    if (expect)
+      c->out << "__builtin_expect(";
+    if (swap) {
       yes = _exit_no;
       no = _exit_yes;
       
@@ -305,8 +503,14 @@ BlockLocation::gen(Compiler *c)
       yes = _exit_yes;
       no = _exit_no;
       
+      if (expect)
+	c->out << "!!(";
       back()->gen_value(c);
+      if (expect)
+	c->out << ")";
     }
+    if (expect)
+      c->out << ", " << (expect > 0 ? 1 : 0) << ")";
     
     c->out << ") {\n" << wmindent(-2);
     yes->gen(c);
@@ -372,6 +576,8 @@ BlockLocation::print()
   errwriter << wmwidth(4) << _id << wmtab(8);
   if (_have_label)
     errwriter << _label << " ";
+  if (_cold)
+    errwriter << "cold ";
   if (_enters.size() > 1)
     errwriter << "ent[" << _enters.size() << "] ";
   if (outline_level() != -1)
@@ -2,6 +2,7 @@
 #define LOCATION_HH
 #include "node.hh"
 class BlockLocation;
+class LogicalLocation;
 class Fork;
 class Jumper;
 
@@ -14,6 +15,8 @@ class Location {
   
   Location()					: _collected(0) { }
   virtual ~Location()				{ }
+  void *operator new(size_t size)	{ return Arena::allocate_current(size); }
+  void operator delete(void *)		{ }
   virtual void destroy()			{ assert(0); }
   
   virtual bool must_gen_state() const		{ return true; }
@@ -31,6 +34,8 @@ class Location {
   virtual void print()				{ }
 
   virtual Fork *cast_fork()			{ return 0; }
+  virtual BlockLocation *cast_block()		{ return 0; }
+  virtual LogicalLocation *cast_logical()	{ return 0; }
   
 };
 
@@ -44,6 +49,7 @@ class BlockLocation: public Location {
   bool _reached;
   bool _did_better_logical: 1;
   bool _have_label: 1;
+  bool _cold: 1;
   
   Vector<Location *> _locs;
   Jumper *_exit_yes;
@@ -54,20 +60,30 @@ class BlockLocation: public Location {
   Vector<Jumper *> _enters;
   
   static int last_id;
+  static bool placing;
+  static int max_copy_cost;
   
   Jumper *maybe(bool isyes) const	{ return isyes?_exit_yes:_exit_no; }
   
   bool try_better_logical(bool);
+  bool gen_switch(Compiler *);
   
  public:
   
   BlockLocation(Betweenliner, int target_id, PermString label_name);
   void destroy();
   
+  static bool placing_blocks()		{ return placing; }
+  static int max_tail_copy_cost()	{ return max_copy_cost; }
+  static void set_placement(bool, int max_copy_cost);
+  
   bool reached() const			{ return _reached; }
   void reach()				{ _reached = true; }
   void unreach()			{ _reached = false; }
   
+  bool cold() const			{ return _cold || _betweenliner.cold(); }
+  void make_cold()			{ _cold = true; }
+  
   int id() const			{ return _id; }
   PermString label() const		{ return _label; }
   int target_id() const			{ return _target_id; }
@@ -90,18 +106,20 @@ class BlockLocation: public Location {
   Jumper *exit_no() const		{ return _exit_no; }
   
   void make_jump(BlockLocation *l);
-  void make_branch(BlockLocation *y, BlockLocation *n);
+  void make_branch(BlockLocation *y, BlockLocation *n, int expect = 0);
   void make_no_exit();
   
   bool must_gen_state() const;
   int outline_epoch() const;
   int outline_level() const;
   
+  int copy_cost() const;
   BlockLocation *copy();
   
   void better_logical();
   
   void decide_direct();
+  void duplicate_tail();
   bool need_label() const;
   void set_label(int);
   
@@ -113,6 +131,8 @@ class BlockLocation: public Location {
   
   void print();
   
+  BlockLocation *cast_block()		{ return this; }
+  
 };
 
 
@@ -126,6 +146,10 @@ class LogicalLocation: public Location {
   
   LogicalLocation(bool, Location *, Location *);
 
+  bool isand() const				{ return _isand; }
+  Location *left() const			{ return _left; }
+  Location *right() const			{ return _right; }
+  
   bool must_gen_state() const			{ return false; }
   
   void grep_forks(Vector<Fork *> &) const;
@@ -134,6 +158,8 @@ class LogicalLocation: public Location {
   
   void print();
   
+  LogicalLocation *cast_logical()		{ return this; }
+  
 };
 
 
@@ -8,10 +8,15 @@
 #include "expr.hh"
 #include "error.hh"
 #include "compiler.hh"
+#include "cache.hh"
+#include "pass.hh"
+#include "bench.hh"
+#include "profile.hh"
 #include "rule.hh"
 #include <lcdf/clp.h>
 #include <cstring>
 #include <cctype>
+#include <cstdlib>
 
 #define DEBUG_NAMESPACE_OPT	300
 #define DEBUG_RULESET_OPT	301
@@ -21,6 +26,26 @@
 #define HEADER_OPT		305
 #define DEBUG_NODE_OPT		306
 #define OPTIMIZE_OPT		307
+#define JOBS_OPT		308
+#define CACHE_DIR_OPT		309
+#define MEM_STATS_OPT		310
+#define TIME_PASSES_OPT		311
+#define INSTRUMENT_OPT		312
+#define PROFILE_USE_OPT		313
+#define LAYOUT_OPT		314
+#define LAYOUT_REPORT_OPT	315
+#define DISPATCH_REPORT_OPT	316
+#define INLINE_BUDGET_OPT	317
+#define INLINE_REPORT_OPT	318
+#define REMARKS_OPT		319
+#define REMARKS_FORMAT_OPT	320
+#define SPECIALIZE_OPT		321
+#define SCALAR_REPLACE_OPT	322
+#define FOLD_OPT		323
+#define FOLD_REPORT_OPT		324
+#define PLACE_BLOCKS_OPT	325
+#define BENCHMARK_OPT		326
+#define NAMESPACE_STATS_OPT	327
 
 Clp_Option options[] = {
     { "dn", 0, DEBUG_NAMESPACE_OPT, Clp_ArgString, Clp_Optional },
@@ -32,6 +57,26 @@ Clp_Option options[] = {
     { "optimize", 'O', OPTIMIZE_OPT, Clp_ArgUnsigned, Clp_Optional },
     { "defines", 'd', HEADER_OPT, 0, Clp_Negate },
     { "header", 0, HEADER_OPT, 0, Clp_Negate },
+    { "jobs", 'j', JOBS_OPT, Clp_ArgUnsigned, 0 },
+    { "cache-dir", 0, CACHE_DIR_OPT, Clp_ArgString, 0 },
+    { "mem-stats", 0, MEM_STATS_OPT, 0, 0 },
+    { "time-passes", 0, TIME_PASSES_OPT, Clp_ArgString, Clp_Optional },
+    { "instrument", 0, INSTRUMENT_OPT, 0, 0 },
+    { "profile-use", 0, PROFILE_USE_OPT, Clp_ArgString, 0 },
+    { "layout", 0, LAYOUT_OPT, Clp_ArgString, 0 },
+    { "layout-report", 0, LAYOUT_REPORT_OPT, 0, 0 },
+    { "dispatch-report", 0, DISPATCH_REPORT_OPT, 0, 0 },
+    { "inline-budget", 0, INLINE_BUDGET_OPT, Clp_ArgString, 0 },
+    { "inline-report", 0, INLINE_REPORT_OPT, 0, 0 },
+    { "remarks", 0, REMARKS_OPT, Clp_ArgString, Clp_Optional },
+    { "remarks-format", 0, REMARKS_FORMAT_OPT, Clp_ArgString, 0 },
+    { "specialize", 0, SPECIALIZE_OPT, Clp_ArgUnsigned, Clp_Optional },
+    { "scalar-replace", 0, SCALAR_REPLACE_OPT, 0, Clp_Negate },
+    { "fold-identical", 0, FOLD_OPT, 0, Clp_Negate },
+    { "fold-report", 0, FOLD_REPORT_OPT, 0, 0 },
+    { "place-blocks", 0, PLACE_BLOCKS_OPT, Clp_ArgUnsigned, Clp_Optional },
+    { "benchmark", 0, BENCHMARK_OPT, Clp_ArgString, 0 },
+    { "namespace-stats", 0, NAMESPACE_STATS_OPT, 0, 0 },
 };
 
 
@@ -64,6 +109,50 @@ typedef int bool;\n\
 \n";
 }
 
+static void
+gen_prolac_attributes(Writer &out)
+{
+  // Cold functions and labels go in .text.unlikely, out of the way of the
+  // code that runs most.
+  out << "/* hot and cold code */\n\
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 3))\n\
+# define PROLAC_HOT	__attribute__((hot))\n\
+# define PROLAC_COLD	__attribute__((cold, noinline))\n\
+#else\n\
+# define PROLAC_HOT\n\
+# define PROLAC_COLD\n\
+#endif\n\
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))\n\
+# define PROLAC_COLD_LABEL	__attribute__((cold))\n\
+#else\n\
+# define PROLAC_COLD_LABEL\n\
+#endif\n\
+\n";
+}
+
+static void
+gen_prolac_alias(Writer &out)
+{
+  // Identical functions are folded into aliases for the first of them. Their
+  // receiver types differ, which GCC would otherwise warn about, so each
+  // alias is bracketed by PROLAC_ALIAS_BEGIN and PROLAC_ALIAS_END.
+  out << "/* identical-code folding */\n\
+#if defined(__ELF__)\n\
+# define PROLAC_ALIAS(f)	__attribute__((alias(#f)))\n\
+#else\n\
+# error \"this target has no aliases; rerun prolacc without --fold-identical\"\n\
+#endif\n\
+#if defined(__GNUC__) && __GNUC__ >= 8\n\
+# define PROLAC_ALIAS_BEGIN	_Pragma(\"GCC diagnostic push\") \\\n\
+	_Pragma(\"GCC diagnostic ignored \\\"-Wattribute-alias\\\"\")\n\
+# define PROLAC_ALIAS_END	_Pragma(\"GCC diagnostic pop\")\n\
+#else\n\
+# define PROLAC_ALIAS_BEGIN\n\
+# define PROLAC_ALIAS_END\n\
+#endif\n\
+\n";
+}
+
 int
 main(int argc, char **argv)
 {
@@ -77,6 +166,27 @@ main(int argc, char **argv)
     PermString out_name;
     bool make_header = true;
     int max_inline = inlinePath;
+    int jobs = 1;
+    PermString cache_dir;
+    bool mem_stats = false;
+    int time_passes = 0;
+    bool instrument = false;
+    PermString profile_use;
+    bool hot_layout = false;
+    bool layout_report = false;
+    bool dispatch_report = false;
+    int inline_budget = -1;
+    int inline_export_budget = -1;
+    bool inline_report = false;
+    int remark_kinds = 0;
+    bool remarks_json = false;
+    int max_clones = 0;
+    bool scalar_replace = false;
+    bool fold_identical = false;
+    bool fold_report = false;
+    int max_tail_copy = -1;
+    PermString benchmark;
+    bool namespace_stats = false;
   
     while (1) {
 	int opt = Clp_Next(clp);
@@ -124,6 +234,123 @@ main(int argc, char **argv)
 		max_inline = inlinePath;
 	    break;
       
+	  case JOBS_OPT:
+	    if (clp->val.u < 1)
+		error(Landmark(), "-j value must be at least 1");
+	    else
+		jobs = clp->val.u;
+	    break;
+      
+	  case CACHE_DIR_OPT:
+	    cache_dir = clp->arg;
+	    break;
+      
+	  case MEM_STATS_OPT:
+	    mem_stats = true;
+	    break;
+      
+	  case TIME_PASSES_OPT:
+	    if (!clp->have_arg || strcmp(clp->arg, "text") == 0)
+		time_passes = 1;
+	    else if (strcmp(clp->arg, "json") == 0)
+		time_passes = 2;
+	    else
+		error(Landmark(), "--time-passes format must be `text' or `json'");
+	    break;
+      
+	  case INSTRUMENT_OPT:
+	    instrument = true;
+	    break;
+      
+	  case PROFILE_USE_OPT:
+	    profile_use = clp->arg;
+	    break;
+      
+	  case LAYOUT_OPT:
+	    if (strcmp(clp->arg, "declaration") == 0)
+		hot_layout = false;
+	    else if (strcmp(clp->arg, "hot") == 0)
+		hot_layout = true;
+	    else
+		error(Landmark(), "--layout must be `declaration' or `hot'");
+	    break;
+      
+	  case LAYOUT_REPORT_OPT:
+	    layout_report = true;
+	    break;
+      
+	  case DISPATCH_REPORT_OPT:
+	    dispatch_report = true;
+	    break;
+      
+	  case INLINE_BUDGET_OPT: {
+	      // N[,M]: N operations in all, M for any one export.
+	      char *end;
+	      inline_budget = strtol(clp->arg, &end, 10);
+	      if (*end == ',')
+		  inline_export_budget = strtol(end + 1, &end, 10);
+	      else
+		  inline_export_budget = inline_budget / 2;
+	      if (*end || end == clp->arg || inline_budget < 0
+		  || inline_export_budget < 0) {
+		  error(Landmark(), "--inline-budget must be N or N,M");
+		  inline_budget = -1;
+	      }
+	      break;
+	  }
+      
+	  case INLINE_REPORT_OPT:
+	    inline_report = true;
+	    break;
+      
+	  case REMARKS_OPT:
+	    remark_kinds = Compiler::parse_remark_kinds
+		(clp->have_arg ? clp->arg : "all");
+	    if (remark_kinds < 0) {
+		error(Landmark(), "unknown --remarks kind (try inline, no-inline, "
+		      "outline, tail-call, devirtualize, fold, exception,\n"
+		      "  specialize, all)");
+		remark_kinds = 0;
+	    }
+	    break;
+      
+	  case REMARKS_FORMAT_OPT:
+	    if (strcmp(clp->arg, "text") == 0)
+		remarks_json = false;
+	    else if (strcmp(clp->arg, "json") == 0)
+		remarks_json = true;
+	    else
+		error(Landmark(), "--remarks-format must be `text' or `json'");
+	    break;
+      
+	  case SPECIALIZE_OPT:
+	    max_clones = (clp->have_arg ? clp->val.u : 16);
+	    break;
+      
+	  case SCALAR_REPLACE_OPT:
+	    scalar_replace = !clp->negated;
+	    break;
+      
+	  case FOLD_OPT:
+	    fold_identical = !clp->negated;
+	    break;
+      
+	  case FOLD_REPORT_OPT:
+	    fold_report = true;
+	    break;
+      
+	  case PLACE_BLOCKS_OPT:
+	    max_tail_copy = (clp->have_arg ? clp->val.u : 2);
+	    break;
+	    
+	  case BENCHMARK_OPT:
+	    benchmark = clp->arg;
+	    break;
+	    
+	  case NAMESPACE_STATS_OPT:
+	    namespace_stats = true;
+	    break;
+      
 	  case HEADER_OPT:
 	    make_header = !clp->negated;
 	    break;
@@ -170,6 +397,16 @@ main(int argc, char **argv)
 	    return 1;
     }
   
+    Tokenizer tize(f, filename);
+    
+    if (benchmark) {
+	if (!run_benchmark(benchmark, tize, errwriter)) {
+	    error(Landmark(), "unknown benchmark `%s'", benchmark.c_str());
+	    return 1;
+	}
+	return 0;
+    }
+  
     FILE *out_c;
     if (!out_name || out_name == "-")
 	out_c = stdout;
@@ -198,22 +435,28 @@ main(int argc, char **argv)
     } else
 	out_structs = fopen("/dev/null", "w");
   
-    Tokenizer tize(f, filename);
-  
     Program prog;
     Yuck y(&tize, &prog);
   
+    begin_pass("parse");
     while (y.ydefinition())
 	;
-    if (!feof(f)) {
+    if (!tize.eof()) {
 	Token t = y.lex();
 	error(t, "unexpected token `%s' ends processing", t.print_string().c_str());
     }
+    end_pass();
     
+    begin_pass("resolve_names");
     prog.resolve_names();
     prog.debug_print(debug_map, all_debug);
+    end_pass();
+    begin_pass("analyze_exports");
     prog.analyze_exports();
+    end_pass();
+    begin_pass("resolve_code");
     prog.resolve_code();
+    end_pass();
 
     const char *include_protector = include_protector_symbol(out_name.c_str());
     if (!out_name)
@@ -222,21 +465,119 @@ main(int argc, char **argv)
     Writer wout_c(out_c);
     Writer wout_structs(out_structs);
     Compiler compiler(wout_c, wout_structs, max_inline);
+    
+    Profile *profile = 0;
+    if (instrument || profile_use) {
+	profile = new Profile;
+	profile->set_instrument(instrument);
+	if (profile_use)
+	    profile->read(profile_use);
+	compiler.set_profile(profile);
+    }
+    // Counters are numbered as rules are compiled, so instrumented code is
+    // compiled serially and isn't cached.
+    if (instrument) {
+	jobs = 1;
+	cache_dir = PermString();
+    }
+    if (cache_dir) {
+	CompileCache *cache = new CompileCache(cache_dir, max_inline);
+	cache->set_block_placement(max_tail_copy);
+	compiler.set_cache(cache);
+    }
+    if (remark_kinds)
+	compiler.set_remarks(remark_kinds, remarks_json, &errwriter);
+#ifndef __ELF__
+    // Folded functions are aliases, which only ELF targets support.
+    if (fold_identical) {
+	warning(Landmark(), "this target has no aliases; not folding");
+	fold_identical = false;
+    }
+#endif
+    compiler.set_fold(fold_identical);
+    if (max_tail_copy >= 0)
+	compiler.set_place_blocks(true, max_tail_copy);
+    
+    begin_pass("heat_analysis");
+    prog.heat_analysis(profile);
+    end_pass();
+    if (inline_budget >= 0) {
+	begin_pass("inline_budget");
+	prog.plan_inlining(inline_budget, inline_export_budget, max_inline);
+	end_pass();
+    }
+    if (max_clones > 0) {
+	begin_pass("specialize");
+	prog.specialize(max_clones, max_inline);
+	end_pass();
+    }
+    if (scalar_replace) {
+	begin_pass("scalar_replace");
+	prog.scalar_replace(max_inline);
+	end_pass();
+    }
+    begin_pass("layout");
+    prog.layout(hot_layout, profile);
+    end_pass();
   
     if (make_header) {
 	wout_structs << "/* Generated by the Prolac compiler */\n"
 		     << "#ifndef " << include_protector
 		     << "\n#define " << include_protector << "\n";
 	gen_prolac_defines(wout_structs);
+	gen_prolac_attributes(wout_structs);
+	if (fold_identical)
+	    gen_prolac_alias(wout_structs);
+	begin_pass("compile_structs");
 	prog.compile_structs(wout_structs);
+	end_pass();
 	wout_structs << "/* prototypes for methods used by exported methods */\n";
     }
     wout_c["filename"] = (void *)out_name.c_str();
     if (make_header)
 	wout_c << "#include \"" << out_structs_name << "\"\n";
     wout_c << "#include <assert.h>\n";
+    if (!make_header) {
+	gen_prolac_attributes(wout_c);
+	if (fold_identical)
+	    gen_prolac_alias(wout_c);
+    }
+    if (instrument)
+	profile->gen_declarations(wout_c, wout_structs);
   
-    prog.compile_exports(&compiler, debug_map, all_debug);
+    begin_pass("compile_exports");
+    prog.compile_exports(&compiler, debug_map, all_debug, jobs);
+    end_pass();
+    if (instrument)
+	profile->gen_counters(wout_c);
+    
+    if (layout_report)
+	prog.write_layout_report(errwriter);
+    if (inline_report)
+	prog.write_inline_report(errwriter);
+    if (dispatch_report)
+	errwriter << "dispatch sites: "
+		  << compiler.stat(statDispatchResolved) << " resolved, "
+		  << compiler.stat(statDispatchGuarded) << " guarded, "
+		  << compiler.stat(statDispatchIndirect) << " indirect\n";
+    if (fold_report)
+	errwriter << "identical-code folding: " << compiler.folded_rules()
+		  << " functions folded, "
+		  << compiler.folded_bytes() << " bytes of C saved\n";
+    if (mem_stats) {
+	write_pass_memory(errwriter);
+	errwriter << "rule arenas: " << compiler.rule_arenas() << " rules, "
+		  << (unsigned long)compiler.rule_arena_bytes()
+		  << " bytes released, largest "
+		  << (unsigned long)compiler.max_rule_arena_bytes() << "\n";
+	write_intern_stats(errwriter);
+    }
+    if (namespace_stats)
+	Namespace::write_search_stats(errwriter);
+    if (time_passes == 1)
+	write_pass_stats(errwriter);
+    else if (time_passes == 2)
+	write_pass_stats_json(errwriter);
 
     if (make_header)
 	wout_structs << "#endif /* " << include_protector << " */\n";
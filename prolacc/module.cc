@@ -10,6 +10,7 @@
 #include "compiler.hh"
 #include "prototype.hh"
 #include <cassert>
+#include <cstdio>
 
 /*****
  * ModuleNames
@@ -167,6 +168,9 @@ ModuleNames::has_implicit_feature(PermString n, bool want_static) const
 int
 ModuleNames::inline_level(Rule *rule) const
 {
+  // Specializations are inlined like the rules they specialize.
+  if (Rule *general = rule->specialized_from())
+    rule = general;
   int level = _inliners[rule];
   if (level < 0)
     level = _module_inliners[rule->actual()];
@@ -232,7 +236,7 @@ Module::Module(Protomodule *p, ModuleNames *mn)
     _ancestor_map(-1), _field_map(-1),
     _anc_field_count(0), _self_field(0),
     _self_vtbl_field(0), _size(-1), _align(-1),
-    _module_map(-1)
+    _module_map(-1), _hot_layout(false)
 {
 }
 
@@ -581,6 +585,10 @@ Module::resolve1_parent(Module *m)
     }
   }
   
+  // A module extending storage prolac lays out may be laid out hot too.
+  if (m->_hot_layout)
+    _hot_layout = true;
+  
   return ok;
 }
 
@@ -859,8 +867,28 @@ field_offset_sorter(const void *v1, const void *v2)
     return f1->offset() - f2->offset();
 }
 
+// With --layout=hot, floating slots are ordered by how often hot code
+// touches them: slots accessed by the heaviest rule come first, so that rule's
+// slots share cache lines. Slots hot code never touches follow in declaration
+// order.
+static bool
+hot_slot_precedes(const Field *f1, const Field *f2)
+{
+  bool hot1 = f1->accesses() > 0;
+  bool hot2 = f2->accesses() > 0;
+  if (hot1 != hot2)
+    return hot1;
+  if (!hot1)
+    return false;
+  if (f1->access_group_weight() != f2->access_group_weight())
+    return f1->access_group_weight() > f2->access_group_weight();
+  if (f1->access_group() != f2->access_group())
+    return f1->access_group() < f2->access_group();
+  return f1->accesses() > f2->accesses();
+}
+
 void
-Module::layout2()
+Module::layout2(bool hot)
 {
   if (_size >= 0)
     return;
@@ -870,11 +898,18 @@ Module::layout2()
   if (!_all_slots.size())
     return;
   
-  // layout2() ALL important modules, to get sizes for slot module types
+  // Only modules declared `layout hot' are reordered; others, like packet
+  // headers, may describe storage whose layout prolac doesn't own.
+  bool reorder = hot && _hot_layout;
+  
+  // layout2() ALL important modules, to get sizes for slot module types.
+  // A hot layout places inherited slots too, so hot ancestors are laid out
+  // after us and keep the offsets we choose.
   for (int i = 0; i < _fields.size(); i++)
     if (_fields[i]->is_in_object()) {
       Module *min = _fields[i]->type()->cast_module();
-      if (min) min->layout2();
+      if (min && !(reorder && i < _anc_field_count && min->_hot_layout))
+	min->layout2(hot);
     }
   
   // arrange slots in offset order, with unknown-offset slots at the end
@@ -889,6 +924,49 @@ Module::layout2()
     float_i++;
   int first_float = float_i;
   
+  // A module whose floating slots hot code never touches keeps the default
+  // layout.
+  bool any_hot = false;
+  if (reorder)
+    for (int i = first_float; i < _all_slots.size(); i++)
+      if (_all_slots[i]->accesses() > 0)
+	any_hot = true;
+  
+  if (any_hot) {
+    // sort floating slots (stably, so ties stay in declaration order)
+    for (int i = first_float + 1; i < _all_slots.size(); i++) {
+      Field *slot = _all_slots[i];
+      int j = i;
+      for (; j > first_float && hot_slot_precedes(slot, _all_slots[j-1]); j--)
+	_all_slots[j] = _all_slots[j-1];
+      _all_slots[j] = slot;
+    }
+    
+    // place each floating slot at the first aligned offset where it overlaps
+    // nothing already placed
+    for (; float_i < _all_slots.size(); float_i++) {
+      Field *slot = _all_slots[float_i];
+      int s = slot->size();
+      int a = slot->align();
+      assert(s >= 0 && a > 0);
+      
+      int offset = 0;
+      for (int j = 0; j < float_i; j++) {
+	Field *other = _all_slots[j];
+	int other_end = other->offset() + other->size();
+	if (s == 0 ? other_end > offset
+	    : (other->size() > 0 && offset < other_end
+	       && other->offset() < offset + s)) {
+	  offset = other_end;
+	  if ((offset & (a - 1)) != 0)
+	    offset = (offset + a) & ~(a - 1);
+	  j = -1;		// start over
+	}
+      }
+      slot->set_offset(offset);
+    }
+  }
+  
   // place each floating slot
   int offset = 0;
   while (float_i < _all_slots.size()) {
@@ -914,12 +992,13 @@ Module::layout2()
   }
   
   // find the structure's alignment and size
-  for (int i = 0; i < _all_slots.size(); i++)
+  for (int i = 0; i < _all_slots.size(); i++) {
     if (_all_slots[i]->align() > _align)
       _align = _all_slots[i]->align();
+    if (_all_slots[i]->offset() + _all_slots[i]->size() > _size)
+      _size = _all_slots[i]->offset() + _all_slots[i]->size();
+  }
   
-  Field *last_slot = _all_slots[_all_slots.size() - 1];
-  _size = last_slot->offset() + last_slot->size();
   int align_mask = _align - 1;
   if ((_size & align_mask) != 0)
     _size = (_size + _align) & ~align_mask;
@@ -946,6 +1025,17 @@ Module::layout2()
 	error(*next, "(`%m.%f' was defined here)", next->origin().obj(), next);
       }
   }
+  
+  if (reorder)
+    for (int i = 0; i < _anc_field_count; i++)
+      _fields[i]->type()->cast_module()->layout2(hot);
+}
+
+void
+Module::count_vtbl_access(int group, unsigned long weight)
+{
+  if (_self_vtbl_field)
+    _self_vtbl_field->count_access(group, weight);
 }
 
 
@@ -1041,6 +1131,102 @@ Module::gen_static_slots(Writer &w) const
     }
 }
 
+void
+Module::write_layout(Writer &w) const
+{
+  w << "module " << gen_module_name() << ' ' << _size << '.' << _align
+    << wmendl << wmindent(2);
+  gen_slots(w);
+  gen_static_slots(w);
+  w << wmindent(-2);
+}
+
+// --layout-report describes each structure: every slot's offset, size and
+// the cache lines it occupies, and the padding between slots. Padding that
+// alignment alone wouldn't need is blamed on the `@'-placed slot after it.
+
+#define CACHE_LINE_SIZE		64
+
+static void
+report_padding(Writer &w, int offset, int size, const Field *pinned)
+{
+  char buf[64];
+  sprintf(buf, "  %6d %6d %9s  ", offset, size, "");
+  w << buf << "(padding";
+  if (pinned)
+    w << " before placed slot " << pinned->basename();
+  w << ")\n";
+}
+
+void
+Module::write_layout_report(Writer &w) const
+{
+  char buf[64];
+  int nlines = (_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+  w << gen_module_name() << " (" << actual() << "): " << _size
+    << (_size == 1 ? " byte, align " : " bytes, align ") << _align << ", " << nlines
+    << (nlines == 1 ? " cache line\n" : " cache lines\n");
+  sprintf(buf, "  %6s %6s %9s  ", "offset", "size", "lines");
+  w << buf << "slot\n";
+  
+  int offset = 0;
+  int padding = 0, holes = 0, pinned_padding = 0, straddles = 0;
+  for (int i = 0; i < _all_slots.size(); i++) {
+    Field *slot = _all_slots[i];
+    if (slot->offset() > offset) {
+      int aligned = offset;
+      int align_mask = slot->align() - 1;
+      if ((aligned & align_mask) != 0)
+	aligned = (aligned + slot->align()) & ~align_mask;
+      bool pin = slot->pinned() && slot->offset() != aligned;
+      report_padding(w, offset, slot->offset() - offset, pin ? slot : 0);
+      padding += slot->offset() - offset;
+      holes++;
+      if (pin)
+	pinned_padding += slot->offset() - offset;
+    }
+    
+    int first_line = slot->offset() / CACHE_LINE_SIZE;
+    int last_line = first_line;
+    if (slot->size() > 0)
+      last_line = (slot->offset() + slot->size() - 1) / CACHE_LINE_SIZE;
+    char lines[32];
+    if (first_line == last_line)
+      sprintf(lines, "%d", first_line);
+    else {
+      sprintf(lines, "%d-%d", first_line, last_line);
+      straddles++;
+    }
+    sprintf(buf, "  %6d %6d %9s  ", slot->offset(), slot->size(), lines);
+    w << buf << slot->basename();
+    if (slot->type()->vtbl_of())
+      w << " (vtbl)";
+    else
+      w << " (" << slot->origin() << ")";
+    if (slot->pinned())
+      w << " @ " << slot->offset();
+    if (first_line != last_line)
+      w << " straddles";
+    w << "\n";
+    
+    if (slot->offset() + slot->size() > offset)
+      offset = slot->offset() + slot->size();
+  }
+  if (_size > offset) {
+    report_padding(w, offset, _size - offset, 0);
+    padding += _size - offset;
+    holes++;
+  }
+  
+  w << "  padding " << padding << (padding == 1 ? " byte in " : " bytes in ")
+    << holes << (holes == 1 ? " hole" : " holes");
+  if (pinned_padding)
+    w << " (" << pinned_padding << " forced by placed slots)";
+  w << ", " << straddles
+    << (straddles == 1 ? " slot straddles" : " slots straddle")
+    << " cache lines\n";
+}
+
 void
 Module::gen_prototype(Writer &w) const
 {
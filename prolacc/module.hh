@@ -133,6 +133,7 @@ class Module {
   Vector<ModuleNames *> _filtered_modules;
   
   bool _need_struct;
+  bool _hot_layout;
   Vector<Module *> _anc_layout;
   mutable GenTracker _gen_track;
   
@@ -213,7 +214,10 @@ class Module {
   bool resolve3_implicit_rule(int);
   
   void layout1();
-  void layout2();
+  bool hot_layout() const		{ return _hot_layout; }
+  void set_hot_layout()			{ _hot_layout = true; }
+  void layout2(bool hot = false);
+  void count_vtbl_access(int group, unsigned long weight);
   void set_default_modnames(ModuleNames *);
   
   // GEN
@@ -232,6 +236,9 @@ class Module {
   void gen_vtbl(Writer &, ModuleNames *) const;
   void gen_assign_vtbl(Compiler *, Node *) const;
   PermString gen_self_vtbl_name();
+  void write_layout(Writer &) const;
+  void write_layout_report(Writer &) const;
+  bool need_struct() const		{ return _need_struct; }
   
   // WRITE
   
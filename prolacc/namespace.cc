@@ -6,16 +6,23 @@
 #include "error.hh"
 #include "node.hh"
 #include "field.hh"
+#include "writer.hh"
 #include <cassert>
+#include <cstdio>
 
 static PermString::Initializer initializer;
 PermString inaccessible_string = "<inaccessible>";
 
+unsigned Namespace::search_generation = 1;
+unsigned long Namespace::search_hits;
+unsigned long Namespace::search_misses;
+unsigned long Namespace::search_depth;
+
 
 ConcreteNamespace::ConcreteNamespace(const ConcreteNamespace &cn)
   : _name(cn._name),
     _h(cn._h), _f(cn._f), _n(cn._n),
-    _refcount(0)
+    _refcount(0), _searched(0)
 {
 }
 
@@ -35,6 +42,7 @@ bool
 ConcreteNamespace::def(PermString name, Feature *f)
 {
   //f->use();
+  changed();
   int i = _h[name];
   if (i) {
     //_f[i]->unuse();
@@ -55,8 +63,9 @@ ConcreteNamespace::undef(PermString name)
 {
   int i = _h[name];
   if (!i) return false;
+  changed();
   //_f[i]->unuse();
-  _h.insert(name, 0);
+  _h.remove(name);
   
   // Now, move the last element in the _f and _n arrays in the place of i.
   Feature *lastf = _f.back();
@@ -75,6 +84,7 @@ ConcreteNamespace::undef(PermString name)
 void
 ConcreteNamespace::clear()
 {
+  changed();
   _h.clear();
   _f.clear();
   _n.clear();
@@ -89,8 +99,9 @@ ConcreteNamespace::rename(PermString old, PermString nuu)
   int i = _h[old];
   if (!i || _h[nuu]) return false;
   
+  changed();
   _n[i] = nuu;
-  _h.insert(old, 0);
+  _h.remove(old);
   _h.insert(nuu, i);
   return true;
 }
@@ -99,13 +110,42 @@ ConcreteNamespace::rename(PermString old, PermString nuu)
 Feature *
 Namespace::search(PermString name) const
 {
-  const Namespace *ns = this;
-  while (ns) {
-    Feature *f = ns->find(name);
-    if (f) return f;
-    ns = ns->parent();
+  if (_search_generation != search_generation) {
+    if (_search_cache)
+      _search_cache->clear();
+    _search_generation = search_generation;
+  } else if (_search_cache)
+    if (Feature **fp = _search_cache->findp(name)) {
+      search_hits++;
+      return *fp;
+    }
+  
+  search_misses++;
+  Feature *f = 0;
+  for (const Namespace *ns = this; ns && !f; ns = ns->parent()) {
+    search_depth++;
+    ns->_searched = ns->_cns->_searched = search_generation;
+    f = ns->find(name);
   }
-  return 0;
+  
+  if (!_search_cache)
+    _search_cache = new FlatHashMap<PermString, Feature *>(0);
+  _search_cache->insert(name, f);
+  return f;
+}
+
+
+void
+Namespace::write_search_stats(Writer &w)
+{
+  unsigned long searches = search_hits + search_misses;
+  char buf[200];
+  sprintf(buf, "namespace searches: %lu, %lu hits (%.1f%%), %lu misses, average depth %.2f per miss\n",
+	  searches, search_hits,
+	  searches ? 100. * search_hits / searches : 0.,
+	  search_misses,
+	  search_misses ? (double)search_depth / search_misses : 0.);
+  w << buf;
 }
 
 
@@ -138,8 +178,10 @@ Namespace::def_reparent(PermString n, Feature *f, bool is_const) const
   if (Namespace *namesp = f->cast_namespace())
     if (is_const)
       return _cns->def(n, new Namespace(*namesp, (Namespace *)this));
-    else
+    else {
+      namesp->changed();
       namesp->_parent = (Namespace *)this;
+    }
   
   return _cns->def(n, f);
 }
@@ -264,6 +306,7 @@ ConcreteNamespace::name_resolve_internal(Namespace *result,
 void
 Namespace::change_concrete(ConcreteNamespace *new_cns)
 {
+  changed();
   new_cns->use();
   _cns->unuse();
   _cns = new_cns;
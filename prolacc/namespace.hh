@@ -10,13 +10,18 @@ class Protomodule;
 class ConcreteNamespace {
   
   PermString _name;
-  HashMap<PermString, int> _h;
+  FlatHashMap<PermString, int> _h;
   Vector<Feature *> _f;
   Vector<PermString> _n;
   int _refcount;
+  mutable unsigned _searched;
   
   ConcreteNamespace(const ConcreteNamespace &);
   
+  inline void changed();
+  
+  friend class Namespace;
+  
  public:
   
   ConcreteNamespace(PermString n);
@@ -53,6 +58,23 @@ class Namespace: public Feature {
   Namespace *_parent;
   ConcreteNamespace *_cns;
   
+  // search() remembers its results, including failures, until a namespace
+  // it looked at changes. Each search marks the namespaces it looks at with
+  // search_generation; a def, undef or rename of a marked namespace, or
+  // reparenting one, bumps search_generation, which empties every cache.
+  mutable FlatHashMap<PermString, Feature *> *_search_cache;
+  mutable unsigned _search_generation;
+  mutable unsigned _searched;
+  
+  static unsigned search_generation;
+  static unsigned long search_hits;
+  static unsigned long search_misses;
+  static unsigned long search_depth;
+  
+  friend class ConcreteNamespace;
+  
+  inline void changed() const;
+  
   Namespace &operator=(const Namespace &) { assert(0); return *this; }
   
  public:
@@ -61,7 +83,7 @@ class Namespace: public Feature {
   Namespace(PermString, Namespace *parent, const Landmark &);
   Namespace(const Namespace &ns);
   Namespace(const Namespace &ns, Namespace *);
-  ~Namespace()				{ _cns->unuse(); }
+  ~Namespace()				{ _cns->unuse(); delete _search_cache; }
   
   Namespace *parent() const		{ return _parent; }
   ConcreteNamespace *concrete() const	{ return _cns; }
@@ -89,6 +111,9 @@ class Namespace: public Feature {
   
   RuleRef *find_ruleref() const;
   
+  static void invalidate_searches()	{ search_generation++; }
+  static void write_search_stats(Writer &);
+  
   PermString gen_name() const;
   PermString gen_subname() const;
   void gen_subname(Writer &) const;
@@ -105,7 +130,7 @@ class Namespace: public Feature {
 
 inline
 ConcreteNamespace::ConcreteNamespace(PermString n)
-  : _name(n), _h(0), _refcount(0)
+  : _name(n), _h(0), _refcount(0), _searched(0)
 {
   _f.push_back((Feature *)0);
   _n.push_back(PermString());
@@ -128,7 +153,8 @@ ConcreteNamespace::featname(int featureindex) const
 inline
 Namespace::Namespace(PermString n, const Landmark &l)
   : Feature(n, ModuleID(0), l), _parent(0),
-    _cns(new ConcreteNamespace(n))
+    _cns(new ConcreteNamespace(n)), _search_cache(0), _search_generation(0),
+    _searched(0)
 {
   _cns->use();
 }
@@ -136,14 +162,16 @@ Namespace::Namespace(PermString n, const Landmark &l)
 inline
 Namespace::Namespace(PermString n, Namespace *parent, const Landmark &l)
   : Feature(n, parent->origin(), l), _parent(parent),
-    _cns(new ConcreteNamespace(n))
+    _cns(new ConcreteNamespace(n)), _search_cache(0), _search_generation(0),
+    _searched(0)
 {
   _cns->use();
 }
 
 inline
 Namespace::Namespace(const Namespace &ns, Namespace *new_parent)
-  : Feature(ns), _parent(new_parent), _cns(ns._cns)
+  : Feature(ns), _parent(new_parent), _cns(ns._cns),
+    _search_cache(0), _search_generation(0), _searched(0)
 {
   _cns->use();
 }
@@ -160,6 +188,20 @@ Namespace::featname(int i) const
   return _cns->featname(i);
 }
 
+inline void
+ConcreteNamespace::changed()
+{
+  if (_searched == Namespace::search_generation)
+    Namespace::invalidate_searches();
+}
+
+inline void
+Namespace::changed() const
+{
+  if (_searched == search_generation)
+    invalidate_searches();
+}
+
 extern PermString inaccessible_string;
 
 #endif
@@ -5,6 +5,7 @@
 #include "node.hh"
 #include "prototype.hh"
 #include "module.hh"
+#include "ruleset.hh"
 #include "error.hh"
 #include "field.hh"
 #include "operator.hh"
@@ -12,22 +13,25 @@
 #include "codeblock.hh"
 #include "compiler.hh"
 #include "writer.hh"
+#include "profile.hh"
 
 
 static PermString::Initializer initializer;
 PermString star_string = "*";
 
 Betweenliner Node::cur_betweenliner;
+unsigned long Node::created_count;
 short Betweenliner::last_outline_epoch = 0;
 
 
 Betweenliner::Betweenliner()
-    : _inline_level(-1), _outline_level(-1), _outline_epoch(0)
+    : _inline_level(-1), _outline_level(-1), _outline_epoch(0), _expect(0)
 {
 }
 
 
 Betweenliner::Betweenliner(bool is_inline, int level, Betweenliner prev)
+    : _expect(prev._expect)
 {
     if (is_inline) {
 	_outline_epoch = prev._outline_epoch;
@@ -54,6 +58,17 @@ Betweenliner::change_outline(Betweenliner b)
 }
 
 
+Betweenliner
+Betweenliner::expecting(int delta) const
+{
+    // `likely' and `unlikely' nest; keep the sum well inside a signed char.
+    Betweenliner b = *this;
+    int e = _expect + delta;
+    b._expect = (e > 100 ? 100 : (e < -100 ? -100 : e));
+    return b;
+}
+
+
 PrototypeNode::PrototypeNode(Prototype *p, bool afterfrob, const Landmark &l)
     : Node(p->base_type(), l), _proto(p), _afterfrob(afterfrob)
 {
@@ -88,7 +103,7 @@ FieldNode::FieldNode(Node *fof, const FieldNode &n)
 
 CallNode::CallNode(Node *of, Rule *rule, Type *return_type, bool fixed_rule,
 		   Betweenliner b, const Landmark &l)
-    : Node(return_type, b, l), _call_of(of), _rule(rule),
+    : Node(return_type, b, l), _call_of(of), _rule(rule), _guess(0),
       _fixed_rule(fixed_rule), _tail_recursion(false)
 {
     /*if (_call_of && _call_of->fixed_run_time_type()) {
@@ -98,7 +113,8 @@ CallNode::CallNode(Node *of, Rule *rule, Type *return_type, bool fixed_rule,
 
 CallNode::CallNode(Node *of, const Vector<Node *> &params, const CallNode &n)
     : Node(n), _call_of(of), _rule(n._rule), _params(params),
-      _fixed_rule(n._fixed_rule), _tail_recursion(n._tail_recursion)
+      _guess(n._guess), _fixed_rule(n._fixed_rule),
+      _tail_recursion(n._tail_recursion)
 {
     /*    if (_call_of && _call_of->fixed_run_time_type()) {
 	errwriter << "2 " << this << wmendl;
@@ -125,6 +141,20 @@ CallNode::fixed_rule() const
     return (r->leaf() ? r : 0);
 }
 
+Rule *
+CallNode::guessed_rule() const
+{
+    // A guessed dynamic dispatch generates its arguments twice, once for the
+    // direct call and once for the indirect one, so each must be safe to
+    // generate twice.
+    if (!_guess || fixed_rule() || _guess->origin() != _rule->origin())
+	return 0;
+    for (int i = 0; i < _params.size(); i++)
+	if (!_params[i]->temporary() && _params[i]->must_gen_value())
+	    return 0;
+    return _guess->rule(_rule->ruleindex());
+}
+
 ConstructorNode::ConstructorNode(Node *of, Rule *rule,
 				 Betweenliner b, const Landmark &l)
   : CallNode(of, rule, of->type(), false, b, l)
@@ -308,12 +338,14 @@ CatchNode::CatchNode(Node *child, const CatchNode &n)
 
 
 CodeNode::CodeNode(CodeBlock *code)
-  : Node(bool_type, code->landmark()), _code(code), _self(0), _have_params(0)
+  : Node(bool_type, code->landmark()), _code(code), _self(0), _have_params(0),
+    _pure(0)
 {
 }
 
 CodeNode::CodeNode(Node *s, const Vector<Node *> &params, const CodeNode &c)
-  : Node(c), _code(c._code), _self(s), _params(params), _have_params(1)
+  : Node(c), _code(c._code), _self(s), _params(params), _have_params(1),
+    _pure(c._pure)
 {
 }
 
@@ -324,6 +356,12 @@ VtblNode::VtblNode(Module *m, Node *o, const Landmark &l)
 }
 
 
+CounterNode::CounterNode(int counter, const Landmark &l)
+  : Node(void_type, l), _counter(counter)
+{
+}
+
+
 SelfNode::SelfNode(Type *t, const Landmark &lm)
   : Node(t, lm), _super(false)
 {
@@ -386,10 +424,72 @@ void
 Node::change_type(Type *t)
 {
   assert(_type);
+  save_state();
   _type = t;
 }
 
 
+static bool saving_states;
+static Vector<Node *> saved_nodes;
+static Vector<Type *> saved_types;
+static Vector<Betweenliner> saved_betweenliners;
+static Vector<int> saved_usages;
+static Vector<PermString> saved_temporaries;
+static Vector<Node **> saved_child_ptrs;
+static Vector<Node *> saved_children;
+
+void
+Node::save_state()
+{
+  if (saving_states) {
+    saved_nodes.push_back(this);
+    saved_types.push_back(_type);
+    saved_betweenliners.push_back(_betweenliner);
+    saved_usages.push_back(_usage);
+    saved_temporaries.push_back(_temporary);
+  }
+}
+
+void
+Node::save_child(Node *&child)
+{
+  if (saving_states) {
+    saved_child_ptrs.push_back(&child);
+    saved_children.push_back(child);
+  }
+}
+
+void
+Node::begin_saving_states()
+{
+  saving_states = true;
+}
+
+void
+Node::restore_states()
+{
+  // Restore in reverse order so a Node changed several times ends up with
+  // its original state.
+  for (int i = saved_nodes.size() - 1; i >= 0; i--) {
+    Node *n = saved_nodes[i];
+    n->_type = saved_types[i];
+    n->_betweenliner = saved_betweenliners[i];
+    n->_usage = saved_usages[i];
+    n->_temporary = saved_temporaries[i];
+  }
+  saved_nodes.clear();
+  saved_types.clear();
+  saved_betweenliners.clear();
+  saved_usages.clear();
+  saved_temporaries.clear();
+  for (int i = saved_child_ptrs.size() - 1; i >= 0; i--)
+    *saved_child_ptrs[i] = saved_children[i];
+  saved_child_ptrs.clear();
+  saved_children.clear();
+  saving_states = false;
+}
+
+
 /*****
  * LetNode etc.
  **/
@@ -730,6 +830,12 @@ CodeNode::write(Writer &w) const
   w << "{code}";
 }
 
+void
+CounterNode::write(Writer &w) const
+{
+  w << "(count " << _counter << ")";
+}
+
 void
 VtblNode::write(Writer &w) const
 {
@@ -969,7 +1075,7 @@ DeclarationNode::optimize(NodeOptimizer *opt) const
   Node *newval = _value ? _value->optimize(opt) : 0;
   if (newval != _value)
     result = new DeclarationNode(_variable, newval, *this);
-  return (Node *)result;
+  return opt->do_declaration(result);
 }
 
 
@@ -994,12 +1100,46 @@ BinaryNode::optimize(NodeOptimizer *opt) const
 }
 
 
+// Returns true if any test of the `==>' chain `n' can make CSEOptimizer
+// forget values.
+static bool
+tests_may_kill(Node *n)
+{
+  SemistrictNode *ss = n->cast_semistrict();
+  if (ss->op() == opArrow)
+    return KillFinder::may_kill(ss->left());
+  else
+    return tests_may_kill(ss->left()) || tests_may_kill(ss->right());
+}
+
+// Returns true if `n' is false only when none of its arms ran, as in
+// `(A ==> B) || (C ==> D)', so that whatever follows it can assume the arms
+// didn't run. Tests after the first run inside arms, where what they forget
+// would look like what an arm forgot, so they must not forget anything.
+static bool
+arms_exclusive(Node *n)
+{
+  SemistrictNode *ss = n->cast_semistrict();
+  if (ss && ss->op() == opArrow)
+    return true;
+  else if (ss && ss->op() == opLogOr)
+    return arms_exclusive(ss->left()) && arms_exclusive(ss->right())
+      && !tests_may_kill(ss->right());
+  else
+    return false;
+}
+
 Node *
 SemistrictNode::optimize(NodeOptimizer *opt) const
 {
   const SemistrictNode *result = this;
   Node *newl = _left->optimize(opt);
+  // Only a sequence always evaluates its right side.
+  if (_op != ',')
+    opt->begin_arm(_op == opLogOr && arms_exclusive(_left));
   Node *newr = _right->optimize(opt);
+  if (_op != ',')
+    opt->end_arm();
   
   if (newl != _left || newr != _right)
     result = new SemistrictNode(newl, newr, *this);
@@ -1011,7 +1151,9 @@ Node *
 EffectNode::optimize(NodeOptimizer *opt) const
 {
   const EffectNode *result = this;
+  opt->begin_lvalue(_left);
   Node *newl = _left->optimize(opt);
+  opt->end_lvalue();
   Node *newr = _right->optimize(opt);
   
   if (newl != _left || newr != _right)
@@ -1024,7 +1166,12 @@ Node *
 UnaryNode::optimize(NodeOptimizer *opt) const
 {
   const UnaryNode *result = this;
+  bool location = (_op == opAddress || _op.side_effects());
+  if (location)
+    opt->begin_lvalue(_child);
   Node *newl = _child->optimize(opt);
+  if (location)
+    opt->end_lvalue();
   if (newl != _child)
     result = new UnaryNode(newl, *this);
   return opt->do_unary(result);
@@ -1055,8 +1202,12 @@ ConditionalNode::optimize(NodeOptimizer *opt) const
 {
   const ConditionalNode *result = this;
   Node *new_test = _test->optimize(opt);
+  opt->begin_arm();
   Node *new_yes = _yes->optimize(opt);
+  opt->end_arm();
+  opt->begin_arm(true);
   Node *new_no = _no->optimize(opt);
+  opt->end_arm();
   
   if (new_test != _test || new_yes != _yes || new_no != _no)
     result = new ConditionalNode(new_test, new_yes, new_no, *this);
@@ -1074,7 +1225,10 @@ Node *
 CatchNode::optimize(NodeOptimizer *opt) const
 {
   const CatchNode *result = this;
+  // An exception can leave the child at any point.
+  opt->begin_arm();
   Node *newc = _child->optimize(opt);
+  opt->end_arm();
   if (newc != _child)
     result = new CatchNode(newc, *this);
   return opt->do_catch(result);
@@ -1085,7 +1239,9 @@ CodeNode::optimize(NodeOptimizer *opt) const
 {
   if (!_have_params) return opt->do_code(this);
 
-  // otherwise, go through all objects and stuff and optimize them
+  // otherwise, go through all objects and stuff and optimize them. They are
+  // substituted into the code's text, which might assign to them.
+  opt->begin_lvalue(0);
   Node *new_self = _self ? _self->optimize(opt) : opt->do_self();
   bool need_new = new_self != _self;
   
@@ -1096,6 +1252,7 @@ CodeNode::optimize(NodeOptimizer *opt) const
     if (p != _params[i])
       need_new = true;
   }
+  opt->end_lvalue();
   
   const CodeNode *result;
   if (need_new)
@@ -1126,6 +1283,8 @@ Node *
 LabelNode::optimize(NodeOptimizer *opt) const
 {
   const LabelNode *result = this;
+  // Tail recursions jump back here.
+  opt->begin_loop();
   Node *newc = _child->optimize(opt);
   if (newc != _child)
     result = new LabelNode(newc);
@@ -1219,15 +1378,32 @@ BinaryNode::compile(Compiler *c, bool value_used, Target *ts)
     return first;
 }
 
+int
+Node::arm_expect(const Node *n) const
+{
+    // Returns 1 if `n' was marked `likely' relative to this node, -1 if it
+    // was marked `unlikely', and 0 otherwise. A sequence counts as marked if
+    // its first statement is, so `a ==> unlikely b, c' works as expected.
+    int e = n->betweenliner().expect() - _betweenliner.expect();
+    if (e == 0) {
+	SemistrictNode *seq = ((Node *)n)->cast_semistrict();
+	if (seq && seq->op() == ',')
+	    return arm_expect(seq->left());
+    }
+    return (e > 0 ? 1 : (e < 0 ? -1 : 0));
+}
+
 Target *
-Node::compile_test(Node *&n, Compiler *c, Target *tyes, Target *tno)
+Node::compile_test(Node *&n, Compiler *c, Target *tyes, Target *tno,
+		   int expect)
 {
     TestNode *test = n->cast_test();
     if (!test) {
 	test = new TestNode(n);
+	save_child(n);
 	n = test;
     }
-    return test->compile_test(c, tyes, tno);
+    return test->compile_test(c, tyes, tno, expect);
 }
 
 Target *
@@ -1235,6 +1411,12 @@ SemistrictNode::compile(Compiler *c, bool value_used, Target *ts)
 {
     Target *first;
     Target *second;
+    // An expectation for the whole test carries to the arms it implies.
+    // Otherwise, a right arm that always throws makes its left arm's
+    // short-circuit the likely way out.
+    int expect = (ts->gen_code() == gcTest ? ts->expect() : 0);
+    int left_expect = arm_expect(_left);
+    int right_expect = arm_expect(_right);
     switch ((int)_op) {
     
       case ',':
@@ -1254,12 +1436,22 @@ SemistrictNode::compile(Compiler *c, bool value_used, Target *ts)
 	      Target *tright = _op == opLogAnd ? tyes : tno;
 	      tright->set_betweenliner(_right->betweenliner());
 	  }
+	  
+	  int short_circuit = (_op == opLogAnd ? -1 : 1);
+	  if (!right_expect)
+	      right_expect = expect;
+	  if (left_expect)
+	      /* keep it */;
+	  else if (expect == -short_circuit)
+	      left_expect = expect;
+	  else if (_right->must_throw())
+	      left_expect = short_circuit;
      
-	  second = compile_test(_right, c, tyes, tno);
+	  second = compile_test(_right, c, tyes, tno, right_expect);
 	  
 	  Target *go_yes = _op == opLogAnd ? second : tyes;
 	  Target *go_no = _op == opLogAnd ? tno : second;
-	  first = compile_test(_left, c, go_yes, go_no);
+	  first = compile_test(_left, c, go_yes, go_no, left_expect);
      
 	  break;
       }
@@ -1272,12 +1464,21 @@ SemistrictNode::compile(Compiler *c, bool value_used, Target *ts)
 	  } else {
 	      tyes = new Target(this, value_used, ts, 0, gcYes);
 	      tno = new Target(this, value_used, ts, 0, gcNo);
-	      Target *tright = _op == opLogAnd ? tyes : tno;
-	      tright->set_betweenliner(_right->betweenliner());
+	      // Only the right arm reaches `tyes'.
+	      tyes->set_betweenliner(_right->betweenliner());
 	  }
      
+	  if (left_expect)
+	      /* keep it */;
+	  else if (right_expect)
+	      left_expect = right_expect;
+	  else if (expect > 0)
+	      left_expect = expect;
+	  else if (_right->must_throw())
+	      left_expect = -1;
+	  
 	  second = _right->compile(c, false, tyes);
-	  first = compile_test(_left, c, second, tno);
+	  first = compile_test(_left, c, second, tno, left_expect);
 	  
 	  break;
       }
@@ -1303,7 +1504,17 @@ ConditionalNode::compile(Compiler *c, bool value_used, Target *ts)
     Target *no_result = new Target(this, value_used, ts, 0, gcNo);
     Target *no = _no->compile(c, value_used, no_result);
   
-    Target *result = compile_test(_test, c, yes, no);
+    // Arms marked `likely' or `unlikely' set the test's expectation unless
+    // the test has its own; an arm that always throws is unlikely.
+    int expect = arm_expect(_test);
+    if (!expect)
+	expect = arm_expect(_yes) - arm_expect(_no);
+    if (!expect)
+	expect = (int)_no->must_throw() - (int)_yes->must_throw();
+    if (expect)
+	expect = (expect > 0 ? 1 : -1);
+    
+    Target *result = compile_test(_test, c, yes, no, expect);
     return result;
 }
 
@@ -1341,9 +1552,10 @@ TestNode::compile(Compiler *c, bool, Target *ts)
 }
 
 Target *
-TestNode::compile_test(Compiler *c, Target *tyes, Target *tno)
+TestNode::compile_test(Compiler *c, Target *tyes, Target *tno, int expect)
 {
     Target *test = new Target(this, false, tyes, tno, gcTest);
+    test->set_expect(expect);
     Target *first = _test->compile(c, true, test);
     return first;
 }
@@ -1375,6 +1587,8 @@ CatchNode::compile(Compiler *c, bool value_used, Target *ts)
 		 new LiteralNode(int_type, e->exception_id(), *this),
 		 bool_type, *this);
 	    handler = compile_test(comparison, c, tcaught, handler);
+	    if (c->placing_blocks())
+		handler->make_cold();
 	}
     }
   
@@ -1405,6 +1619,13 @@ CodeNode::compile(Compiler *, bool value_used, Target *ts)
 }
 
 
+Target *
+CounterNode::compile(Compiler *, bool value_used, Target *ts)
+{
+    assert(!value_used);
+    return new Target(this, false, ts);
+}
+
 Target *
 VtblNode::compile(Compiler *c, bool value_used, Target *ts)
 {
@@ -1545,9 +1766,10 @@ Node::decr_usage(void *)
   /* Check for case when this Node has actually been optimized away and doesn't
      appear as a Fork. If so, it hasn't had its usage incremented -- so don't
      decrement it; rather, decrement its children with mark_usage. */
-  if (_usage > 0)
+  if (_usage > 0) {
+    save_state();
     _usage--;
-  else
+  } else
     mark_usage();
 }
 
@@ -1578,8 +1800,10 @@ Node::fix_outline(void *v)
 {
   NodeOutlineFixer *nof = (NodeOutlineFixer *)v;
   
-  if (outline_epoch() != nof->outline_epoch() && !nof->_novel_ok)
+  if (outline_epoch() != nof->outline_epoch() && !nof->_novel_ok) {
+    save_state();
     _betweenliner.change_outline(nof->_new_outline);
+  }
   
   NodeOutlineFixer newnof(false, _betweenliner);
   traverse(&Node::fix_outline, &newnof);
@@ -1707,6 +1931,148 @@ CallNode::callable_analysis(void *)
 }
 
 
+/*****
+ * warm_analysis
+ **/
+
+// A rule is warm if some call to it isn't in outlined code. Rules that
+// aren't warm are compiled as cold functions. Outlines are found the way
+// fix_outline will find them: only branch destinations can start a new
+// outline, and other nodes inherit their parent's.
+
+struct NodeWarmth {
+  
+  bool _novel_ok;
+  int _outline_epoch;
+  bool _cold;
+  
+  NodeWarmth(bool ok, int epoch, bool cold)
+    : _novel_ok(ok), _outline_epoch(epoch), _cold(cold) { }
+  NodeWarmth at(const Node *) const;
+  
+};
+
+NodeWarmth
+NodeWarmth::at(const Node *n) const
+{
+  if (_novel_ok && n->outline_epoch() != _outline_epoch)
+    return NodeWarmth(false, n->outline_epoch(), n->betweenliner().cold());
+  else
+    return NodeWarmth(false, _outline_epoch, _cold);
+}
+
+void
+Node::warm_analysis()
+{
+  NodeWarmth w(false, outline_epoch(), false);
+  warm_analysis(&w);
+}
+
+void
+Node::warm_analysis(void *v)
+{
+  NodeWarmth w = ((NodeWarmth *)v)->at(this);
+  traverse(&Node::warm_analysis, &w);
+}
+
+void
+SemistrictNode::warm_analysis(void *v)
+{
+  NodeWarmth w = ((NodeWarmth *)v)->at(this);
+  _left->warm_analysis(&w);
+  
+  w._novel_ok = true;
+  _right->warm_analysis(&w);
+}
+
+void
+ConditionalNode::warm_analysis(void *v)
+{
+  NodeWarmth w = ((NodeWarmth *)v)->at(this);
+  _test->warm_analysis(&w);
+  
+  w._novel_ok = true;
+  _yes->warm_analysis(&w);
+  _no->warm_analysis(&w);
+}
+
+static void
+warm_analysis_children(Rule *r)
+{
+    Ruleset *base_ruleset = r->actual()->find_ruleset(r->origin());
+    int ruleindex = r->ruleindex();
+    for (Ruleset *rs = base_ruleset->child(); rs; rs = rs->sibling()) {
+	r = rs->rule(ruleindex);
+	if (!r->warm())
+	    r->warm_analysis();
+	warm_analysis_children(r);
+    }
+}
+
+void
+CallNode::warm_analysis(void *v)
+{
+    NodeWarmth w = ((NodeWarmth *)v)->at(this);
+    if (!w._cold) {
+	Rule *r = (_fixed_rule ? _rule : _rule->version_in(_rule->receiver_class()));
+	if (!r->warm())
+	    r->warm_analysis();
+	if (!r->leaf() && !_fixed_rule)
+	    warm_analysis_children(r);
+    }
+    traverse(&Node::warm_analysis, &w);
+}
+
+
+/*****
+ * count_field_accesses
+ **/
+
+// Counts the slots a rule touches for --layout=hot. Code run only in cold
+// outlines doesn't count. A dynamic dispatch reads the receiver's vtbl.
+
+struct FieldAccessCount {
+  
+  int _group;
+  unsigned long _weight;
+  
+  FieldAccessCount(int g, unsigned long w) : _group(g), _weight(w) { }
+  
+};
+
+void
+Node::count_field_accesses(int group, unsigned long weight)
+{
+  FieldAccessCount fac(group, weight);
+  count_field_accesses(&fac);
+}
+
+void
+Node::count_field_accesses(void *v)
+{
+  traverse(&Node::count_field_accesses, v);
+}
+
+void
+FieldNode::count_field_accesses(void *v)
+{
+  FieldAccessCount *fac = (FieldAccessCount *)v;
+  if (!betweenliner().cold() && _field->is_slot() && _field->is_in_object())
+    _field->count_access(fac->_group, fac->_weight);
+  traverse(&Node::count_field_accesses, v);
+}
+
+void
+CallNode::count_field_accesses(void *v)
+{
+    FieldAccessCount *fac = (FieldAccessCount *)v;
+    Rule *r = (_fixed_rule ? _rule : _rule->version_in(_rule->receiver_class()));
+    if (!betweenliner().cold() && !r->leaf() && !_fixed_rule)
+	_rule->origin()->count_vtbl_access(fac->_group, fac->_weight);
+    traverse(&Node::count_field_accesses, v);
+}
+
+
 /*****
  * gen_prototypes
  **/
@@ -1728,14 +2094,118 @@ CallNode::gen_prototypes(void *v)
 {
     Compiler *c = (Compiler *)v;
     Rule *rule = (_fixed_rule ? _rule : _rule->version_in(_rule->receiver_class()));
-    if (_fixed_rule || rule->leaf()) {
-	rule->mark_gen();
-	rule->gen_prototype(c->proto_out, true);
-    }
+    if (_tail_recursion)
+	/* a jump, not a call: the rule needn't be generated */;
+    else if (_fixed_rule || rule->leaf())
+	c->gen_prototype(rule);
+    else if (Rule *guess = guessed_rule())
+	c->gen_prototype(guess);
     traverse(&Node::gen_prototypes, v);
 }
 
 
+/*****
+ * remark_lowering
+ **/
+
+// Makes remarks about how calls and exceptions left in an optimized body
+// will be compiled, following the decisions CallNode::gen_value_real and
+// CatchNode::compile make.
+
+struct LoweringRemarks {
+  
+  Compiler *_compiler;
+  Vector<CatchNode *> _catches;
+  
+  LoweringRemarks(Compiler *c) : _compiler(c) { }
+  
+};
+
+void
+Node::remark_lowering(Compiler *c)
+{
+    LoweringRemarks lr(c);
+    remark_lowering(&lr);
+}
+
+void
+Node::remark_lowering(void *v)
+{
+    traverse(&Node::remark_lowering, v);
+}
+
+void
+CallNode::remark_lowering(void *v)
+{
+    Compiler *c = ((LoweringRemarks *)v)->_compiler;
+    if (Rule *general = _rule->specialized_from()) {
+	Writer w(0);
+	if (_rule->is_static() && !general->is_static())
+	    w << "copy of `" << general << "' taking its object's fields "
+	      << "as parameters";
+	else
+	    w << "specialization of `" << general << "' for constant arguments";
+	char *message = w.steal_buf();
+	c->remark(remarkSpecialize, *this, _rule, message);
+	delete[] message;
+    }
+    if (_tail_recursion)
+	c->remark(remarkTailCall, *this, _rule,
+		  "tail call turned into a jump");
+    else if (!_rule->is_static()
+	     && !_rule->version_in(_rule->origin())->leaf()) {
+	if (Rule *fixed = fixed_rule())
+	    c->remark(remarkDevirtualize, *this, fixed,
+		      "devirtualized: receiver class is known");
+	else if (Rule *guess = guessed_rule())
+	    c->remark(remarkDevirtualize, *this, guess, "devirtualized: "
+		      "called directly when the receiver is the likeliest class");
+	else
+	    c->remark(remarkDevirtualize, *this, _rule,
+		      "not devirtualized: dispatched through the vtbl");
+    }
+    traverse(&Node::remark_lowering, v);
+}
+
+void
+ExceptionNode::remark_lowering(void *v)
+{
+    LoweringRemarks *lr = (LoweringRemarks *)v;
+    
+    // A thrown exception jumps to the innermost handler catching it. An
+    // exception returned by a call is tested against every enclosing handler.
+    CatchNode *handler = 0;
+    for (int i = lr->_catches.size() - 1; i >= 0 && !handler; i--) {
+	CatchNode *catcher = lr->_catches[i];
+	if (catcher->catch_all() || !_exception
+	    || catcher->exception_set().contains(_exception))
+	    handler = catcher;
+    }
+    
+    Writer w(0);
+    if (_exception)
+	w << "exception `" << _exception->name() << "' ";
+    else
+	w << "exception from call ";
+    if (handler)
+	w << "lowered to a goto to the handler at line " << handler->landmark().line();
+    else
+	w << "lowered to a return code";
+    char *message = w.steal_buf();
+    lr->_compiler->remark(remarkException, *this, 0, message);
+    delete[] message;
+}
+
+void
+CatchNode::remark_lowering(void *v)
+{
+    LoweringRemarks *lr = (LoweringRemarks *)v;
+    lr->_catches.push_back(this);
+    _child->remark_lowering(v);
+    lr->_catches.pop_back();
+}
+
+
 /*****
  * count_operations
  **/
@@ -1786,20 +2256,188 @@ SelfNode::count_operations(void *)
 }
 
 
+/*****
+ * write_cache_key
+ **/
+
+struct NodeCacheKeyWriter {
+  
+  Writer &_w;
+  Vector<int> _epochs;
+  
+  NodeCacheKeyWriter(Writer &w)		: _w(w) { }
+  int epoch_index(int);
+  
+};
+
+int
+NodeCacheKeyWriter::epoch_index(int epoch)
+{
+  // Outline epochs are allocated globally, so number them in the order this
+  // tree uses them.
+  for (int i = 0; i < _epochs.size(); i++)
+    if (_epochs[i] == epoch)
+      return i;
+  _epochs.push_back(epoch);
+  return _epochs.size() - 1;
+}
+
+static void
+write_exception_ids(Writer &w, const ExceptionSet &eset)
+{
+  w << '{';
+  for (Exception *e = eset.element(); e; e = eset.element(e))
+    w << ' ' << e->exception_id();
+  w << " }";
+}
+
+void
+Node::write_cache_key(Writer &w)
+{
+  w << wmexpandnodes(1) << this << wmexpandnodes(0) << wmendl;
+  NodeCacheKeyWriter nckw(w);
+  write_cache_key(&nckw);
+}
+
+void
+Node::write_cache_key(void *v)
+{
+  NodeCacheKeyWriter *nckw = (NodeCacheKeyWriter *)v;
+  nckw->_w << '[' << _type << ' ' << inline_level() << ' '
+	   << outline_level() << ' ' << nckw->epoch_index(outline_epoch())
+	   << ' ' << _betweenliner.expect() << ' ' << _temporary << "]\n";
+  traverse(&Node::write_cache_key, v);
+}
+
+void
+FieldNode::write_cache_key(void *v)
+{
+  Writer &w = ((NodeCacheKeyWriter *)v)->_w;
+  w << "field " << _field->compiled_name() << ' ' << _field->offset()
+    << (_is_static ? " static\n" : "\n");
+  Node::write_cache_key(v);
+}
+
+void
+CallNode::write_cache_key(void *v)
+{
+  // The callee's prototype and exceptions determine how the call is made;
+  // its rule index determines the vtbl slot for dynamic calls.
+  Writer &w = ((NodeCacheKeyWriter *)v)->_w;
+  w << "call " << _rule->ruleindex() << ' '
+    << _rule->origin()->gen_module_name()
+    << (_fixed_rule ? " fixed" : "") << (_tail_recursion ? " tail" : "")
+    << (_rule->dyn_dispatch() ? " dyn\n" : "\n");
+  if (_guess) {
+    w << "guess ";
+    _guess->gen_item_name(w);
+    w << wmendl;
+  }
+  if (Rule *fixed = fixed_rule())
+    fixed->gen_prototype(w, false);
+  else
+    _rule->gen_prototype(w, false);
+  write_exception_ids(w, _rule->all_exceptions());
+  w << wmendl;
+  Node::write_cache_key(v);
+}
+
+void
+BinaryNode::write_cache_key(void *v)
+{
+  ((NodeCacheKeyWriter *)v)->_w << "op " << (int)_op << "\n";
+  Node::write_cache_key(v);
+}
+
+void
+UnaryNode::write_cache_key(void *v)
+{
+  ((NodeCacheKeyWriter *)v)->_w << "op " << (int)_op << "\n";
+  Node::write_cache_key(v);
+}
+
+void
+ExceptionNode::write_cache_key(void *v)
+{
+  ((NodeCacheKeyWriter *)v)->_w << "exception "
+				<< (_exception ? _exception->exception_id() : -1)
+				<< "\n";
+  Node::write_cache_key(v);
+}
+
+void
+CatchNode::write_cache_key(void *v)
+{
+  Writer &w = ((NodeCacheKeyWriter *)v)->_w;
+  w << "catch" << (_catch_all ? " all " : " ");
+  write_exception_ids(w, _eset);
+  w << wmendl;
+  Node::write_cache_key(v);
+}
+
+void
+CodeNode::write_cache_key(void *v)
+{
+  // CodeNodes don't traverse their self and parameter nodes, but those are
+  // substituted into the generated code.
+  Writer &w = ((NodeCacheKeyWriter *)v)->_w;
+  _code->write_cache_key(w);
+  if (_pure)
+    w << "pure\n";
+  if (_self)
+    _self->write_cache_key(v);
+  w << "params " << _params.size() << "\n";
+  for (int i = 0; i < _params.size(); i++)
+    _params[i]->write_cache_key(v);
+  Node::write_cache_key(v);
+}
+
+void
+CounterNode::write_cache_key(void *v)
+{
+  ((NodeCacheKeyWriter *)v)->_w << "count " << _counter << "\n";
+  Node::write_cache_key(v);
+}
+
+void
+VtblNode::write_cache_key(void *v)
+{
+  ((NodeCacheKeyWriter *)v)->_w << "vtbl " << _vtbl_from->gen_module_name()
+				<< "\n";
+  Node::write_cache_key(v);
+}
+
+
 /*****
  * mark_tail_recursions
  **/
 
 static int tail_recursion_count;
+static Vector<CallNode *> *tail_calls;
+
+// True if the value of the current tail position is thrown away. Then the
+// right arm of `==>' is a tail position too: the arrow's own value, `true',
+// isn't needed.
+static bool tail_value_unused;
 
 int
 Node::mark_tail_recursions(Rule *rule)
 {
   tail_recursion_count = 0;
+  tail_value_unused = false;
   mark_tail_recursions((void *)rule);
   return tail_recursion_count;
 }
 
+void
+Node::grep_tail_calls(Vector<CallNode *> &v)
+{
+  tail_calls = &v;
+  tail_value_unused = false;
+  mark_tail_recursions((void *)0);
+  tail_calls = 0;
+}
+
 void
 Node::mark_tail_recursions(void *)
 {
@@ -1809,7 +2447,13 @@ void
 CallNode::mark_tail_recursions(void *v)
 {
   Rule *rule = (Rule *)v;
-  if (rule == _rule && !_call_of) {
+  // Inlining a rule into itself leaves explicit `self' objects behind.
+  SelfNode *self = _call_of ? _call_of->cast_self() : 0;
+  if (_call_of && (!self || self->super()))
+    /* not a call on self */;
+  else if (tail_calls)
+    tail_calls->push_back(this);
+  else if (rule == _rule && !_tail_recursion) {
     set_tail_recursion(true);
     tail_recursion_count++;
   }
@@ -1821,10 +2465,22 @@ LetNode::mark_tail_recursions(void *v)
   _body->mark_tail_recursions(v);
 }
 
+void
+CastNode::mark_tail_recursions(void *v)
+{
+  if (type() == void_type) {
+    bool old_unused = tail_value_unused;
+    tail_value_unused = true;
+    _child->mark_tail_recursions(v);
+    tail_value_unused = old_unused;
+  }
+}
+
 void
 SemistrictNode::mark_tail_recursions(void *v)
 {
-  if (op() == ',' || op() == opLogOr || op() == opLogAnd)
+  if (op() == ',' || op() == opLogOr || op() == opLogAnd
+      || (op() == opArrow && tail_value_unused))
     _right->mark_tail_recursions(v);
 }
 
@@ -1836,9 +2492,9 @@ ConditionalNode::mark_tail_recursions(void *v)
 }
 
 void
-LabelNode::mark_tail_recursions(void *v)
+LabelNode::mark_tail_recursions(void *)
 {
-  _child->mark_tail_recursions(v);
+  // Don't look inside: a tail call there would jump to this loop's head.
 }
 
 
@@ -2017,6 +2673,32 @@ SelfNode::simple_value() const
 }
 
 
+/*****
+ * must_throw
+ **/
+
+bool
+CallNode::must_throw() const
+{
+  return _rule->is_exception();
+}
+
+bool
+SemistrictNode::must_throw() const
+{
+  if (_op == ',')
+    return _left->must_throw() || _right->must_throw();
+  else
+    return false;
+}
+
+bool
+UnaryNode::must_throw() const
+{
+  return _op == opCopy && _child->must_throw();
+}
+
+
 /*****
  * GEN
  **/
@@ -2132,6 +2814,12 @@ VtblNode::gen_state_real(Compiler *c)
     _vtbl_from->gen_assign_vtbl(c, _object ? _object : self_node);
 }
 
+void
+CounterNode::gen_state_real(Compiler *c)
+{
+    c->out << PROFILE_COUNTS "[" << _counter << "]++;\n";
+}
+
 
 /*****
  * gen_value
@@ -2164,28 +2852,12 @@ LetNode::gen_value_real(Compiler *c, GenContext)
     return gctxNone;
 }
 
-GenContext
-CallNode::gen_value_real(Compiler *c, GenContext)
+void
+CallNode::gen_arguments(Compiler *c, Node *call_of, Module *rule_self)
 {
-    Node *call_of = _call_of ? _call_of : self_node;
-
-    // Find actual rule using receiver class analysis information
-    Rule *fixed = fixed_rule();
-    if (fixed) {
-	fixed->gen_name(c->out);
-	fixed->mark_gen();	// we will need to output this rule as a fn
-    } else {
-	assert(call_of->simple_value());
-	c->out << "((";
-	call_of->gen_value(c);
-	c->out << ")." << _rule->origin()->gen_self_vtbl_name() << "->"
-	       << _rule->basename() << ")" << "/*DYN*/";
-    }
-  
     c->out << "(";
     if (!_rule->is_static()) {
 	// Generate `This' argument, including cast, if necessary.
-	Module *rule_self = _rule->receiver_class();
 	Type *call_of_type = call_of->type();
 	if (!call_of_type) call_of_type = SelfNode::current_self_type;
 	if (rule_self != call_of_type->cast_module())
@@ -2200,6 +2872,48 @@ CallNode::gen_value_real(Compiler *c, GenContext)
 	_params[i]->gen_value(c);
     }
     c->out << ")";
+}
+
+GenContext
+CallNode::gen_value_real(Compiler *c, GenContext)
+{
+    Node *call_of = _call_of ? _call_of : self_node;
+
+    // Find actual rule using receiver class analysis information
+    Rule *fixed = fixed_rule();
+    Rule *guess = guessed_rule();
+    if (!_rule->is_static() && !_rule->version_in(_rule->origin())->leaf())
+	c->count_stat(fixed ? statDispatchResolved
+		      : (guess ? statDispatchGuarded : statDispatchIndirect));
+    
+    if (fixed) {
+	fixed->gen_name(c->out);
+	c->mark_gen(fixed);	// we will need to output this rule as a fn
+	gen_arguments(c, call_of, _rule->receiver_class());
+	return gctxNone;
+    }
+    
+    assert(call_of->simple_value());
+    if (guess) {
+	// Test for the likeliest receiver class's vtbl, and call its version
+	// of the rule directly if it's there.
+	c->out << "(((";
+	call_of->gen_value(c);
+	c->out << ")." << _rule->origin()->gen_self_vtbl_name() << " == &";
+	_guess->gen_item_name(c->out);
+	c->out << ") ? ";
+	guess->gen_name(c->out);
+	c->mark_gen(guess);
+	gen_arguments(c, call_of, guess->receiver_class());
+	c->out << " : ";
+    }
+    c->out << "((";
+    call_of->gen_value(c);
+    c->out << ")." << _rule->origin()->gen_self_vtbl_name() << "->"
+	   << _rule->basename() << ")" << "/*DYN*/";
+    gen_arguments(c, call_of, _rule->receiver_class());
+    if (guess)
+	c->out << ")";
   
     return gctxNone;
 }
@@ -5,6 +5,7 @@
 #include "rule.hh"
 #include "literal.hh"
 #include "operator.hh"
+#include "arena.hh"
 class PrototypeNode;
 class NamespaceNode;
 class VariableNode;
@@ -20,12 +21,14 @@ class ExceptionNode;
 class CatchNode;
 class LiteralNode;
 class SelfNode;
+class CodeNode;
 class Prototype;
 class Rule;
 class NodeOptimizer;
 class Compiler;
 class Target;
 class CodeBlock;
+class Ruleset;
 
 extern PermString star_string;
 
@@ -51,14 +54,18 @@ class Betweenliner { public:
     int inline_level() const		{ return _inline_level; }
     int outline_level() const		{ return _outline_level; }
     int outline_epoch() const		{ return _outline_epoch; }
+    int expect() const			{ return _expect; }
+    bool cold() const			{ return _outline_level >= 5; }
   
     Betweenliner &change_outline(Betweenliner);
+    Betweenliner expecting(int) const;
 
   private:
   
     signed char _inline_level;
     signed char _outline_level;
     short _outline_epoch;
+    signed char _expect;
   
     static short last_outline_epoch;
   
@@ -76,6 +83,8 @@ class Node {
   GenCode _gen_code;
   
   GenContext gen_value_temp(Compiler *);
+  void save_state();
+  static void save_child(Node *&);
 
 #ifdef CHECK_GEN
   int _n_gen_state;
@@ -86,11 +95,14 @@ class Node {
  public:
   
   static Betweenliner cur_betweenliner;
+  static unsigned long created_count;
   
   Node(Type *, Betweenliner, const Landmark &);
   Node(Type *, const Landmark &);
   Node(const Node &);
   virtual ~Node()			{ }
+  void *operator new(size_t size)	{ return Arena::allocate_current(size); }
+  void operator delete(void *)		{ }
   
   operator const Landmark &() const	{ return _landmark; }
   const Landmark &landmark() const	{ return _landmark; }
@@ -106,6 +118,7 @@ class Node {
   virtual bool interpolatable() const		{ return false; }
   virtual Node *state_wrap()			{ return this; }
   virtual Node *simple_value() const;
+  virtual bool must_throw() const		{ return false; }
   virtual Node *call_object() const;
   
   Node *type_convert(Type *, const Landmark &);
@@ -123,17 +136,29 @@ class Node {
   int count_operations();
   virtual void count_operations(void *);
   
+  // Write everything about an optimized tree that affects the code generated
+  // from it, for CompileCache keys.
+  void write_cache_key(Writer &);
+  virtual void write_cache_key(void *);
+  
   // USAGE AND TEMPORARIES
   
-  void reset_usage()			{ _usage = 0; }
-  void incr_usage()			{ _usage++; }
+  void reset_usage()			{ save_state(); _usage = 0; }
+  void incr_usage()			{ save_state(); _usage++; }
   void decr_usage(void * = 0);
   void mark_usage()			{ traverse(&Node::decr_usage, 0); }
   bool unequal_usage() const		{ return _usage > 0; }
   
   PermString temporary() const		{ return _temporary; }
   void make_temporary();
-  void make_temporary(PermString t)	{ _temporary = t; }
+  void make_temporary(PermString t)	{ save_state(); _temporary = t; }
+  
+  // Compiling a rule changes types, usage counts, temporaries, outline
+  // levels and test wrappers on Nodes shared with other rules. The Compiler saves their states while
+  // it works and restores them afterwards, so each rule is compiled the same
+  // way no matter which rules were compiled before it.
+  static void begin_saving_states();
+  static void restore_states();
 
   // ANALYSIS
   
@@ -143,7 +168,14 @@ class Node {
   void callable_analysis()		{ callable_analysis(0); }
   virtual void callable_analysis(void *);
   
+  void warm_analysis();
+  virtual void warm_analysis(void *);
+  
+  void count_field_accesses(int group, unsigned long weight);
+  virtual void count_field_accesses(void *);
+  
   int mark_tail_recursions(Rule *);
+  void grep_tail_calls(Vector<CallNode *> &);
   virtual void mark_tail_recursions(void *);
   void mark_param_usage(Vector<int> &);
   virtual void mark_param_usage(void *);
@@ -155,17 +187,20 @@ class Node {
   int outline_epoch() const	{ return _betweenliner.outline_epoch(); }
   
   Betweenliner betweenliner() const		{ return _betweenliner; }
-  void set_betweenliner(Betweenliner b)		{ _betweenliner = b; }
+  void set_betweenliner(Betweenliner b)	{ save_state(); _betweenliner = b; }
   
   void fix_outline();
   void gen_prototypes(Compiler *);
+  void remark_lowering(Compiler *);
   virtual void fix_outline(void *);
   virtual void gen_prototypes(void *);
+  virtual void remark_lowering(void *);
   
   virtual Node *optimize(NodeOptimizer *) const;
   virtual Target *compile(Compiler *, bool, Target *);
   
-  Target *compile_test(Node *&, Compiler *, Target *, Target *);
+  int arm_expect(const Node *) const;
+  Target *compile_test(Node *&, Compiler *, Target *, Target *, int = 0);
   
   // GENERATING
   
@@ -202,6 +237,7 @@ class Node {
   
   virtual PrototypeNode *cast_prototype()	{ return 0; }
   virtual NamespaceNode *cast_namespace()	{ return 0; }
+  virtual VariableNode *cast_variable()		{ return 0; }
   virtual FieldNode *cast_field()		{ return 0; }
   virtual CallNode *cast_call()			{ return 0; }
   virtual ConstructorNode *cast_constructor()	{ return 0; }
@@ -214,6 +250,7 @@ class Node {
   virtual CatchNode *cast_catch()		{ return 0; }
   virtual LiteralNode *cast_literal()		{ return 0; }
   virtual SelfNode *cast_self()			{ return 0; }
+  virtual CodeNode *cast_code()			{ return 0; }
   static bool is_self(const Node *n);
   
 };
@@ -299,7 +336,9 @@ class FieldNode: public Node {
   Node *call_object() const;
   
   void traverse(TraverseHook, void *);
+  void count_field_accesses(void *);
   Node *optimize(NodeOptimizer *) const;
+  void write_cache_key(void *);
   
   Target *compile(Compiler *, bool, Target *);
   GenContext gen_value_real(Compiler *, GenContext);
@@ -327,17 +366,25 @@ class CallNode : public Node { public:
     Rule *rule() const			{ return _rule; }
     Rule *fixed_rule() const;
     void change_rule(Rule *r) 		{ _rule = r; }
+    bool must_throw() const;
     ModuleID origin() const		{ return _rule->origin(); }
     int ruleindex() const		{ return _rule->ruleindex(); }
     bool tail_recursion() const		{ return _tail_recursion; }
     void set_tail_recursion(bool tr)	{ _tail_recursion = tr; }
+    Ruleset *guess() const		{ return _guess; }
+    void set_guess(Ruleset *rs)		{ _guess = rs; }
+    Rule *guessed_rule() const;
   
     void traverse(TraverseHook, void *);
     void receiver_class_analysis(void *);
     void callable_analysis(void *);
+    void warm_analysis(void *);
+    void count_field_accesses(void *);
     void mark_tail_recursions(void *);
     void gen_prototypes(void *);
+    void remark_lowering(void *);
     Node *optimize(NodeOptimizer *) const;
+    void write_cache_key(void *);
 
     Target *compile(Compiler *, bool, Target *);
     GenContext gen_value_real(Compiler *, GenContext);
@@ -352,9 +399,12 @@ class CallNode : public Node { public:
     Node *_call_of;
     Rule *_rule;
     Vector<Node *> _params;
+    Ruleset *_guess;
     bool _fixed_rule: 1;
     bool _tail_recursion: 1;
   
+    void gen_arguments(Compiler *, Node *, Module *);
+  
 };
 
 
@@ -389,6 +439,7 @@ class LetNode: public Node {
   void set_body(Node *);
   
   Node *simple_value() const;
+  bool must_throw() const		{ return _body->must_throw(); }
   
   void traverse(TraverseHook, void *);
   void mark_tail_recursions(void *);
@@ -412,6 +463,9 @@ class DeclarationNode: public Node {
   DeclarationNode(Node *, Node *, const Landmark &);
   DeclarationNode(Node *, Node *, const DeclarationNode &);
   
+  Node *variable() const		{ return _variable; }
+  Node *value() const			{ return _value; }
+  
   Node *simple_value() const;
   
   void traverse(TraverseHook, void *);
@@ -436,6 +490,9 @@ class VariableNode: public Node {
   
   VariableNode(PermString, Type *, const Landmark &);
   
+  static int uniqueifier_value()	{ return uniqueifier; }
+  static void set_uniqueifier(int u)	{ uniqueifier = u; }
+  
   PermString name() const		{ return _name; }
   
   bool lvalue() const			{ return true; }
@@ -451,6 +508,8 @@ class VariableNode: public Node {
   void write(Writer &) const;
   VariableNode *clone(const Landmark &) const;
   
+  VariableNode *cast_variable()		{ return this; }
+  
 };
 
 
@@ -498,6 +557,7 @@ class BinaryNode: public Node {
   
   void traverse(TraverseHook, void *);
   Node *optimize(NodeOptimizer *) const;
+  void write_cache_key(void *);
   
   Target *compile(Compiler *, bool, Target *);
   GenContext gen_value_real(Compiler *, GenContext);
@@ -518,11 +578,13 @@ class SemistrictNode: public BinaryNode {
   SemistrictNode(Node *, Node *, const SemistrictNode &);
   
   Node *simple_value() const;
+  bool must_throw() const;
   void count_operations(void *);
   
   Node *optimize(NodeOptimizer *) const;
   
   void fix_outline(void *);
+  void warm_analysis(void *);
   void mark_tail_recursions(void *);
   
   Target *compile(Compiler *, bool, Target *);
@@ -569,10 +631,13 @@ class ConditionalNode: public Node {
   Node *yes() const			{ return _yes; }
   Node *no() const			{ return _no; }
   
+  bool must_throw() const	{ return _yes->must_throw() && _no->must_throw(); }
+  
   void traverse(TraverseHook, void *);
   Node *optimize(NodeOptimizer *) const;
   
   void fix_outline(void *);
+  void warm_analysis(void *);
   void mark_tail_recursions(void *);
   
   Target *compile(Compiler *, bool, Target *);
@@ -602,12 +667,14 @@ class UnaryNode: public Node {
   bool fixed_run_time_type() const;
   bool interpolatable() const;
   Node *simple_value() const;
+  bool must_throw() const;
   
   Node *make_deref() const;
   Node *make_address() const;
   
   void traverse(TraverseHook, void *);
   Node *optimize(NodeOptimizer *) const;
+  void write_cache_key(void *);
   
   Target *compile(Compiler *, bool, Target *);
   bool must_gen_value() const		{ return _op.side_effects(); }
@@ -634,10 +701,12 @@ class CastNode: public Node {
   Node *child() const			{ return _child; }
 
   Node *simple_value() const;
+  bool must_throw() const		{ return _child->must_throw(); }
   bool interpolatable() const;
   void count_operations(void *);
 
   void traverse(TraverseHook, void *);
+  void mark_tail_recursions(void *);
   Node *optimize(NodeOptimizer *) const;
   
   Target *compile(Compiler *, bool, Target *);
@@ -659,11 +728,13 @@ class TestNode: public Node {
   
   TestNode(Node *);
   
+  Node *test() const			{ return _test; }
+  
   void traverse(TraverseHook, void *);
   Node *optimize(NodeOptimizer *) const;
   
   Target *compile(Compiler *, bool, Target *);
-  Target *compile_test(Compiler *, Target *, Target *);
+  Target *compile_test(Compiler *, Target *, Target *, int = 0);
   GenContext gen_value_real(Compiler *, GenContext);
   
   void write(Writer &) const;
@@ -683,8 +754,11 @@ class ExceptionNode: public Node {
   ExceptionNode(Exception *, const Landmark &);
   
   Exception *exception() const		{ return _exception; }
+  bool must_throw() const		{ return true; }
   
+  void remark_lowering(void *);
   Node *optimize(NodeOptimizer *) const;
+  void write_cache_key(void *);
   
   Target *compile(Compiler *, bool, Target *);
   GenContext gen_value_real(Compiler *, GenContext);
@@ -710,7 +784,9 @@ class CatchNode: public Node {
   Node *child() const			{ return _child; }
   
   void traverse(TraverseHook, void *);
+  void remark_lowering(void *);
   Node *optimize(NodeOptimizer *) const;
+  void write_cache_key(void *);
   
   Target *compile(Compiler *, bool, Target *);
   GenContext gen_value_real(Compiler *, GenContext);
@@ -733,6 +809,7 @@ class LiteralNode: public Node {
   LiteralNode(Type *, const Landmark &);
   LiteralNode(Type *, long, const Landmark &);
   
+  const Literal &literal() const	{ return _literal; }
   long vlong() const			{ return _literal.vlong(); }
   
   bool simple_type() const		{ return _literal.is_type(); }
@@ -756,16 +833,24 @@ class CodeNode: public Node {
   Node *_self;
   Vector<Node *> _params;
   bool _have_params;
+  bool _pure;
   
  public:
   
   CodeNode(CodeBlock *);
   CodeNode(Node *, const Vector<Node *> &, const CodeNode &);
   
+  CodeNode *cast_code()			{ return this; }
+  
   Node *simple_value() const;
+  CodeBlock *code() const		{ return _code; }
+  Node *code_self() const		{ return _self; }
   bool have_params() const		{ return _have_params; }
+  bool pure() const			{ return _pure; }
+  void set_pure()			{ _pure = true; }
   
   Node *optimize(NodeOptimizer *) const;
+  void write_cache_key(void *);
   Target *compile(Compiler *, bool, Target *);
   bool must_gen_state_real() const	{ return true; }
   void gen_state_real(Compiler *);
@@ -787,6 +872,26 @@ class VtblNode: public Node {
   
   void traverse(TraverseHook, void *);
   Node *optimize(NodeOptimizer *) const;
+  void write_cache_key(void *);
+  
+  Target *compile(Compiler *, bool, Target *);
+  bool must_gen_state_real() const	{ return true; }
+  void gen_state_real(Compiler *);
+  
+  void write(Writer &) const;
+  
+};
+
+
+class CounterNode: public Node {
+
+  int _counter;
+  
+ public:
+  
+  CounterNode(int counter, const Landmark &);
+  
+  void write_cache_key(void *);
   
   Target *compile(Compiler *, bool, Target *);
   bool must_gen_state_real() const	{ return true; }
@@ -859,29 +964,35 @@ LiteralNode *false_node(const Landmark &);
 
 inline
 Node::Node(Type *t, Betweenliner b, const Landmark &l)
-  : _type(t), _landmark(l), _betweenliner(b)
+  : _type(t), _landmark(l), _betweenliner(b),
+    _usage(0), _gen_code(gcNormal)
 #ifdef CHECK_GEN
   , _n_gen_state(0), _n_gen_value(0)
 #endif
 {
+  created_count++;
 }
 
 inline
 Node::Node(Type *t, const Landmark &l)
-  : _type(t), _landmark(l), _betweenliner(cur_betweenliner)
+  : _type(t), _landmark(l), _betweenliner(cur_betweenliner),
+    _usage(0), _gen_code(gcNormal)
 #ifdef CHECK_GEN
   , _n_gen_state(0), _n_gen_value(0)
 #endif
 {
+  created_count++;
 }
 
 inline
 Node::Node(const Node &n)
-  : _type(n._type), _landmark(n._landmark), _betweenliner(n._betweenliner)
+  : _type(n._type), _landmark(n._landmark), _betweenliner(n._betweenliner),
+    _usage(0), _gen_code(gcNormal)
 #ifdef CHECK_GEN
   , _n_gen_state(0), _n_gen_value(0)
 #endif
 {
+  created_count++;
 }
 
 inline bool
@@ -911,7 +1022,10 @@ LiteralNode::LiteralNode(Type *type, long value, const Landmark &lm)
 inline void
 Node::make_temporary()
 {
-  if (!_temporary) _temporary = star_string;
+  if (!_temporary) {
+    save_state();
+    _temporary = star_string;
+  }
 }
 
 inline Node *
@@ -29,6 +29,7 @@ enum OperatorValue {
   
   // Keywords
   opHas,
+  opLayout,
   opModule,
   opField,
   
@@ -68,6 +69,9 @@ enum OperatorValue {
   opInline,
   opPathinline,
   opOutline,
+  opLikely,
+  opUnlikely,
+  opPure,
   
   opIf,
   opLet,
@@ -249,7 +253,7 @@ Operator::module_op() const
 inline bool
 Operator::betweenliner() const
 {
-  return _op >= opNoinline && _op <= opOutline;
+  return _op >= opNoinline && _op <= opUnlikely;
 }
 
 inline bool
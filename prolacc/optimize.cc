@@ -9,6 +9,12 @@
 #include "operator.hh"
 #include "writer.hh"
 #include "field.hh"
+#include "profile.hh"
+#include "compiler.hh"
+#include "codeblock.hh"
+#include "prototype.hh"
+#include <cstring>
+#include <cstdio>
 
 Node *
 NodeOptimizer::to_static_constant(const Node *input, Module *me)
@@ -47,7 +53,8 @@ NodeOptimizer::to_integer_constant(const Node *input, Module *me, int &value)
 InlineOptimizer::InlineOptimizer(Node *self, int min_lev, int max_lev)
   : _self(self), _self_type(self ? self->type() : 0),
     _pass_self(0), _pass_self_type(0),
-    _min_inline_level(min_lev), _max_inline_level(max_lev), _inlining(false)
+    _min_inline_level(min_lev), _max_inline_level(max_lev), _inlining(false),
+    _profile(0), _remarks(0)
 {
 }
 
@@ -58,7 +65,7 @@ InlineOptimizer::InlineOptimizer(Node *self, Type *self_type,
   : _self(self), _self_type(self_type),
     _pass_self(0), _pass_self_type(pass_self_type),
     _min_inline_level(min_lev), _max_inline_level(max_lev), _inlining(true),
-    _param(param)
+    _profile(0), _remarks(0), _param(param)
 {
 }
 
@@ -147,15 +154,71 @@ InlineOptimizer::do_call(const CallNode *old_call)
   // specified; otherwise minimum level. Take _min_inline_level and
   // _max_inline_level into account.
   int level = (call_level < 0 ? module_level : call_level);
+  // `why' explains the level chosen, for remarks.
+  const char *why;
+  if (call_level >= 0)
+    why = "inline level given at the call";
+  else if (level == inlineDefault)
+    why = "rule is not marked inline";
+  else
+    why = (level >= inlineYes ? "rule is marked inline"
+	   : "rule is marked noinline");
+  
+  // A profile overrides module levels, though not call levels: hot rules are
+  // inlined, and cold rules that aren't trivial are called out of line.
+  if (_profile && _profile->has_counts() && call_level < 0) {
+    int heat = _profile->rule_heat(rule);
+    if (heat > 0 && level == inlineDefault) {
+      level = inlineYes;
+      why = "rule is hot in the profile";
+    } else if (heat < 0 && level == inlineYes && rule->body()
+	       && rule->body()->count_operations() > inlineTrivialNodeCount) {
+      level = inlineNo;
+      why = "rule is cold in the profile";
+    }
+  }
+  
+  // The inline budget promotes rules whose inlining it judged worthwhile.
+  if (level == inlineDefault && call_level < 0 && rule->budget_inline()) {
+    level = inlineYes;
+    why = "chosen by the inline budget";
+  }
+  
   if (_min_inline_level == inlinePath
-      || (_min_inline_level == inlineYes && level == inlineDefault))
+      || (_min_inline_level == inlineYes && level == inlineDefault)) {
     level = _min_inline_level;
-  if (level > _max_inline_level)
+    why = "inside an inline path";
+  }
+  if (level > _max_inline_level) {
     level = _max_inline_level;
+    if (level < inlineYes)
+      why = "inlining limited by -O";
+  }
   //if (_min_inline_level < inlineYes && rule->basename() == "fin_wait_1")
   //errwriter << rule << " " << level << " (" << call_level << "/" << module_level << "/" << (Type *)mn << " " << (void*)mn << " " << (void *)(mn->module()->base_modnames()) << ")" << " [" << _min_inline_level << "/" << _max_inline_level << "]" << wmendl;
   
   Node *body = rule->body();
+  if (_remarks) {
+    if (!body)
+      _remarks->remark(remarkNoInline, *old_call, rule,
+		       "not inlined: rule has no body");
+    else if (level < inlineYes) {
+      char buf[128];
+      sprintf(buf, "not inlined: %s", why);
+      _remarks->remark(remarkNoInline, *old_call, rule, buf);
+    } else if (rule->inlining())
+      _remarks->remark(remarkNoInline, *old_call, rule,
+		       "not inlined: call is recursive");
+    else if (!rule->leaf() && !old_call->fixed_rule())
+      _remarks->remark(remarkNoInline, *old_call, rule,
+		       "not inlined: call is dynamically dispatched");
+    else {
+      char buf[128];
+      sprintf(buf, "inlined: %s", why);
+      _remarks->remark(remarkInline, *old_call, rule, buf);
+    }
+  }
+  
   if (body && level >= inlineYes && !rule->inlining()
       && (rule->leaf() || old_call->fixed_rule())) {
     // Generate new variables to ensure that parameter expressions aren't
@@ -179,11 +242,15 @@ InlineOptimizer::do_call(const CallNode *old_call)
     // than the type we've cast `ob' to above.
     InlineOptimizer newopt(ob, ob_type, pass_self_type,
 			   next_min_level, _max_inline_level, param);
+    newopt._profile = _profile;
+    newopt._remarks = _remarks;
     rule->set_inlining(true);
     body = body->optimize(&newopt);
     rule->set_inlining(false);
     // Don't forget to change the type of `body' back to what it was before.
     body->change_type(old_call->type());
+    if (_profile && _profile->instrumenting())
+      body = ProfileOptimizer::count_rule(_profile, rule, body);
 
     if (call == 0)
       return body;
@@ -241,6 +308,20 @@ InlineOptimizer::do_self(const Node *n)
  * ConstOptimizer
  **/
 
+Node *
+ConstOptimizer::folded(const Node *from, Node *to, const char *message) const
+{
+  if (_remarks) {
+    char buf[64];
+    if (!message) {
+      sprintf(buf, "folded to constant %ld", to->cast_literal()->vlong());
+      message = buf;
+    }
+    _remarks->remark(remarkFold, *from, 0, message);
+  }
+  return to;
+}
+
 Node *
 ConstOptimizer::do_binary(const BinaryNode *b)
 {
@@ -259,52 +340,52 @@ ConstOptimizer::do_binary(const BinaryNode *b)
   switch ((int)b->op()) {
     
    case '+':
-    return new LiteralNode(t, lv + rv, *b);
+    return folded(b, new LiteralNode(t, lv + rv, *b));
     
    case '-':
-    return new LiteralNode(t, lv - rv, *b);
+    return folded(b, new LiteralNode(t, lv - rv, *b));
     
    case '*':
-    return new LiteralNode(t, lv * rv, *b);
+    return folded(b, new LiteralNode(t, lv * rv, *b));
     
    case '/':
-    return new LiteralNode(t, lv / rv, *b);
+    return folded(b, new LiteralNode(t, lv / rv, *b));
     
    case '%':
-    return new LiteralNode(t, lv % rv, *b);
+    return folded(b, new LiteralNode(t, lv % rv, *b));
     
    case '&':
-    return new LiteralNode(t, lv & rv, *b);
+    return folded(b, new LiteralNode(t, lv & rv, *b));
     
    case '^':
-    return new LiteralNode(t, lv ^ rv, *b);
+    return folded(b, new LiteralNode(t, lv ^ rv, *b));
 
    case '|':
-    return new LiteralNode(t, lv | rv, *b);
+    return folded(b, new LiteralNode(t, lv | rv, *b));
     
    case opLeftShift:
-    return new LiteralNode(t, lv << rv, *b);
+    return folded(b, new LiteralNode(t, lv << rv, *b));
     
    case opRightShift:
-    return new LiteralNode(t, lv >> rv, *b);
+    return folded(b, new LiteralNode(t, lv >> rv, *b));
 
    case opEq:
-    return new LiteralNode(t, lv == rv, *b);
+    return folded(b, new LiteralNode(t, lv == rv, *b));
     
    case opNotEq:
-    return new LiteralNode(t, lv != rv, *b);
+    return folded(b, new LiteralNode(t, lv != rv, *b));
     
    case opLt:
-    return new LiteralNode(t, lv < rv, *b);
+    return folded(b, new LiteralNode(t, lv < rv, *b));
     
    case opLeq:
-    return new LiteralNode(t, lv <= rv, *b);
+    return folded(b, new LiteralNode(t, lv <= rv, *b));
     
    case opGt:
-    return new LiteralNode(t, lv > rv, *b);
+    return folded(b, new LiteralNode(t, lv > rv, *b));
     
    case opGeq:
-    return new LiteralNode(t, lv >= rv, *b);
+    return folded(b, new LiteralNode(t, lv >= rv, *b));
     
    default:
     return (Node *)b;
@@ -329,23 +410,24 @@ ConstOptimizer::do_semistrict(const SemistrictNode *ss)
     
    case opLogAnd:
     if (lv)
-      return r;
+      return folded(ss, r, "left side is always true");
     else
-      return new LiteralNode(bool_type, 0L, *ss);
+      return folded(ss, new LiteralNode(bool_type, 0L, *ss));
     
    case opLogOr:
     if (lv)
-      return new LiteralNode(bool_type, 1L, *ss);
+      return folded(ss, new LiteralNode(bool_type, 1L, *ss));
     else
-      return r;
+      return folded(ss, r, "left side is always false");
     
    case opArrow:
     if (lv) {
       Node *true_node = new LiteralNode(bool_type, 1L, *ss);
-      return
-	do_semistrict(new SemistrictNode(r, ',', true_node, bool_type, *ss));
+      return folded(ss, do_semistrict(new SemistrictNode
+				      (r, ',', true_node, bool_type, *ss)),
+		    "condition is always true");
     } else
-      return new LiteralNode(bool_type, 0L, *ss);
+      return folded(ss, new LiteralNode(bool_type, 0L, *ss));
     
    default:
     assert(0);
@@ -366,7 +448,7 @@ ConstOptimizer::do_unary(const UnaryNode *u)
   
   Type *t = l->type();
   if (u->op() == '!' && t == bool_type)
-    return new LiteralNode(t, !l->vlong(), *u);
+    return folded(u, new LiteralNode(t, !l->vlong(), *u));
   
   if (!t || !t->cast_arithmetic())
     return (Node *)u;
@@ -376,7 +458,7 @@ ConstOptimizer::do_unary(const UnaryNode *u)
   switch ((int)u->op()) {
     
    case '-':
-    return new LiteralNode(t, -lv, *u);
+    return folded(u, new LiteralNode(t, -lv, *u));
 
    default:
     return (Node *)u;
@@ -410,9 +492,564 @@ ConstOptimizer::do_conditional(const ConditionalNode *cond)
     return (Node *)cond;
   
   if (c->vlong())
-    return cond->yes();
+    return folded(cond, cond->yes(), "condition is always true");
   else
-    return cond->no();
+    return folded(cond, cond->no(), "condition is always false");
+}
+
+
+/*****
+ * ProfileOptimizer
+ **/
+
+/* When instrumenting, ProfileOptimizer adds counters to the test and the yes
+   (or right) arm of each branch. When using a profile, it outlines arms the
+   profile says are rarely taken, as if they were marked `outline'. It runs
+   after inlining, so every inlined copy of a branch shares its counters. */
+
+Node *
+ProfileOptimizer::count_rule(Profile *profile, Rule *rule, Node *body)
+{
+  int counter = profile->counter(Profile::rule_key(rule));
+  return new SemistrictNode(new CounterNode(counter, *body), ',', body,
+			    body->type(), *body);
+}
+
+Node *
+ProfileOptimizer::count(PermString key, Node *n) const
+{
+  int counter = _profile->counter(key);
+  return new SemistrictNode(new CounterNode(counter, *n), ',', n, n->type(),
+			    *n);
+}
+
+void
+ProfileOptimizer::outline(Node *arm, const Node *branch) const
+{
+  // Leave arms with outline levels of their own alone.
+  if (arm->outline_epoch() == branch->outline_epoch()) {
+    arm->set_betweenliner(Betweenliner(false, 5, arm->betweenliner()));
+    if (_remarks)
+      _remarks->remark(remarkOutline, *arm, 0,
+		       "outlined: arm is rarely taken in the profile");
+  }
+}
+
+Node *
+ProfileOptimizer::do_semistrict(const SemistrictNode *ss)
+{
+  if (ss->op() != opLogAnd && ss->op() != opLogOr && ss->op() != opArrow)
+    return (Node *)ss;
+  
+  if (_profile->instrumenting())
+    return new SemistrictNode(count(Profile::enter_key(*ss), ss->left()),
+			      count(Profile::taken_key(*ss), ss->right()),
+			      *ss);
+  
+  if (_profile->cold_arm(*ss, true))
+    outline(ss->right(), ss);
+  return (Node *)ss;
+}
+
+Node *
+ProfileOptimizer::do_conditional(const ConditionalNode *cond)
+{
+  if (_profile->instrumenting())
+    return new ConditionalNode(count(Profile::enter_key(*cond), cond->test()),
+			       count(Profile::taken_key(*cond), cond->yes()),
+			       cond->no(), *cond);
+  
+  if (_profile->cold_arm(*cond, true))
+    outline(cond->yes(), cond);
+  else if (_profile->cold_arm(*cond, false))
+    outline(cond->no(), cond);
+  return (Node *)cond;
+}
+
+
+/*****
+ * CSEOptimizer
+ **/
+
+// CSEOptimizer finds values computed again while an earlier computation of
+// them still holds: no store, call or code block has run since, and the
+// earlier computation always runs first. A first pass finds which values are
+// computed again. A second pass stores the first computation of each in a
+// new variable, as `let' would, and makes the later computations read it.
+//
+// Values are keyed by their structure. Keys mention variables as `$NAME$',
+// so assigning a variable forgets only the values that use it. Loads from
+// memory are marked in keys too. Storing to a field forgets loads of that
+// field and loads through pointers, since distinct fields never overlap; any
+// other store, and any call, forgets every load. Code blocks forget
+// everything unless they're marked `pure'.
+//
+// Values an arm forgets stay forgotten after it, except in an arm that runs
+// only when that arm didn't, like the rest of `(A ==> B) || C' after `B'.
+
+CSEOptimizer::CSEOptimizer()
+  : _key_map(-1), _address_taken(false), _rewriting(false), _nvalues(0)
+{
+}
+
+Node *
+CSEOptimizer::optimize(Node *n)
+{
+  n->optimize(this);
+  int nbind = 0;
+  for (int i = 0; i < _bind.size(); i++)
+    nbind += _bind[i];
+  if (!nbind)
+    return n;
+  
+  _keys.clear();
+  _ordinals.clear();
+  _temps.clear();
+  _live.clear();
+  _prev.clear();
+  _killed.clear();
+  _last_arm_killed.clear();
+  _key_map.clear();
+  _address_taken = false;
+  _rewriting = true;
+  _nvalues = 0;
+  return n->optimize(this);
+}
+
+bool
+CSEOptimizer::write_key(Node *n, Writer &w) const
+{
+  if (!n) {
+    w << "(self)";
+    return true;
+  }
+  
+  // A variable we bound stands for the value it holds.
+  VariableNode *var = n->cast_variable();
+  SemistrictNode *binding = n->cast_semistrict();
+  if (binding && binding->op() == ',')
+    var = binding->right()->cast_variable();
+  if (var && _temp_keys[var->temporary()]) {
+    w << _temp_keys[var->temporary()];
+    return true;
+  }
+  
+  w << '(' << (void *)n->type() << ' ';
+  if (var && !binding)
+    w << '$' << var->temporary() << '$';
+  
+  else if (FieldNode *field = n->cast_field()) {
+    w << "field " << (void *)field->field() << "$ ";
+    if (!write_key(field->field_of(), w))
+      return false;
+    
+  } else if (BinaryNode *binary = n->cast_binary()) {
+    Operator op = binary->op();
+    if (binary->cast_semistrict() || op == '=' || op.side_effects())
+      return false;
+    w << (op == '[' ? "mem op " : "op ") << (int)op << ' ';
+    if (!write_key(binary->left(), w) || !write_key(binary->right(), w))
+      return false;
+    
+  } else if (UnaryNode *unary = n->cast_unary()) {
+    Operator op = unary->op();
+    if (op == opCopy || op.side_effects())
+      return false;
+    w << (op == opDeref ? "mem op " : "op ") << (int)op << ' ';
+    if (!write_key(unary->child(), w))
+      return false;
+    
+  } else if (CastNode *cast = n->cast_cast()) {
+    if (n->type() == void_type)
+      return false;
+    w << "cast ";
+    if (!write_key(cast->child(), w))
+      return false;
+    
+  } else if (LiteralNode *literal = n->cast_literal()) {
+    if (literal->simple_type())
+      return false;
+    literal->literal().gen(w);
+    
+  } else if (n->cast_self())
+    w << "self";
+  
+  else
+    return false;
+  
+  w << ')';
+  return true;
+}
+
+PermString
+CSEOptimizer::value_key(Node *n) const
+{
+  Vector<char> key;
+  Writer w(0);
+  w.set_capture(&key);
+  if (!write_key(n, w))
+    return PermString();
+  w << wmendl;
+  return PermString(key.begin(), key.size() - 1);
+}
+
+bool
+CSEOptimizer::in_lvalue(const Node *n) const
+{
+  // A location whose operands changed was rebuilt, so look for nodes like
+  // it. This can also catch its operands, which is safe.
+  FieldNode *field = ((Node *)n)->cast_field();
+  UnaryNode *unary = ((Node *)n)->cast_unary();
+  for (int i = 0; i < _lvalues.size(); i++) {
+    Node *l = (Node *)_lvalues[i];
+    if (!l || l == n)
+      return true;
+    if (field && l->cast_field() && l->cast_field()->field() == field->field())
+      return true;
+    if (unary && l->cast_unary() && l->cast_unary()->op() == unary->op())
+      return true;
+  }
+  return false;
+}
+
+Node *
+CSEOptimizer::reference(int i, Node *n)
+{
+  if (!_rewriting) {
+    // Remember to store the first computation.
+    _bind[_ordinals[i]] = 1;
+    return n;
+  }
+  
+  assert(_temps[i]);
+  VariableNode *var = new VariableNode("_cse", n->type(), *n);
+  var->make_temporary(_temps[i]);
+  var->set_betweenliner(n->betweenliner());
+  return var;
+}
+
+Node *
+CSEOptimizer::bind(int i, Node *n)
+{
+  VariableNode *var = new VariableNode("_cse", n->type(), *n);
+  _temps[i] = var->temporary();
+  _temp_keys.insert(_temps[i], _keys[i]);
+  var->set_betweenliner(n->betweenliner());
+  
+  Node *decl = new DeclarationNode(var, n, *n);
+  decl->set_betweenliner(n->betweenliner());
+  Node *binding = new SemistrictNode(decl, ',', var, n->type(), *n);
+  binding->set_betweenliner(n->betweenliner());
+  return binding;
+}
+
+Node *
+CSEOptimizer::value(Node *n)
+{
+  Type *type = n->type();
+  if (type == void_type || type->cast_module() || n->temporary()
+      || in_lvalue(n))
+    return n;
+  PermString key = value_key(n);
+  if (!key)
+    return n;
+  
+  int i = _key_map[key];
+  if (i >= 0 && _live[i])
+    return reference(i, n);
+  
+  // Values computed inside a location aren't available to later code.
+  if (_lvalues.size())
+    return n;
+  int ordinal = _nvalues++;
+  if (!_rewriting)
+    _bind.push_back(0);
+  _key_map.insert(key, _keys.size());
+  _prev.push_back(i);
+  _keys.push_back(key);
+  _ordinals.push_back(ordinal);
+  _temps.push_back(PermString());
+  _live.push_back(1);
+  
+  if (_rewriting && _bind[ordinal])
+    return bind(_keys.size() - 1, n);
+  return n;
+}
+
+void
+CSEOptimizer::kill_entry(int i)
+{
+  if (_live[i]) {
+    _live[i] = 0;
+    _killed.push_back(i);
+  }
+}
+
+void
+CSEOptimizer::kill(PermString variable)
+{
+  PermString mention;
+  if (variable)
+    mention = permprintf("$%p$", variable.capsule());
+  for (int i = 0; i < _keys.size(); i++)
+    if (!variable || strstr(_keys[i].c_str(), mention.c_str()))
+      kill_entry(i);
+}
+
+void
+CSEOptimizer::kill_memory(Field *field)
+{
+  // Once a variable's address is taken, memory stores can change it.
+  if (_address_taken) {
+    kill();
+    return;
+  }
+  char mention[64];
+  sprintf(mention, "field %p$", (void *)field);
+  for (int i = 0; i < _keys.size(); i++) {
+    const char *key = _keys[i].c_str();
+    if (strstr(key, "mem op ") || strstr(key, field ? mention : "field "))
+      kill_entry(i);
+  }
+}
+
+void
+CSEOptimizer::kill_store(Node *location)
+{
+  if (VariableNode *var = location->cast_variable())
+    kill(var->temporary());
+  else if (FieldNode *field = location->cast_field())
+    kill_memory(field->field());
+  else if ((location->cast_unary() && location->cast_unary()->op() == opDeref)
+	   || (location->cast_binary() && location->cast_binary()->op() == '['))
+    kill_memory();
+  else
+    kill();
+}
+
+void
+CSEOptimizer::begin_arm(bool exclusive)
+{
+  _arms.push_back(_keys.size());
+  _arm_kills.push_back(_killed.size());
+  _revived_arms.push_back(_revived.size());
+  if (exclusive)
+    for (int j = 0; j < _last_arm_killed.size(); j++) {
+      int i = _last_arm_killed[j];
+      if (!_live[i]) {
+	_live[i] = 1;
+	_revived.push_back(i);
+      }
+    }
+}
+
+void
+CSEOptimizer::end_arm()
+{
+  // Values revived for an exclusive arm die again, since the arm before it
+  // might have run instead.
+  int r = _revived_arms.back();
+  _revived_arms.pop_back();
+  for (int j = r; j < _revived.size(); j++)
+    kill_entry(_revived[j]);
+  _revived.resize(r);
+  
+  // Forget values computed in the arm. Anything the arm killed stays dead.
+  int n = _arms.back();
+  _arms.pop_back();
+  int k = _arm_kills.back();
+  _arm_kills.pop_back();
+  _last_arm_killed.clear();
+  for (int j = k; j < _killed.size(); j++)
+    if (_killed[j] < n && !_live[_killed[j]])
+      _last_arm_killed.push_back(_killed[j]);
+  
+  for (int i = _keys.size() - 1; i >= n; i--)
+    if (_key_map[_keys[i]] == i)
+      _key_map.insert(_keys[i], _prev[i]);
+  _keys.resize(n);
+  _ordinals.resize(n);
+  _temps.resize(n);
+  _live.resize(n);
+  _prev.resize(n);
+}
+
+Node *
+CSEOptimizer::do_call(const CallNode *call)
+{
+  // Rules can't reach our variables unless their addresses were taken.
+  kill_memory();
+  return (Node *)call;
+}
+
+Node *
+CSEOptimizer::do_binary(const BinaryNode *binary)
+{
+  return value((Node *)binary);
+}
+
+Node *
+CSEOptimizer::do_effect(const EffectNode *effect)
+{
+  kill_store(effect->left());
+  return (Node *)effect;
+}
+
+Node *
+CSEOptimizer::do_unary(const UnaryNode *unary)
+{
+  Operator op = unary->op();
+  if (op.side_effects()) {
+    kill_store(unary->child());
+    return (Node *)unary;
+  } else if (op == opAddress) {
+    if (unary->child()->cast_variable())
+      _address_taken = true;
+    return (Node *)unary;
+  } else if (op == opCopy)
+    return (Node *)unary;
+  else
+    return value((Node *)unary);
+}
+
+Node *
+CSEOptimizer::do_field(const FieldNode *field)
+{
+  return value((Node *)field);
+}
+
+Node *
+CSEOptimizer::do_declaration(const DeclarationNode *decl)
+{
+  VariableNode *var = decl->variable()->cast_variable();
+  if (var)
+    kill(var->temporary());
+  return (Node *)decl;
+}
+
+Node *
+CSEOptimizer::do_code(const CodeNode *code)
+{
+  if (!code->pure())
+    kill();
+  return (Node *)code;
+}
+
+
+/*****
+ * KillFinder
+ **/
+
+// KillFinder finds whether code can make CSEOptimizer forget values.
+
+bool
+KillFinder::may_kill(const Node *n)
+{
+  KillFinder finder;
+  n->optimize(&finder);
+  return finder.kills();
+}
+
+Node *
+KillFinder::do_call(const CallNode *call)
+{
+  _kills = true;
+  return (Node *)call;
+}
+
+Node *
+KillFinder::do_effect(const EffectNode *effect)
+{
+  _kills = true;
+  return (Node *)effect;
+}
+
+Node *
+KillFinder::do_unary(const UnaryNode *unary)
+{
+  if (unary->op().side_effects())
+    _kills = true;
+  return (Node *)unary;
+}
+
+Node *
+KillFinder::do_declaration(const DeclarationNode *decl)
+{
+  _kills = true;
+  return (Node *)decl;
+}
+
+Node *
+KillFinder::do_code(const CodeNode *code)
+{
+  if (!code->pure())
+    _kills = true;
+  return (Node *)code;
+}
+
+
+/*****
+ * Devirtualizer
+ **/
+
+// A dispatch receiver class analysis can't resolve is guarded with a test for
+// the receiver class it most likely sees, and that class's version of the
+// rule is called directly. Without a profile, that class is the receiver class
+// the program hooked up. With one, it's the class whose version ran most, as
+// long as it ran more than all the others together.
+
+static void
+grep_dispatch_rulesets(Ruleset *rs, Vector<Ruleset *> &result)
+{
+  if (rs->any_dynamic())
+    result.push_back(rs);
+  for (Ruleset *child = rs->child(); child; child = child->sibling())
+    grep_dispatch_rulesets(child, result);
+}
+
+Node *
+Devirtualizer::do_call(const CallNode *old_call)
+{
+  Rule *rule = old_call->rule();
+  if (rule->is_static() || old_call->fixed_rule())
+    return (Node *)old_call;
+  
+  Ruleset *guess = rule->receiver_class()->find_ruleset(rule->origin());
+  if (!guess || !guess->any_dynamic())
+    return (Node *)old_call;
+  
+  if (_profile && _profile->has_counts()) {
+    Vector<Ruleset *> rsets;
+    grep_dispatch_rulesets(guess, rsets);
+    
+    // Rulesets that don't override the rule share their parent's version;
+    // count each version once.
+    Vector<Rule *> versions;
+    unsigned long total = 0, best = 0;
+    for (int i = 0; i < rsets.size(); i++) {
+      Rule *version = rsets[i]->rule(rule->ruleindex());
+      int j = 0;
+      while (j < versions.size() && versions[j] != version)
+	j++;
+      if (j < versions.size())
+	continue;
+      versions.push_back(version);
+      
+      unsigned long count = _profile->count(Profile::rule_key(version));
+      total += count;
+      if (count > best) {
+	best = count;
+	guess = rsets[i];
+      }
+    }
+    if (total && best * 2 <= total)
+      return (Node *)old_call;
+  }
+  
+  CallNode *call = new CallNode
+    (old_call->call_of(), old_call->parameters(), *old_call);
+  call->set_guess(guess);
+  return call;
 }
 
 
@@ -564,7 +1201,7 @@ TailRecursionFixer::TailRecursionFixer(Rule *r)
 Node *
 TailRecursionFixer::do_call(const CallNode *call)
 {
-  if (!call->tail_recursion())
+  if (!call->tail_recursion() || call->rule() != _body_of)
     return (Node *)call;
   Rule *rule = call->rule();
   
@@ -658,18 +1295,500 @@ TailRecursionFixer::do_param(const ParamNode *param)
 }
 
 
+/*****
+ * TailCallInliner
+ **/
+
+TailCallInliner::TailCallInliner(Rule *r, Node *self)
+  : _body_of(r), _inliner(self, inlineYes, inlineYes)
+{
+}
+
+Rule *
+TailCallInliner::callee(const CallNode *call)
+{
+  Rule *rule = call->fixed_rule();
+  if (!rule && call->rule()->leaf())
+    rule = call->rule();
+  return rule;
+}
+
+bool
+TailCallInliner::calls_back(Rule *rule) const
+{
+  if (rule == _body_of || !rule->body() || rule->inlining())
+    return false;
+  Vector<CallNode *> calls;
+  rule->body()->grep_tail_calls(calls);
+  for (int i = 0; i < calls.size(); i++)
+    if (callee(calls[i]) == _body_of)
+      return true;
+  return false;
+}
+
+Node *
+TailCallInliner::inline_tail_calls(Node *body)
+{
+  // Inline each rule that tail-calls back into this one. Its call back
+  // becomes a tail recursion, which TailRecursionFixer turns into a loop.
+  body->grep_tail_calls(_calls);
+  int n = 0;
+  for (int i = 0; i < _calls.size(); i++)
+    if (Rule *rule = callee(_calls[i]))
+      if (calls_back(rule))
+	_calls[n++] = _calls[i];
+  _calls.resize(n);
+  if (!n)
+    return body;
+  
+  _body_of->set_inlining(true);
+  body = body->optimize(this);
+  _body_of->set_inlining(false);
+  return body;
+}
+
+Node *
+TailCallInliner::do_call(const CallNode *call)
+{
+  for (int i = 0; i < _calls.size(); i++)
+    if (_calls[i] == call)
+      return _inliner.do_call(call);
+  return (Node *)call;
+}
+
+
+/*****
+ * CallSiteCounter
+ **/
+
+CallSiteCounter::CallSiteCounter(Rule *caller)
+  : _self_type(caller->receiver_class()->default_modnames()),
+    _arm_depth(0), _loop_depth(0)
+{
+}
+
+Node *
+CallSiteCounter::do_call(const CallNode *call)
+{
+  Node *ob = call->call_of();
+  Type *ob_type = (ob && !ob->cast_self() ? ob->type() : _self_type);
+  ModuleNames *mn = ob_type->cast_modnames();
+  
+  Rule *rule = call->fixed_rule();
+  if (!rule && mn)
+    rule = mn->find_rule(call->origin(), call->ruleindex());
+  if (!rule)
+    rule = call->rule();
+  
+  // A tail recursion is a jump, not a call.
+  if (call->tail_recursion())
+    return (Node *)call;
+  
+  CallSite site;
+  site.callee = rule;
+  if (!mn || !(rule->leaf() || call->fixed_rule()))
+    site.level = inlineNo;
+  else if (call->inline_level() >= 0)
+    site.level = call->inline_level();
+  else
+    site.level = mn->inline_level(rule);
+  // Only calls left at the default inline level are the budget's to decide.
+  site.candidate = site.level == inlineDefault && call->inline_level() < 0;
+  site.overhead = 1 + call->param_count();
+  site.constant_args = 0;
+  for (int i = 0; i < call->param_count(); i++) {
+    Node *p = call->param(i);
+    while (CastNode *cast = p->cast_cast())
+      p = cast->child();
+    if (p->cast_literal())
+      site.constant_args++;
+  }
+  
+  // Estimate how often the call runs, in eighths of a run of the caller:
+  // each conditional arm halves it, and each loop multiplies it by 4.
+  int arms = (_arm_depth > 3 ? 3 : _arm_depth);
+  int loops = (_loop_depth > 3 ? 3 : _loop_depth);
+  site.frequency = (8 << (2 * loops)) >> arms;
+  
+  _sites.push_back(site);
+  return (Node *)call;
+}
+
+Node *
+CallSiteCounter::do_label(const LabelNode *label)
+{
+  _loop_depth--;
+  return (Node *)label;
+}
+
+
+
+/*****
+ * Specializer
+ **/
+
+// Specializer finds calls that pass constants to rules called out of line.
+// Given the clones made for some of them, it redirects those calls to the
+// clones, dropping the constant arguments.
+
+Specializer::Specializer(Rule *caller, int max_level,
+			 const HashMap<PermString, Rule *> *clones)
+  : _self_type(caller->receiver_class()->default_modnames()),
+    _max_level(max_level), _clones(clones), _loops(false)
+{
+}
+
+bool
+Specializer::constant_call(const CallNode *call, ConstantCall &cc) const
+{
+  if (call->tail_recursion() || ((CallNode *)call)->cast_constructor()
+      || !call->param_count())
+    return false;
+  
+  Node *ob = call->call_of();
+  Type *ob_type = (ob && !ob->cast_self() ? ob->type() : _self_type);
+  ModuleNames *mn = ob_type->cast_modnames();
+  Rule *rule = call->fixed_rule();
+  if (!rule && mn)
+    rule = mn->find_rule(call->origin(), call->ruleindex());
+  if (!mn || !rule || !(rule->leaf() || call->fixed_rule())
+      || rule->implicit() || rule->constructor() || rule->is_exception()
+      || !rule->body() || rule->param_count() != call->param_count())
+    return false;
+  
+  // Calls that will be inlined get the constants anyway.
+  int level = call->inline_level();
+  if (level < 0) {
+    level = mn->inline_level(rule);
+    if (level == inlineDefault && rule->budget_inline())
+      level = inlineYes;
+  }
+  if (level > _max_level)
+    level = _max_level;
+  if (level >= inlineYes)
+    return false;
+  
+  Vector<char> key;
+  Writer w(0);
+  w.set_capture(&key);
+  w << (void *)rule;
+  cc.callee = rule;
+  cc.constants.assign(call->param_count(), 0);
+  bool any = false;
+  for (int i = 0; i < call->param_count(); i++) {
+    Node *p = call->param(i);
+    while (CastNode *cast = p->cast_cast())
+      p = cast->child();
+    LiteralNode *lit = p->cast_literal();
+    Type *t = (lit ? lit->type() : 0);
+    if (t && (t->cast_arithmetic() || t == bool_type)
+	&& !rule->param(i)->assigned()) {
+      w << ' ' << (void *)t << ':' << lit->vlong();
+      cc.constants[i] = call->param(i);
+      any = true;
+    } else
+      w << " -";
+  }
+  w << wmendl;
+  cc.key = PermString(key.begin(), key.size() - 1);
+  return any;
+}
+
+Node *
+Specializer::do_call(const CallNode *call)
+{
+  ConstantCall cc;
+  if (!constant_call(call, cc))
+    return (Node *)call;
+  
+  if (!_clones) {
+    _calls.push_back(cc);
+    return (Node *)call;
+  }
+  
+  Rule *clone = (*_clones)[cc.key];
+  if (!clone)
+    return (Node *)call;
+  CallNode *new_call = new CallNode(call->call_of(), clone, call->type(),
+				    true, call->betweenliner(), *call);
+  for (int i = 0; i < call->param_count(); i++)
+    if (!cc.constants[i])
+      new_call->add_param(call->param(i));
+  return new_call;
+}
+
+Node *
+Specializer::do_label(const LabelNode *label)
+{
+  _loops = true;
+  return (Node *)label;
+}
+
+
+/*****
+ * ScalarReplacer
+ **/
+
+// ScalarReplacer finds calls on objects constructed just for them, like
+// `Output(tcb).run', whose callees are called out of line. Given clones of
+// those callees that take the object's fields as parameters, it redirects the
+// calls to the clones, so the object is never passed by address.
+
+ScalarReplacer::ScalarReplacer(int max_level,
+			       const HashMap<PermString, Rule *> *clones)
+  : _max_level(max_level), _clones(clones)
+{
+}
+
+bool
+ScalarReplacer::object_call(const CallNode *call, ObjectCall &oc) const
+{
+  // The object must be a constructor temporary, which ConstructorFixer left
+  // as `(constructor _ctor_T ...), _ctor_T'. Nothing else can refer to it.
+  SemistrictNode *ss = (call->call_of() ? call->call_of()->cast_semistrict()
+			: 0);
+  if (!ss || ss->op() != ',' || call->tail_recursion())
+    return false;
+  ConstructorNode *ctor = ss->left()->cast_constructor();
+  VariableNode *var = ss->right()->cast_variable();
+  if (!ctor || !var || ctor->call_of() != var || var->name() != "_ctor_T")
+    return false;
+  
+  ModuleNames *mn = var->type()->cast_modnames();
+  Rule *rule = call->fixed_rule();
+  if (!rule && mn)
+    rule = mn->find_rule(call->origin(), call->ruleindex());
+  if (!mn || !rule || rule->is_static() || rule->implicit()
+      || rule->constructor() || rule->is_exception() || !rule->body()
+      || rule->param_count() != call->param_count())
+    return false;
+  
+  // Calls that will be inlined have their objects' fields inlined anyway.
+  int level = call->inline_level();
+  if (level < 0) {
+    level = mn->inline_level(rule);
+    if (level == inlineDefault && rule->budget_inline())
+      level = inlineYes;
+  }
+  if (level > _max_level)
+    level = _max_level;
+  if (level >= inlineYes)
+    return false;
+  
+  Vector<char> key;
+  Writer w(0);
+  w.set_capture(&key);
+  w << (void *)rule << ' ' << (void *)mn << wmendl;
+  oc.callee = rule;
+  oc.object_type = mn;
+  oc.key = PermString(key.begin(), key.size() - 1);
+  return true;
+}
+
+Node *
+ScalarReplacer::do_call(const CallNode *call)
+{
+  ObjectCall oc;
+  if (!object_call(call, oc))
+    return (Node *)call;
+  
+  if (!_clones) {
+    _calls.push_back(oc);
+    return (Node *)call;
+  }
+  
+  Rule *clone = (*_clones)[oc.key];
+  if (!clone)
+    return (Node *)call;
+  
+  // Construct the object, then pass the clone the fields it uses.
+  SemistrictNode *ss = call->call_of()->cast_semistrict();
+  Node *object = ss->right();
+  CallNode *new_call = new CallNode(0, clone, call->type(), true,
+				    call->betweenliner(), *call);
+  for (int i = 0; i < call->param_count(); i++)
+    new_call->add_param(call->param(i));
+  for (int i = 0; i < clone->object_field_count(); i++)
+    new_call->add_param(new FieldNode(object, clone->object_field(i), false,
+				      *call));
+  return new SemistrictNode(ss->left(), ',', new_call, new_call->type(),
+			    *call);
+}
+
+
+/*****
+ * EscapeAnalyzer
+ **/
+
+// EscapeAnalyzer decides whether a rule's object escapes: whether it uses
+// `self' other than to read or write the object's scalar fields, to call
+// rules that will be inlined and don't let it escape either, or in code
+// blocks that name only its slots. Static fields and static rules don't use
+// the object at all. It collects the fields used.
+
+EscapeAnalyzer::EscapeAnalyzer(ModuleNames *self_type, int max_level,
+			       Vector<Field *> &fields)
+  : _self_type(self_type), _min_level(inlineNo), _max_level(max_level),
+    _fields(fields), _self_uses(0), _field_uses(0), _escapes(false)
+{
+}
+
+void
+EscapeAnalyzer::walk(Rule *rule)
+{
+  rule->set_inlining(true);
+  rule->body()->optimize(this);
+  rule->set_inlining(false);
+}
+
+bool
+EscapeAnalyzer::escapes(Rule *rule)
+{
+  _fields.clear();
+  _self_uses = _field_uses = 0;
+  _escapes = false;
+  walk(rule);
+  return _escapes || _self_uses != _field_uses;
+}
+
+Node *
+EscapeAnalyzer::do_self(const Node *self)
+{
+  // `super' picks a parent's rule, which an object of the derived type
+  // would not.
+  SelfNode *s = (self ? ((Node *)self)->cast_self() : 0);
+  if (s && s->super())
+    _escapes = true;
+  _self_uses++;
+  return (Node *)self;
+}
+
+void
+EscapeAnalyzer::use_field(Field *f)
+{
+  // The clone copies scalar slots; a slot holding a module, or an ancestor,
+  // would be used as an object in its own right.
+  if (f->is_static() || f->is_import())
+    return;
+  if (!f->is_slot() || f->type()->cast_module()) {
+    _escapes = true;
+    return;
+  }
+  for (int i = 0; i < _fields.size(); i++)
+    if (_fields[i] == f)
+      return;
+  _fields.push_back(f);
+}
+
+Node *
+EscapeAnalyzer::do_field(const FieldNode *field)
+{
+  Node *ob = field->field_of();
+  if (ob && !ob->cast_self())
+    return (Node *)field;
+  
+  if (!field->is_static())
+    use_field(field->field());
+  _field_uses++;
+  return (Node *)field;
+}
+
+Node *
+EscapeAnalyzer::do_unary(const UnaryNode *unary)
+{
+  // The address of a field would outlive the clone's copy of the object.
+  if (unary->op() == opAddress)
+    if (FieldNode *field = unary->child()->cast_field())
+      if (!field->field_of() || field->field_of()->cast_self())
+	_escapes = true;
+  return (Node *)unary;
+}
+
+Node *
+EscapeAnalyzer::do_call(const CallNode *call)
+{
+  Node *ob = call->call_of();
+  if (ob && !ob->cast_self())
+    return (Node *)call;
+  
+  Rule *rule = call->fixed_rule();
+  if (!rule)
+    rule = _self_type->find_rule(call->origin(), call->ruleindex());
+  if (rule->is_static()) {
+    _field_uses++;
+    return (Node *)call;
+  }
+  
+  // A tail recursion jumps back with the same object.
+  if (call->tail_recursion() && rule->inlining()) {
+    _field_uses++;
+    return (Node *)call;
+  }
+  
+  // Calls on the object must be inlined into the clone, just as
+  // InlineOptimizer will.
+  int level = call->inline_level();
+  if (level < 0) {
+    level = _self_type->inline_level(rule);
+    if (level == inlineDefault && rule->budget_inline())
+      level = inlineYes;
+  }
+  if (_min_level == inlinePath
+      || (_min_level == inlineYes && level == inlineDefault))
+    level = _min_level;
+  if (level > _max_level)
+    level = _max_level;
+  if (level < inlineYes || call->tail_recursion() || !rule->body()
+      || rule->inlining() || !(rule->leaf() || call->fixed_rule())) {
+    _escapes = true;
+    return (Node *)call;
+  }
+  
+  int old_min_level = _min_level;
+  _min_level = (level == inlinePath ? inlineYes : inlineNo);
+  if (_min_level < old_min_level)
+    _min_level = old_min_level;
+  walk(rule);
+  _min_level = old_min_level;
+  _field_uses++;
+  return (Node *)call;
+}
+
+Node *
+EscapeAnalyzer::do_code(const CodeNode *code)
+{
+  // A code block given its object explicitly has already counted it.
+  Node *ob = code->code_self();
+  if (code->have_params()) {
+    if (ob && !ob->cast_self())
+      return (Node *)code;
+    _field_uses++;
+  }
+  
+  Vector<Field *> slots;
+  if (!code->code()->self_slots(slots))
+    _escapes = true;
+  for (int i = 0; i < slots.size(); i++)
+    use_field(slots[i]);
+  return (Node *)code;
+}
+
+
 /*****
  * ExceptionCounter
  **/
 
-ExceptionCounter::ExceptionCounter(ExceptionSet &eset)
-  : _eset(eset)
+ExceptionCounter::ExceptionCounter(ExceptionSet &eset,
+				   ExceptionWorklist *worklist)
+  : _eset(eset), _worklist(worklist)
 {
 }
 
 Node *
 ExceptionCounter::do_call(const CallNode *call)
 {
+  if (_worklist)
+    _worklist->read(call->rule());
   _eset += call->rule()->all_exceptions();
   return (Node *)call;
 }
@@ -812,8 +1931,42 @@ ParamReplacer::do_param(const ParamNode *p)
     return (Node *)p;
 }
 
+Node *
+ParamReplacer::do_code(const CodeNode *c)
+{
+  if (!c->have_params())
+    return new CodeNode(_self, _param, *c);
+  else
+    return (Node *)c;
+}
+
 Node *
 ParamReplacer::do_self(const Node *)
 {
   return _self;
 }
+
+
+/*****
+ * ParamSpecializer
+ **/
+
+// ParamSpecializer makes the body of a rule's specialization: parameters
+// become the constants passed, or the specialization's own parameters. Code
+// blocks, which name parameters directly, are given them explicitly, as when
+// the rule is inlined.
+
+Node *
+ParamSpecializer::do_param(const ParamNode *p)
+{
+  return _param[ p->number() ];
+}
+
+Node *
+ParamSpecializer::do_code(const CodeNode *c)
+{
+  if (!c->have_params())
+    return new CodeNode(_self, _param, *c);
+  else
+    return (Node *)c;
+}
@@ -1,6 +1,9 @@
 #ifndef OPTIMIZE_HH
 #define OPTIMIZE_HH
 #include "node.hh"
+class Profile;
+class Compiler;
+class ExceptionWorklist;
 
 class NodeOptimizer {
   
@@ -19,12 +22,25 @@ class NodeOptimizer {
   virtual Node *do_cast(const CastNode *n)		{ return (Node *)n; }
   virtual Node *do_conditional(const ConditionalNode *n){ return (Node *)n; }
   virtual Node *do_let(const LetNode *n)		{ return (Node *)n; }
+  virtual Node *do_declaration(const DeclarationNode *n){ return (Node *)n; }
   virtual Node *do_exception(const ExceptionNode *n)	{ return (Node *)n; }
   virtual Node *do_catch(const CatchNode *n)		{ return (Node *)n; }
   virtual Node *do_code(const CodeNode *n)		{ return (Node *)n; }
   virtual Node *do_label(const LabelNode *n)		{ return (Node *)n; }
   virtual Node *do_self(const Node *n = 0)		{ return (Node *)n; }
   
+  // Nodes are optimized in evaluation order. Code between begin_arm and
+  // end_arm might not run; an exclusive arm runs only when the arm that
+  // just ended did not. The location an assignment, `&', `++' or `--'
+  // uses is optimized between begin_lvalue and end_lvalue; a null location
+  // means everything until end_lvalue, as for a code block's operands.
+  // begin_loop precedes code that tail recursions jump back to.
+  virtual void begin_arm(bool exclusive = false)	{ (void) exclusive; }
+  virtual void end_arm()				{ }
+  virtual void begin_lvalue(const Node *)		{ }
+  virtual void end_lvalue()				{ }
+  virtual void begin_loop()				{ }
+  
   static Node *to_static_constant(const Node *, Module *);
   static bool to_integer_constant(const Node *, Module *, int &);
   
@@ -41,6 +57,8 @@ class InlineOptimizer: public NodeOptimizer {
   int _min_inline_level;
   int _max_inline_level;
   bool _inlining;
+  Profile *_profile;
+  Compiler *_remarks;
   
   Vector<Node *> _param;
   
@@ -53,6 +71,9 @@ class InlineOptimizer: public NodeOptimizer {
   
   InlineOptimizer(Node *, int, int);
   
+  void set_profile(Profile *p)		{ _profile = p; }
+  void set_remarks(Compiler *c)		{ _remarks = c; }
+  
   Node *do_call(const CallNode *);
   Node *do_param(const ParamNode *);
   Node *do_code(const CodeNode *);
@@ -63,9 +84,13 @@ class InlineOptimizer: public NodeOptimizer {
 
 class ConstOptimizer: public NodeOptimizer {
   
+  Compiler *_remarks;
+  
+  Node *folded(const Node *, Node *, const char * = 0) const;
+  
  public:
   
-  ConstOptimizer()			{ }
+  ConstOptimizer(Compiler *c = 0)	: _remarks(c) { }
   
   Node *do_binary(const BinaryNode *);
   Node *do_semistrict(const SemistrictNode *);
@@ -76,6 +101,120 @@ class ConstOptimizer: public NodeOptimizer {
 };
 
 
+class ProfileOptimizer: public NodeOptimizer {
+  
+  Profile *_profile;
+  Compiler *_remarks;
+  
+  Node *count(PermString, Node *) const;
+  void outline(Node *, const Node *) const;
+  
+ public:
+  
+  ProfileOptimizer(Profile *p)		: _profile(p), _remarks(0) { }
+  
+  void set_remarks(Compiler *c)		{ _remarks = c; }
+  
+  static Node *count_rule(Profile *, Rule *, Node *);
+  
+  Node *do_semistrict(const SemistrictNode *);
+  Node *do_conditional(const ConditionalNode *);
+  
+};
+
+
+class CSEOptimizer: public NodeOptimizer {
+  
+  Vector<PermString> _keys;
+  Vector<int> _ordinals;
+  Vector<PermString> _temps;
+  Vector<int> _live;
+  Vector<int> _prev;
+  HashMap<PermString, int> _key_map;
+  HashMap<PermString, PermString> _temp_keys;
+  
+  Vector<const Node *> _lvalues;
+  Vector<int> _arms;
+  Vector<int> _arm_kills;
+  Vector<int> _killed;
+  Vector<int> _last_arm_killed;
+  Vector<int> _revived;
+  Vector<int> _revived_arms;
+  bool _address_taken;
+  
+  bool _rewriting;
+  int _nvalues;
+  Vector<int> _bind;
+  
+  bool write_key(Node *, Writer &) const;
+  PermString value_key(Node *) const;
+  bool in_lvalue(const Node *) const;
+  Node *reference(int, Node *);
+  Node *bind(int, Node *);
+  Node *value(Node *);
+  void kill_entry(int);
+  void kill(PermString variable = PermString());
+  void kill_memory(Field * = 0);
+  void kill_store(Node *);
+  
+ public:
+  
+  CSEOptimizer();
+  
+  Node *optimize(Node *);
+  
+  Node *do_call(const CallNode *);
+  Node *do_binary(const BinaryNode *);
+  Node *do_effect(const EffectNode *);
+  Node *do_unary(const UnaryNode *);
+  Node *do_field(const FieldNode *);
+  Node *do_declaration(const DeclarationNode *);
+  Node *do_code(const CodeNode *);
+  
+  void begin_arm(bool exclusive);
+  void end_arm();
+  void begin_lvalue(const Node *n)	{ _lvalues.push_back(n); }
+  void end_lvalue()			{ _lvalues.pop_back(); }
+  void begin_loop()			{ kill(); }
+  
+};
+
+class KillFinder: public NodeOptimizer {
+  
+  bool _kills;
+  
+ public:
+  
+  KillFinder()				: _kills(false) { }
+  
+  bool kills() const			{ return _kills; }
+  static bool may_kill(const Node *);
+  
+  Node *do_call(const CallNode *);
+  Node *do_effect(const EffectNode *);
+  Node *do_unary(const UnaryNode *);
+  Node *do_declaration(const DeclarationNode *);
+  Node *do_code(const CodeNode *);
+  
+  void begin_loop()			{ _kills = true; }
+  
+};
+
+
+class Devirtualizer: public NodeOptimizer {
+  
+  Profile *_profile;
+  
+ public:
+  
+  Devirtualizer(Profile *p)		: _profile(p) { }
+  
+  Node *do_call(const CallNode *);
+  Node *do_constructor(const ConstructorNode *n){ return (Node *)n; }
+  
+};
+
+
 /* these optimization passes are done as part of resolution */
    
 class ParentFixer: public NodeOptimizer {
@@ -131,13 +270,158 @@ class TailRecursionFixer: public NodeOptimizer {
   
 };
 
+class TailCallInliner: public NodeOptimizer {
+  
+  Rule *_body_of;
+  InlineOptimizer _inliner;
+  Vector<CallNode *> _calls;
+  
+  static Rule *callee(const CallNode *);
+  bool calls_back(Rule *) const;
+  
+ public:
+  
+  TailCallInliner(Rule *r, Node *self);
+  
+  Node *inline_tail_calls(Node *);
+  
+  Node *do_call(const CallNode *);
+  
+};
+
+struct CallSite {
+  
+  Rule *callee;
+  int level;		// inline level, or inlineNo if it can't be inlined
+  bool candidate;	// left at the default inline level
+  int overhead;		// operations the call itself costs
+  int constant_args;
+  int frequency;	// in eighths of a run of the caller
+  
+};
+
+class CallSiteCounter: public NodeOptimizer {
+  
+  ModuleNames *_self_type;
+  int _arm_depth;
+  int _loop_depth;
+  Vector<CallSite> _sites;
+  
+ public:
+  
+  CallSiteCounter(Rule *caller);
+  
+  const Vector<CallSite> &sites() const	{ return _sites; }
+  
+  void begin_arm(bool)			{ _arm_depth++; }
+  void end_arm()			{ _arm_depth--; }
+  void begin_loop()			{ _loop_depth++; }
+  
+  Node *do_call(const CallNode *);
+  Node *do_label(const LabelNode *);
+  
+};
+
+// A call passing constants to a rule that is called out of line. Calls
+// with the same callee and constants share a key; `constants' holds the
+// constant arguments, and null for the others.
+struct ConstantCall {
+  
+  Rule *callee;
+  PermString key;
+  Vector<Node *> constants;
+  
+};
+
+class Specializer: public NodeOptimizer {
+  
+  ModuleNames *_self_type;
+  int _max_level;
+  const HashMap<PermString, Rule *> *_clones;
+  Vector<ConstantCall> _calls;
+  bool _loops;
+  
+  bool constant_call(const CallNode *, ConstantCall &) const;
+  
+ public:
+  
+  Specializer(Rule *caller, int max_level,
+	      const HashMap<PermString, Rule *> *clones = 0);
+  
+  const Vector<ConstantCall> &calls() const	{ return _calls; }
+  bool loops() const			{ return _loops; }
+  
+  Node *do_call(const CallNode *);
+  Node *do_label(const LabelNode *);
+  
+};
+
+// A call on an object constructed for that call alone, as in
+// `Output(tcb).run', whose callee is called out of line. Calls with the same
+// callee and object type share a key; `fields' lists the fields the callee
+// uses, if its object does not escape.
+struct ObjectCall {
+  
+  Rule *callee;
+  Type *object_type;
+  PermString key;
+  Vector<Field *> fields;
+  
+};
+
+class ScalarReplacer: public NodeOptimizer {
+  
+  int _max_level;
+  const HashMap<PermString, Rule *> *_clones;
+  Vector<ObjectCall> _calls;
+  
+  bool object_call(const CallNode *, ObjectCall &) const;
+  
+ public:
+  
+  ScalarReplacer(int max_level, const HashMap<PermString, Rule *> *clones = 0);
+  
+  const Vector<ObjectCall> &calls() const	{ return _calls; }
+  
+  Node *do_call(const CallNode *);
+  
+};
+
+class EscapeAnalyzer: public NodeOptimizer {
+  
+  ModuleNames *_self_type;
+  int _min_level;
+  int _max_level;
+  Vector<Field *> &_fields;
+  int _self_uses;
+  int _field_uses;
+  bool _escapes;
+  
+  void walk(Rule *);
+  void use_field(Field *);
+  
+ public:
+  
+  EscapeAnalyzer(ModuleNames *, int max_level, Vector<Field *> &);
+  
+  bool escapes(Rule *);
+  
+  Node *do_self(const Node *);
+  Node *do_field(const FieldNode *);
+  Node *do_unary(const UnaryNode *);
+  Node *do_call(const CallNode *);
+  Node *do_code(const CodeNode *);
+  
+};
+
 class ExceptionCounter: public NodeOptimizer {
   
   ExceptionSet &_eset;
+  ExceptionWorklist *_worklist;
   
  public:
   
-  ExceptionCounter(ExceptionSet &);
+  ExceptionCounter(ExceptionSet &, ExceptionWorklist * = 0);
   
   Node *do_call(const CallNode *);
   Node *do_exception(const ExceptionNode *);
@@ -188,15 +472,37 @@ class ParamReplacer: public NodeOptimizer {
   ParamReplacer(Node *, const Vector<Node *> &);
   
   Node *do_param(const ParamNode *);
+  Node *do_code(const CodeNode *);
   Node *do_self(const Node * = 0);
   
 };
 
 
+class ParamSpecializer: public NodeOptimizer {
+  
+  Node *_self;
+  Vector<Node *> _param;
+  
+ public:
+  
+  ParamSpecializer(Node *, const Vector<Node *> &);
+  
+  Node *do_param(const ParamNode *);
+  Node *do_code(const CodeNode *);
+  
+};
+
+
 inline
 ParamReplacer::ParamReplacer(Node *s, const Vector<Node *> &p)
   : _self(s), _param(p)
 {
 }
 
+inline
+ParamSpecializer::ParamSpecializer(Node *s, const Vector<Node *> &p)
+  : _self(s), _param(p)
+{
+}
+
 #endif
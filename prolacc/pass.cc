@@ -0,0 +1,160 @@
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include "pass.hh"
+#include "arena.hh"
+#include "node.hh"
+#include "writer.hh"
+#include <lcdf/vector.hh>
+#include <cassert>
+#include <cstdio>
+#include <ctime>
+#ifdef HAVE_UNISTD_H
+# include <sys/time.h>
+#endif
+
+struct PassRecord {
+
+  const char *name;
+  int depth;
+  double wall;
+  unsigned long allocations;
+  unsigned long bytes;
+  unsigned long peak;
+  unsigned long nodes;
+  unsigned long rules;
+  unsigned long iterations;
+
+  Arena *arena;
+  Arena *old_arena;
+  size_t old_peak;
+
+};
+
+static Vector<PassRecord> passes;
+static Vector<int> open_passes;
+static unsigned long rule_count;
+static unsigned long iteration_count;
+
+
+double
+wall_time()
+{
+#ifdef HAVE_UNISTD_H
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1000000.;
+#else
+  return time(0);
+#endif
+}
+
+void
+begin_pass(const char *name)
+{
+  PassRecord p;
+  p.name = name;
+  p.depth = open_passes.size();
+  p.arena = 0;
+  p.old_arena = 0;
+  if (p.depth == 0) {
+    p.arena = new Arena(name);
+    p.old_arena = Arena::enter(p.arena);
+  }
+  p.old_peak = Arena::reset_peak();
+
+  // Counters hold their starting values until end_pass.
+  p.allocations = Arena::allocations();
+  p.bytes = Arena::allocated_bytes();
+  p.nodes = Node::created_count;
+  p.rules = rule_count;
+  p.iterations = iteration_count;
+  p.peak = 0;
+  p.wall = wall_time();
+
+  open_passes.push_back(passes.size());
+  passes.push_back(p);
+}
+
+void
+end_pass()
+{
+  assert(open_passes.size());
+  PassRecord &p = passes[open_passes.back()];
+  open_passes.pop_back();
+
+  p.wall = wall_time() - p.wall;
+  p.allocations = Arena::allocations() - p.allocations;
+  p.bytes = Arena::allocated_bytes() - p.bytes;
+  p.nodes = Node::created_count - p.nodes;
+  p.rules = rule_count - p.rules;
+  p.iterations = iteration_count - p.iterations;
+  p.peak = Arena::peak();
+  Arena::restore_peak(p.old_peak);
+  if (p.arena)
+    Arena::enter(p.old_arena);
+}
+
+void
+count_pass_iteration()
+{
+  iteration_count++;
+}
+
+void
+count_pass_rule()
+{
+  rule_count++;
+}
+
+
+/*****
+ * reports
+ **/
+
+void
+write_pass_stats(Writer &w)
+{
+  char buf[256];
+  sprintf(buf, "%-24s %10s %12s %12s %9s %6s %6s\n", "pass", "wall ms",
+	  "allocations", "bytes", "nodes", "rules", "iters");
+  w << buf;
+  for (int i = 0; i < passes.size(); i++) {
+    const PassRecord &p = passes[i];
+    sprintf(buf, "%*s%-*s %10.3f %12lu %12lu %9lu %6lu %6lu\n",
+	    2 * p.depth, "", 24 - 2 * p.depth, p.name, p.wall * 1000,
+	    p.allocations, p.bytes, p.nodes, p.rules, p.iterations);
+    w << buf;
+  }
+}
+
+void
+write_pass_stats_json(Writer &w)
+{
+  char buf[256];
+  w << "{\"passes\": [";
+  for (int i = 0; i < passes.size(); i++) {
+    const PassRecord &p = passes[i];
+    sprintf(buf, "%s\n  {\"name\": \"%s\", \"depth\": %d, \"wall_ms\": %.3f, "
+	    "\"allocations\": %lu, \"bytes\": %lu, \"peak_bytes\": %lu, "
+	    "\"nodes\": %lu, \"rules\": %lu, \"iterations\": %lu}",
+	    (i ? "," : ""), p.name, p.depth, p.wall * 1000, p.allocations,
+	    p.bytes, p.peak, p.nodes, p.rules, p.iterations);
+    w << buf;
+  }
+  w << "\n]}\n";
+}
+
+void
+write_pass_memory(Writer &w)
+{
+  char buf[256];
+  sprintf(buf, "%-24s %12s %12s\n", "pass", "allocated", "peak live");
+  w << buf;
+  for (int i = 0; i < passes.size(); i++) {
+    const PassRecord &p = passes[i];
+    sprintf(buf, "%*s%-*s %12lu %12lu\n", 2 * p.depth, "",
+	    24 - 2 * p.depth, p.name, p.bytes, p.peak);
+    w << buf;
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef PASS_HH
+#define PASS_HH
+class Writer;
+
+// Passes are timed and counted between begin_pass and end_pass. Passes nest;
+// a pass's figures include those of the passes inside it. Each outermost
+// pass allocates from an Arena of its own.
+
+void begin_pass(const char *name);
+void end_pass();
+
+void count_pass_iteration();
+void count_pass_rule();
+
+void write_pass_stats(Writer &);
+void write_pass_stats_json(Writer &);
+void write_pass_memory(Writer &);
+
+double wall_time();
+
+#endif
@@ -24,11 +24,40 @@
 
 static PermString::Initializer initializer;
 
+// Readers walk the table without a lock, so the pointers they follow are
+// published with release stores and read with acquire loads. Writers are
+// serialized by a spinlock.
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+# define PERMSTR_LOAD(x)	__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+# define PERMSTR_STORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+# define PERMSTR_LOCK()		while (__atomic_test_and_set(&table_lock, __ATOMIC_ACQUIRE)) /* spin */
+# define PERMSTR_UNLOCK()	__atomic_clear(&table_lock, __ATOMIC_RELEASE)
+#else
+# define PERMSTR_LOAD(x)	(x)
+# define PERMSTR_STORE(x, v)	((x) = (v))
+# define PERMSTR_LOCK()		/* nada */
+# define PERMSTR_UNLOCK()	/* nada */
+#endif
+
+struct PermString::Table {
+    unsigned mask;		// number of buckets - 1; a power of 2 - 1
+    Doodad **buckets;
+};
+
+enum { INITIAL_BUCKETS = 1024 };
+static PermString::Capsule initial_buckets[INITIAL_BUCKETS];
+static bool table_lock;
+static unsigned table_strings;
+static unsigned table_resizes;
+
 PermString::Doodad PermString::zero_char_doodad = {
-    0, 0, { 0, 0 }
+    0, 0, 0, { 0, 0 }
 };
 PermString::Doodad PermString::one_char_doodad[256];
-PermString::Doodad *PermString::buckets[NHASH];
+PermString::Table PermString::initial_table = {
+    INITIAL_BUCKETS - 1, initial_buckets
+};
+PermString::Table *PermString::table = &initial_table;
 
 PermString::Initializer::Initializer()
 {
@@ -45,6 +74,7 @@ PermString::static_initialize()
     for (int i = 0; i < 256; i++) {
 	one_char_doodad[i].next = 0;
 	one_char_doodad[i].length = 1;
+	one_char_doodad[i].hash = 0;
 	one_char_doodad[i].data[0] = i;
 	one_char_doodad[i].data[1] = 0;
     }
@@ -108,81 +138,139 @@ static int scatter[] = {        /* map characters to random values */
 };
 
 
-PermString::PermString(const char *s)
+static inline unsigned
+hash_string(const unsigned char *m, int len)
 {
-    register const unsigned char *m = (const unsigned char *)s;
-    register const unsigned char *mm;
-    int len;
+    unsigned int hash;
+    for (hash = 0; len; m++, len--)
+	hash = hash * 33 + scatter[*m];
+    // Mix the high bits into the low ones, which pick the bucket; otherwise
+    // a bucket would depend only on a string's last few characters.
+    hash ^= hash >> 16;
+    hash *= 0x45D9F3B;
+    return hash ^ (hash >> 16);
+}
 
-    if (m == 0 || m[0] == 0) {
-	_rep = zero_char_doodad.data;
-	return;
-    } else if (m[1] == 0) {
-	_rep = one_char_doodad[m[0]].data;
-	return;
-    }
 
-    unsigned int hash;
-    for (hash = 0, len = 0, mm = m; *mm; mm++, len++)
-	hash = (hash << 1) + scatter[*mm];
-    hash &= (NHASH - 1);
+PermString::Doodad *
+PermString::intern(const char *s, int length)
+{
+    unsigned hash = hash_string((const unsigned char *)s, length);
 
+    Table *t = PERMSTR_LOAD(table);
     Doodad *buck;
-    for (buck = buckets[hash]; buck; buck = buck->next)
-	if (len == buck->length && memcmp(s, buck->data, len) == 0) {
-	    _rep = buck->data;
-	    return;
+    for (buck = PERMSTR_LOAD(t->buckets[hash & t->mask]); buck;
+	 buck = PERMSTR_LOAD(buck->next))
+	if (hash == buck->hash && length == buck->length
+	    && memcmp(s, buck->data, length) == 0)
+	    return buck;
+
+    // Not found. A reader can miss a string while the table is being grown,
+    // so look again under the lock before adding it.
+    PERMSTR_LOCK();
+    t = table;
+    Doodad **pprev = &t->buckets[hash & t->mask];
+    for (buck = *pprev; buck; buck = buck->next)
+	if (hash == buck->hash && length == buck->length
+	    && memcmp(s, buck->data, length) == 0) {
+	    PERMSTR_UNLOCK();
+	    return buck;
 	}
 
     // CANNOT USE new because the structure has variable size.
-    buck = (Doodad *)malloc(sizeof(Doodad) + len - 1);
-    buck->next = buckets[hash];
-    buckets[hash] = buck;
-    buck->length = len;
-    strcpy(buck->data, s);
+    buck = (Doodad *)malloc(sizeof(Doodad) + length - 1);
+    buck->next = *pprev;
+    buck->length = length;
+    buck->hash = hash;
+    memcpy(buck->data, s, length);
+    buck->data[length] = 0;
+    PERMSTR_STORE(*pprev, buck);
 
-    _rep = buck->data;
+    if (++table_strings > t->mask + 1)
+	grow_table();
+    PERMSTR_UNLOCK();
+    return buck;
 }
 
 
-PermString::PermString(const char *s, int length)
+// Doubles the table. Called with the lock held. Strings are moved one at a
+// time onto the new table's chains, so a reader still on the old table
+// always reaches the end of a chain, though it may miss a string and have
+// to look again under the lock. Old tables are never freed, since readers
+// may still hold them; they add up to less than the current table.
+void
+PermString::grow_table()
 {
-    register unsigned char *m = (unsigned char *)s;
-    register unsigned char *mm;
+    Table *old_t = table;
+    Table *t = new Table;
+    t->mask = 2 * old_t->mask + 1;
+    t->buckets = new Doodad *[t->mask + 1];
+    memset(t->buckets, 0, sizeof(Doodad *) * (t->mask + 1));
+
+    for (unsigned i = 0; i <= old_t->mask; i++) {
+	Doodad *next;
+	for (Doodad *buck = old_t->buckets[i]; buck; buck = next) {
+	    next = buck->next;
+	    Doodad **bp = &t->buckets[buck->hash & t->mask];
+	    PERMSTR_STORE(buck->next, *bp);
+	    *bp = buck;
+	}
+    }
 
-    if (length < 0)
-	length = (s ? strlen(s) : 0);
-    
-    if (length == 0) {
-	_rep = zero_char_doodad.data;
-	return;
-    } else if (length == 1) {
-	_rep = one_char_doodad[m[0]].data;
-	return;
+    PERMSTR_STORE(table, t);
+    table_resizes++;
+}
+
+
+PermString::TableStats
+PermString::table_stats()
+{
+    TableStats stats;
+    PERMSTR_LOCK();
+    Table *t = table;
+    stats.strings = table_strings;
+    stats.buckets = t->mask + 1;
+    stats.collisions = 0;
+    stats.longest_chain = 0;
+    stats.resizes = table_resizes;
+    for (unsigned i = 0; i <= t->mask; i++) {
+	unsigned chain = 0;
+	for (Doodad *buck = t->buckets[i]; buck; buck = buck->next)
+	    chain++;
+	if (chain > 1)
+	    stats.collisions += chain;
+	if (chain > stats.longest_chain)
+	    stats.longest_chain = chain;
     }
+    PERMSTR_UNLOCK();
+    return stats;
+}
 
-    unsigned int hash;
-    int l;
-    for (hash = 0, l = length, mm = m; l; mm++, l--)
-	hash = (hash << 1) + scatter[*mm];
-    hash &= (NHASH - 1);
 
-    Doodad *buck;
-    for (buck = buckets[hash]; buck; buck = buck->next)
-	if (length == buck->length && memcmp(s, buck->data, length) == 0) {
-	    _rep = buck->data;
-	    return;
-	}
+PermString::PermString(const char *s)
+{
+    const unsigned char *m = (const unsigned char *)s;
 
-    // CANNOT USE new because the structure has variable size.
-    buck = (Doodad *)malloc(sizeof(Doodad) + length - 1);
-    buck->next = buckets[hash];
-    buckets[hash] = buck;
-    buck->length = length;
-    memcpy(buck->data, s, length);
-    buck->data[length] = 0;
+    if (m == 0 || m[0] == 0)
+	_rep = zero_char_doodad.data;
+    else if (m[1] == 0)
+	_rep = one_char_doodad[m[0]].data;
+    else
+	_rep = intern(s, strlen(s))->data;
+}
+
+
+PermString::PermString(const char *s, int length)
+{
+    if (length < 0)
+	length = (s ? strlen(s) : 0);
     
-    _rep = buck->data;
+    if (length == 0)
+	_rep = zero_char_doodad.data;
+    else if (length == 1)
+	_rep = one_char_doodad[(unsigned char)s[0]].data;
+    else
+	_rep = intern(s, length)->data;
 }
 
 PermString::PermString(char c)
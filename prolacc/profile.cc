@@ -0,0 +1,194 @@
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include "profile.hh"
+#include "landmark.hh"
+#include "writer.hh"
+#include "error.hh"
+#include "rule.hh"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+
+#define PROFILE_KEYS		"prolac_profile_keys"
+
+// Rules run at least 1/PROFILE_HOT_RATIO as often as the hottest rule are
+// hot; rules run less than 1/PROFILE_COLD_RATIO as often are cold. An arm
+// taken less than 1/PROFILE_COLD_ARM_RATIO of the time is cold.
+#define PROFILE_HOT_RATIO	100
+#define PROFILE_COLD_RATIO	10000
+#define PROFILE_COLD_ARM_RATIO	100
+
+
+Profile::Profile()
+  : _instrument(false), _key_map(-1), _max_rule_count(0)
+{
+}
+
+int
+Profile::find_key(PermString key)
+{
+  int &index = _key_map.find_force(key);
+  if (index < 0) {
+    index = _keys.size();
+    _keys.push_back(key);
+    _counts.push_back(0);
+  }
+  return index;
+}
+
+
+PermString
+Profile::rule_key(Rule *rule)
+{
+  Vector<char> name;
+  Writer w(0);
+  w.set_capture(&name);
+  w << "rule " << rule << wmendl;
+  return PermString(name.begin(), name.size() - 1);
+}
+
+PermString
+Profile::enter_key(const Landmark &l)
+{
+  return permprintf("enter %p:%d.%d", l.file().capsule(), l.line(),
+		    l.branch());
+}
+
+PermString
+Profile::taken_key(const Landmark &l)
+{
+  return permprintf("taken %p:%d.%d", l.file().capsule(), l.line(),
+		    l.branch());
+}
+
+
+/*****
+ * instrumenting
+ **/
+
+void
+Profile::gen_declarations(Writer &out, Writer &structs_out) const
+{
+  out << "#include <stdio.h>\n"
+      << "extern unsigned long " PROFILE_COUNTS "[];\n";
+  structs_out << "/* writes profile counts for --profile-use */\n"
+	      << "#include <stdio.h>\n"
+	      << "void prolac_profile_write(FILE *);\n";
+}
+
+static void
+gen_c_string(Writer &w, PermString s)
+{
+  w << '\"';
+  for (int i = 0; i < s.length(); i++) {
+    if (s[i] == '\"' || s[i] == '\\')
+      w << '\\';
+    w << s[i];
+  }
+  w << '\"';
+}
+
+void
+Profile::gen_counters(Writer &w) const
+{
+  int n = (_keys.size() ? _keys.size() : 1);
+  w << "\n/* profile counters */\n"
+    << "unsigned long " PROFILE_COUNTS "[" << n << "];\n"
+    << "static const char * const " PROFILE_KEYS "[" << n << "] = {\n"
+    << wmindent(2);
+  for (int i = 0; i < _keys.size(); i++) {
+    gen_c_string(w, _keys[i]);
+    w << ",\n";
+  }
+  if (!_keys.size())
+    w << "0\n";
+  w << wmindent(-2) << "};\n\n"
+    << "void\nprolac_profile_write(FILE *f)\n{\n" << wmindent(2)
+    << "int i;\n"
+    << "fputs(\"# prolac profile\\n\", f);\n"
+    << "for (i = 0; i < " << _keys.size() << "; i++)\n"
+    << "  fprintf(f, \"%lu %s\\n\", " PROFILE_COUNTS "[i], " PROFILE_KEYS
+    "[i]);\n"
+    << wmindent(-2) << "}\n";
+}
+
+
+/*****
+ * using counts
+ **/
+
+bool
+Profile::read(PermString filename)
+{
+  FILE *f = fopen(filename.c_str(), "r");
+  if (!f) {
+    error(Landmark(), "%s: %s", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Lines are `COUNT KEY'. Counts for repeated keys are summed, so the
+  // output of several runs can simply be concatenated.
+  char buf[1024];
+  unsigned lineno = 0;
+  while (fgets(buf, sizeof(buf), f)) {
+    lineno++;
+    int len = strlen(buf);
+    while (len && isspace((unsigned char) buf[len - 1]))
+      buf[--len] = 0;
+    if (len == 0 || buf[0] == '#')
+      continue;
+
+    char *key;
+    unsigned long count = strtoul(buf, &key, 10);
+    if (key == buf || *key != ' ' || !key[1]) {
+      error(Landmark(filename, lineno), "bad profile line");
+      continue;
+    }
+    key++;
+
+    unsigned long &total = _counts[find_key(key)];
+    total += count;
+    if (strncmp(key, "rule ", 5) == 0 && total > _max_rule_count)
+      _max_rule_count = total;
+  }
+
+  fclose(f);
+  return true;
+}
+
+unsigned long
+Profile::count(PermString key) const
+{
+  int index = _key_map[key];
+  return (index >= 0 ? _counts[index] : 0);
+}
+
+int
+Profile::rule_heat(Rule *rule) const
+{
+  // Returns 1 for hot rules, -1 for cold rules, and 0 for lukewarm rules and
+  // rules the profile doesn't mention.
+  int index = _key_map[rule_key(rule)];
+  if (index < 0 || !_max_rule_count)
+    return 0;
+  unsigned long count = _counts[index];
+  if (count * PROFILE_HOT_RATIO >= _max_rule_count)
+    return 1;
+  else if (count * PROFILE_COLD_RATIO < _max_rule_count)
+    return -1;
+  else
+    return 0;
+}
+
+bool
+Profile::cold_arm(const Landmark &l, bool taken) const
+{
+  unsigned long enter = count(enter_key(l));
+  unsigned long arm = count(taken_key(l));
+  if (!taken)
+    arm = (enter > arm ? enter - arm : 0);
+  return enter > 0 && arm * PROFILE_COLD_ARM_RATIO < enter;
+}
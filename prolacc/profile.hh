@@ -0,0 +1,55 @@
+#ifndef PROFILE_HH
+#define PROFILE_HH
+#include <lcdf/permstr.hh>
+#include <lcdf/vector.hh>
+#include <lcdf/hashmap.hh>
+class Landmark;
+class Writer;
+class Rule;
+
+#define PROFILE_COUNTS		"prolac_profile_counts"
+
+// A Profile counts how often rules run and which way branches go. With
+// --instrument, the generated C increments a counter for each key and can
+// write the counts with prolac_profile_write(). With --profile-use, counts
+// read back from that plain-text file guide inlining and outlining.
+//
+// Keys are `rule NAME', counting entries to a rule; `enter FILE:LINE.N',
+// counting evaluations of the Nth `?:', `&&', `||' or `==>' on a line; and
+// `taken FILE:LINE.N', counting evaluations of its yes (or right) arm.
+
+class Profile {
+
+  bool _instrument;
+
+  HashMap<PermString, int> _key_map;
+  Vector<PermString> _keys;
+  Vector<unsigned long> _counts;
+  unsigned long _max_rule_count;
+
+  int find_key(PermString);
+
+ public:
+
+  Profile();
+
+  bool instrumenting() const		{ return _instrument; }
+  void set_instrument(bool i)		{ _instrument = i; }
+  bool has_counts() const		{ return _max_rule_count > 0; }
+
+  static PermString rule_key(Rule *);
+  static PermString enter_key(const Landmark &);
+  static PermString taken_key(const Landmark &);
+
+  int counter(PermString key)		{ return find_key(key); }
+  void gen_declarations(Writer &, Writer &) const;
+  void gen_counters(Writer &) const;
+
+  bool read(PermString filename);
+  unsigned long count(PermString key) const;
+  int rule_heat(Rule *) const;
+  bool cold_arm(const Landmark &, bool taken) const;
+
+};
+
+#endif
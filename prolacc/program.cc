@@ -5,13 +5,18 @@
 #include "prototype.hh"
 #include "optimize.hh"
 #include "compiler.hh"
+#include "cache.hh"
+#include "pass.hh"
+#include "profile.hh"
 #include "expr.hh"
 #include "error.hh"
 #include "codeblock.hh"
+#include <cstdio>
 
 
 Program::Program()
-  : Namespace(PermString(), Landmark())
+  : Namespace(PermString(), Landmark()),
+    _inline_budget(-1), _inline_export_budget(-1), _inline_budget_used(0)
 {
   _error_prototype = new Protomodule("<any>", this, this, Landmark());
 }
@@ -156,22 +161,34 @@ Program::analyze_exports()
 void
 Program::resolve_code()
 {
+  begin_pass("resolve5");
   for (int i = 0; i < _protos.size(); i++)
     _protos[i]->resolve5();
+  end_pass();
   
-  while (1) {
-    bool changed = false;
+  // Each prototype runs once, then again only when a rule it reads gains
+  // exceptions.
+  begin_pass("resolve6");
+  {
+    ExceptionWorklist worklist;
     for (int i = 0; i < _protos.size(); i++)
-      _protos[i]->resolve6(changed);
-    if (!changed) break;
+      worklist.push(_protos[i]);
+    while (Prototype *p = worklist.pop()) {
+      count_pass_iteration();
+      p->resolve6(worklist);
+    }
   }
+  end_pass();
   
+  begin_pass("resolve7");
   for (int i = 0; i < _protos.size(); i++)
     _protos[i]->resolve7();
+  end_pass();
 
   // Find dynamic dispatches and mark rules for generation
   // Only do this after inlining, to avoid dead-code definitions of methods
   // that are only inlined
+  begin_pass("callable_analysis");
   for (int r = 0; r < _export_rules.size(); r++) {
     // Create a fake Node calling the rule and analyze that. That way we'll
     // mark this rule as a dynamic dispatch if necessary, even if no one in
@@ -181,42 +198,716 @@ Program::resolve_code()
     ((Node &)call).callable_analysis();
     _export_rules[r]->mark_gen();
   }
+  end_pass();
+}
+
+void
+Program::heat_analysis(Profile *profile)
+{
+  // Exported rules, and rules called from code that isn't outlined, are
+  // warm; other rules are compiled as cold functions. A profile can also
+  // make rules hot or cold.
+  for (int r = 0; r < _export_rules.size(); r++) {
+    CallNode call(0, _export_rules[r], void_type, false,
+		  Betweenliner(), Landmark());
+    ((Node &)call).warm_analysis();
+  }
+  
+  bool counts = profile && profile->has_counts();
+  for (int i = 0; i < _all_rules.size(); i++) {
+    Rule *rule = _all_rules[i];
+    int heat = (counts ? profile->rule_heat(rule) : 0);
+    if (heat == 0 && !rule->warm())
+      heat = -1;
+    rule->set_heat(heat);
+  }
+}
+
+/*****
+ * inline budget
+ **/
+
+class InlinePlanner {
+  
+  const Vector<Rule *> &_rules;
+  const Vector<Rule *> &_exports;
+  int _max_level;
+  HashMap<RuleID, int> _index;
+  
+  Vector<CallSite> _sites;
+  Vector<int> _caller;
+  Vector<int> _callee;
+  Vector<int> _first_site;	// sites by caller
+  Vector<int> _by_callee;	// site numbers sorted by callee
+  Vector<int> _first_by_callee;
+  
+  Vector<int> _reach;		// _reach[e * nrules + r]: export e reaches r
+  Vector<int> _copies;		// copies of each rule's code
+  Vector<int> _size;		// operations, counting inlined calls
+  
+  enum { max_copies = 64, max_size = 100000 };
+  
+  bool exported(int) const;
+  bool inlined(int) const;
+  int site_benefit(int) const;
+  int expand_size(int, Vector<int> &);
+  
+ public:
+  
+  InlinePlanner(const Vector<Rule *> &, const Vector<Rule *> &, int);
+  
+  int nrules() const			{ return _rules.size(); }
+  int nexports() const			{ return _exports.size(); }
+  bool candidate(int) const;
+  
+  void measure();
+  void price(int, InlineChoice &, Vector<int> &charges) const;
+  
+};
+
+InlinePlanner::InlinePlanner(const Vector<Rule *> &rules,
+			     const Vector<Rule *> &exports, int max_level)
+  : _rules(rules), _exports(exports), _max_level(max_level), _index(-1)
+{
+  int n = rules.size();
+  for (int i = 0; i < n; i++)
+    _index.insert(rules[i], i);
+  
+  // Collect every rule's call sites.
+  _first_site.assign(n + 1, 0);
+  for (int i = 0; i < n; i++) {
+    _first_site[i] = _sites.size();
+    if (Node *body = rules[i]->body()) {
+      CallSiteCounter counter(rules[i]);
+      body->optimize(&counter);
+      const Vector<CallSite> &v = counter.sites();
+      for (int j = 0; j < v.size(); j++) {
+	_sites.push_back(v[j]);
+	_caller.push_back(i);
+	_callee.push_back(_index[v[j].callee]);
+      }
+    }
+  }
+  _first_site[n] = _sites.size();
+  
+  _first_by_callee.assign(n + 1, 0);
+  for (int j = 0; j < _sites.size(); j++)
+    if (_callee[j] >= 0)
+      _first_by_callee[_callee[j] + 1]++;
+  for (int i = 0; i < n; i++)
+    _first_by_callee[i + 1] += _first_by_callee[i];
+  Vector<int> next(_first_by_callee);
+  _by_callee.assign(_first_by_callee[n], 0);
+  for (int j = 0; j < _sites.size(); j++)
+    if (_callee[j] >= 0)
+      _by_callee[next[_callee[j]]++] = j;
+  
+  // Find the rules each export can reach.
+  _reach.assign(n * _exports.size(), 0);
+  for (int e = 0; e < _exports.size(); e++) {
+    int *mine = &_reach[e * n];
+    Vector<int> stack;
+    int ri = _index[_exports[e]];
+    if (ri >= 0) {
+      mine[ri] = 1;
+      stack.push_back(ri);
+    }
+    while (stack.size()) {
+      int r = stack.back();
+      stack.pop_back();
+      for (int j = _first_site[r]; j < _first_site[r + 1]; j++) {
+	int ci = _callee[j];
+	if (ci >= 0 && !mine[ci]) {
+	  mine[ci] = 1;
+	  stack.push_back(ci);
+	}
+      }
+    }
+  }
+}
+
+bool
+InlinePlanner::exported(int ri) const
+{
+  for (int e = 0; e < _exports.size(); e++)
+    if (_exports[e] == _rules[ri])
+      return true;
+  return false;
+}
+
+bool
+InlinePlanner::inlined(int j) const
+{
+  const CallSite &site = _sites[j];
+  int level = site.level;
+  if (site.candidate && site.callee->budget_inline())
+    level = inlineYes;
+  if (level > _max_level)
+    level = _max_level;
+  return level >= inlineYes && site.callee->body();
+}
+
+bool
+InlinePlanner::candidate(int ri) const
+{
+  if (!_rules[ri]->body())
+    return false;
+  for (int k = _first_by_callee[ri]; k < _first_by_callee[ri + 1]; k++) {
+    int j = _by_callee[k];
+    if (_sites[j].candidate && _caller[j] != ri)
+      return true;
+  }
+  return false;
+}
+
+int
+InlinePlanner::site_benefit(int j) const
+{
+  // Inlining saves the call and lets constant arguments fold. Hot callers
+  // count more and cold ones less.
+  const CallSite &site = _sites[j];
+  Rule *caller = _rules[_caller[j]];
+  int benefit = site.frequency * (site.overhead + 2 * site.constant_args);
+  if (caller->heat() > 0)
+    benefit *= 4;
+  else if (caller->heat() < 0)
+    benefit /= 4;
+  return benefit;
+}
+
+int
+InlinePlanner::expand_size(int ri, Vector<int> &state)
+{
+  // state: 0 not yet sized, 1 being sized, 2 done. A recursive call is
+  // inlined only once, so a cycle adds nothing more.
+  if (state[ri] == 2)
+    return _size[ri];
+  else if (state[ri] == 1)
+    return 0;
+  state[ri] = 1;
+  
+  Node *body = _rules[ri]->body();
+  int size = (body ? body->count_operations() : 0);
+  for (int j = _first_site[ri]; j < _first_site[ri + 1]; j++)
+    if (_callee[j] >= 0 && inlined(j)) {
+      int more = expand_size(_callee[j], state) - _sites[j].overhead;
+      if (more > 0)
+	size += more;
+    }
+  if (size > max_size)
+    size = max_size;
+  
+  _size[ri] = size;
+  state[ri] = 2;
+  return size;
+}
+
+void
+InlinePlanner::measure()
+{
+  // Size each rule as it will be compiled, counting the calls inlined into
+  // it. A rule's code appears once if it is generated as a function, plus
+  // once for every copy of a caller it is inlined into.
+  int n = _rules.size();
+  Vector<int> state(n, 0);
+  _size.assign(n, 0);
+  for (int i = 0; i < n; i++)
+    expand_size(i, state);
+  
+  _copies.assign(n, 0);
+  for (int i = 0; i < n; i++)
+    if (exported(i) || _rules[i]->dyn_dispatch())
+      _copies[i] = 1;
+  
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    Vector<int> copies(n, 0);
+    Vector<int> generated(n, 0);
+    for (int i = 0; i < n; i++)
+      if (exported(i) || _rules[i]->dyn_dispatch())
+	generated[i] = 1;
+    for (int j = 0; j < _sites.size(); j++) {
+      int ci = _callee[j];
+      int from = _copies[_caller[j]];
+      if (ci < 0 || !from)
+	continue;
+      if (inlined(j))
+	copies[ci] += from;
+      else
+	generated[ci] = 1;
+    }
+    for (int i = 0; i < n; i++) {
+      int c = copies[i] + generated[i];
+      if (c > max_copies)
+	c = max_copies;
+      if (c > _copies[i]) {
+	_copies[i] = c;
+	changed = true;
+      }
+    }
+  }
+}
+
+static int
+exception_count(Rule *rule)
+{
+  ExceptionSet eset = rule->all_exceptions();
+  int n = 0;
+  for (Exception *e = eset.element(); e; e = eset.element(e))
+    n++;
+  return n;
+}
+
+void
+InlinePlanner::price(int ri, InlineChoice &c, Vector<int> &charges) const
+{
+  // Each inlined call site adds a copy of the body, less the call, for
+  // every copy of its caller, and a check for each exception the rule can
+  // throw. If every call is inlined, the rule's function goes away.
+  Rule *rule = _rules[ri];
+  int n = _rules.size();
+  int nexp = _exports.size();
+  c.rule = rule;
+  c.sites = c.growth = c.benefit = 0;
+  c.size = _size[ri];
+  c.verdict = 0;
+  charges.assign(nexp, 0);
+  
+  int excs = exception_count(rule);
+  bool all_inlined = !exported(ri) && !rule->dyn_dispatch();
+  for (int k = _first_by_callee[ri]; k < _first_by_callee[ri + 1]; k++) {
+    int j = _by_callee[k];
+    int from = _caller[j];
+    if (!_copies[from])
+      continue;
+    if (!_sites[j].candidate || from == ri) {
+      if (!inlined(j))
+	all_inlined = false;
+      continue;
+    }
+    int growth = c.size - _sites[j].overhead + excs;
+    if (growth < 0)
+      growth = 0;
+    growth *= _copies[from];
+    c.sites++;
+    c.growth += growth;
+    c.benefit += site_benefit(j) * _copies[from];
+    for (int e = 0; e < nexp; e++)
+      if (_reach[e * n + from])
+	charges[e] += growth;
+  }
+  
+  if (all_inlined && c.sites) {
+    c.growth -= c.size;
+    for (int e = 0; e < nexp; e++)
+      if (_reach[e * n + ri])
+	charges[e] -= c.size;
+  }
+}
+
+// Returns true if `a' is a better buy than `b': shrinking the code first,
+// then the most benefit per operation of growth.
+static bool
+better_inline_choice(const InlineChoice &a, const InlineChoice &b)
+{
+  if ((a.growth <= 0) != (b.growth <= 0))
+    return a.growth <= 0;
+  long av = (long)a.benefit * (b.growth > 0 ? b.growth : 1);
+  long bv = (long)b.benefit * (a.growth > 0 ? a.growth : 1);
+  return av > bv;
+}
+
+void
+Program::plan_inlining(int budget, int export_budget, int max_level)
+{
+  // Decide which rules left at the default inline level are worth inlining
+  // anyway. Candidates are bought best value first until the global budget,
+  // or the budget of an export whose code they would grow, runs out. Each
+  // purchase changes how many copies of other rules' code exist, so the
+  // remaining candidates are priced again after every decision.
+  _inline_budget = budget;
+  _inline_export_budget = export_budget;
+  _inline_budget_used = 0;
+  _inline_choices.clear();
+  
+  InlinePlanner planner(_all_rules, _export_rules, max_level);
+  int nrules = planner.nrules();
+  int nexports = planner.nexports();
+  Vector<int> open;
+  for (int i = 0; i < nrules; i++)
+    if (planner.candidate(i))
+      open.push_back(i);
+  
+  Vector<int> export_used(nexports, 0);
+  Vector<int> charges, best_charges;
+  while (open.size()) {
+    planner.measure();
+    int best = -1;
+    InlineChoice best_choice;
+    for (int k = 0; k < open.size(); k++) {
+      InlineChoice c;
+      planner.price(open[k], c, charges);
+      if (best < 0 || better_inline_choice(c, best_choice)) {
+	best = k;
+	best_choice = c;
+	best_charges = charges;
+      }
+    }
+    open.erase(open.begin() + best);
+    
+    InlineChoice &c = best_choice;
+    if (!c.sites)
+      continue;			// no longer called from live code
+    else if (c.growth > 0 && c.benefit <= 0)
+      c.verdict = "no benefit";
+    else if (c.growth > 0 && _inline_budget_used + c.growth > budget)
+      c.verdict = "over budget";
+    else
+      for (int e = 0; e < nexports; e++)
+	if (best_charges[e] > 0
+	    && export_used[e] + best_charges[e] > export_budget)
+	  c.verdict = "over export budget";
+    
+    if (!c.verdict) {
+      c.verdict = "inline";
+      c.rule->set_budget_inline(true);
+      if (c.growth > 0)
+	_inline_budget_used += c.growth;
+      for (int e = 0; e < nexports; e++)
+	export_used[e] += best_charges[e];
+    }
+    _inline_choices.push_back(c);
+  }
+}
+
+void
+Program::write_inline_report(Writer &w) const
+{
+  char buf[64];
+  if (_inline_budget < 0) {
+    w << "inline budget: none\n";
+    return;
+  }
+  w << "inline budget: " << _inline_budget << " operations, "
+    << _inline_export_budget << " per export\n";
+  sprintf(buf, "  %5s %5s %6s %7s  ", "sites", "size", "growth", "benefit");
+  w << buf << "decision\n";
+  int inlined = 0;
+  for (int i = 0; i < _inline_choices.size(); i++) {
+    const InlineChoice &c = _inline_choices[i];
+    sprintf(buf, "  %5d %5d %6d %7d  ", c.sites, c.size, c.growth, c.benefit);
+    w << buf << c.verdict << " " << c.rule << "\n";
+    if (c.rule->budget_inline())
+      inlined++;
+  }
+  w << "inline budget: " << _inline_budget_used << " of " << _inline_budget
+    << " operations used, " << inlined << " of " << _inline_choices.size()
+    << " rules inlined\n";
+}
+
+
+/*****
+ * specialization
+ **/
+
+void
+Program::specialize(int max_clones, int max_level)
+{
+  // Rules called out of line with constant arguments are cloned for each
+  // set of constants, up to `max_clones' clones; constant folding then
+  // simplifies the clones' code. Sets passed from the most call sites are
+  // cloned first. Rules that loop are left alone, since their loops jump
+  // back with new values for every parameter.
+  int nrules = _all_rules.size();
+  HashMap<RuleID, int> looping(0);
+  HashMap<PermString, int> key_index(-1);
+  Vector<ConstantCall> sets;
+  Vector<int> uses;
+  for (int i = 0; i < nrules; i++)
+    if (Node *body = _all_rules[i]->body()) {
+      Specializer finder(_all_rules[i], max_level);
+      body->optimize(&finder);
+      if (finder.loops())
+	looping.insert(_all_rules[i], 1);
+      const Vector<ConstantCall> &calls = finder.calls();
+      for (int j = 0; j < calls.size(); j++) {
+	int &k = key_index.find_force(calls[j].key);
+	if (k < 0) {
+	  k = sets.size();
+	  sets.push_back(calls[j]);
+	  uses.push_back(0);
+	}
+	uses[k]++;
+      }
+    }
+  
+  Vector<int> order;
+  for (int k = 0; k < sets.size(); k++)
+    if (!looping[sets[k].callee]) {
+      int pos = order.size();
+      order.push_back(k);
+      for (; pos > 0 && uses[order[pos - 1]] < uses[k]; pos--)
+	order[pos] = order[pos - 1];
+      order[pos] = k;
+    }
+  if (order.size() > max_clones)
+    order.resize(max_clones);
+  
+  HashMap<PermString, Rule *> clones(0);
+  HashMap<RuleID, int> nclones(0);
+  for (int i = 0; i < order.size(); i++) {
+    const ConstantCall &cc = sets[order[i]];
+    int &n = nclones.find_force(cc.callee);
+    n++;
+    PermString name = permprintf("%p__%d", cc.callee->basename().capsule(), n);
+    Rule *clone = cc.callee->make_specialization(name, cc.constants);
+    clones.insert(cc.key, clone);
+    _all_rules.push_back(clone);
+  }
+  
+  // Redirect the calls, including those the clones make.
+  if (order.size())
+    for (int i = 0; i < _all_rules.size(); i++)
+      if (Node *body = _all_rules[i]->body()) {
+	Specializer redirector(_all_rules[i], max_level, &clones);
+	Node *new_body = body->optimize(&redirector);
+	if (new_body != body)
+	  _all_rules[i]->set_body(new_body);
+      }
+}
+
+void
+Program::scalar_replace(int max_level)
+{
+  // A rule called out of line on an object constructed for that call alone
+  // gets a static clone, if the object does not escape it. The clone takes
+  // the fields it uses as parameters, so the object is built from values the
+  // caller already has and never passed by address.
+  int nrules = _all_rules.size();
+  HashMap<PermString, int> key_index(-1);
+  Vector<ObjectCall> calls;
+  for (int i = 0; i < nrules; i++)
+    if (Node *body = _all_rules[i]->body()) {
+      ScalarReplacer finder(max_level);
+      body->optimize(&finder);
+      const Vector<ObjectCall> &found = finder.calls();
+      for (int j = 0; j < found.size(); j++) {
+	int &k = key_index.find_force(found[j].key);
+	if (k < 0) {
+	  k = calls.size();
+	  calls.push_back(found[j]);
+	}
+      }
+    }
+  
+  HashMap<PermString, Rule *> clones(0);
+  HashMap<RuleID, int> nclones(0);
+  for (int k = 0; k < calls.size(); k++) {
+    ObjectCall &oc = calls[k];
+    EscapeAnalyzer escape(oc.object_type->cast_modnames(), max_level,
+			  oc.fields);
+    if (escape.escapes(oc.callee))
+      continue;
+    int &n = nclones.find_force(oc.callee);
+    n++;
+    PermString name = permprintf("%p__scalar_%d",
+				 oc.callee->basename().capsule(), n);
+    Rule *clone = oc.callee->make_scalar_replacement
+      (name, oc.object_type, oc.fields);
+    clones.insert(oc.key, clone);
+    _all_rules.push_back(clone);
+  }
   
+  if (clones.size())
+    for (int i = 0; i < _all_rules.size(); i++)
+      if (Node *body = _all_rules[i]->body()) {
+	ScalarReplacer redirector(max_level, &clones);
+	Node *new_body = body->optimize(&redirector);
+	if (new_body != body)
+	  _all_rules[i]->set_body(new_body);
+      }
+}
+
+void
+Program::layout(bool hot, Profile *profile)
+{
   // Now that we know whether VTBLs contain any dynamic dispatches, we can do
   // class layout
+  begin_pass("layout1");
   for (int i = 0; i < _protos.size(); i++)
     _protos[i]->module()->layout1();
-  for (int i = 0; i < _protos.size(); i++)
-    _protos[i]->module()->layout2();
+  end_pass();
+  
+  if (!hot) {
+    begin_pass("layout2");
+    for (int i = 0; i < _protos.size(); i++)
+      _protos[i]->module()->layout2();
+    end_pass();
+    return;
+  }
+  
+  // A hot layout weighs each rule by its profile count, or, without a
+  // profile, counts every rule that isn't cold once. Derived modules are laid
+  // out first, so a rule's slots are grouped even if they come from
+  // different ancestors.
+  begin_pass("count_field_accesses");
+  bool counts = profile && profile->has_counts();
+  for (int i = 0; i < _all_rules.size(); i++) {
+    Rule *rule = _all_rules[i];
+    unsigned long weight;
+    if (counts)
+      weight = profile->count(Profile::rule_key(rule));
+    else
+      weight = (rule->heat() < 0 ? 0 : 1);
+    if (weight)
+      rule->count_field_accesses(i, weight);
+  }
+  end_pass();
+  
+  begin_pass("layout2");
+  for (int i = _protos.size() - 1; i >= 0; i--)
+    _protos[i]->module()->layout2(true);
+  end_pass();
 }
 
 void
-Program::compile_exports(Compiler *c,
-			 HashMap<PermString, int> &debug_map, int all_debug)
+Program::write_layout_report(Writer &w) const
+{
+  for (int i = 0; i < _protos.size(); i++) {
+    Module *m = _protos[i]->module();
+    if (m->need_struct() && m->size() > 0)
+      m->write_layout_report(w);
+  }
+}
+
+// A binary min-heap of rule indexes, for compile_exports.
+
+static void
+heap_push(Vector<int> &heap, int x)
+{
+  int i = heap.size();
+  heap.push_back(x);
+  while (i > 0 && heap[(i - 1) / 2] > x) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = x;
+}
+
+static int
+heap_pop(Vector<int> &heap)
+{
+  int top = heap[0];
+  int x = heap.back();
+  heap.pop_back();
+  int n = heap.size();
+  int i = 0;
+  while (2*i + 1 < n) {
+    int k = 2*i + 1;
+    if (k + 1 < n && heap[k + 1] < heap[k])
+      k++;
+    if (heap[k] >= x)
+      break;
+    heap[i] = heap[k];
+    i = k;
+  }
+  if (n)
+    heap[i] = x;
+  return top;
+}
+
+void
+Program::compile_exports(Compiler *c, HashMap<PermString, int> &debug_map,
+			 int all_debug, int jobs)
 {
   // Generate VTBL 
   for (int i = 0; i < _protos.size(); i++)
     _protos[i]->module()->gen_vtbl_proto(c->out);
   
+  // Rules in cached code are found by name.
+  if (CompileCache *cache = c->cache())
+    cache->add_rules(_all_rules);
+  
   // Output pre-literal code (in %{ %})
   for (int i = 0; i < _pre_literal_code.size(); i++)
     _pre_literal_code[i]->gen_outer(c);
   
-  // All necessary code
-  bool done = false;
-  while (!done) {
-    done = true;
-    for (int i = 0; i < _all_rules.size(); i++) {
+  // All necessary code. Rules are compiled in sweeps over _all_rules, in
+  // index order: a rule marked while compiling one earlier in the list joins
+  // the current sweep, and one marked behind it waits for the next. Only
+  // rules newly marked for generation are queued, so a sweep costs the rules
+  // it compiles rather than a pass over every rule. A rule can appear in
+  // _all_rules more than once, so it joins the current sweep if any of its
+  // positions is still ahead.
+  //
+  // With several jobs, the rules a sweep is known to need are compiled ahead
+  // of time by worker processes; their results are emitted in the same order
+  // a serial compile would use. Rules being debugged are always compiled here
+  // so their traces come out in order.
+  HashMap<RuleID, int> rule_index(-1);
+  Vector<int> next_index(_all_rules.size(), -1);
+  for (int i = _all_rules.size() - 1; i >= 0; i--) {
+    next_index[i] = rule_index[_all_rules[i]];
+    rule_index.insert(_all_rules[i], i);
+  }
+  
+  Vector<Rule *> marked;
+  c->set_gen_queue(&marked);
+  Vector<int> sweep, next_sweep;
+  for (int i = 0; i < _all_rules.size(); i++)
+    if (_all_rules[i]->need_gen() && rule_index[_all_rules[i]] == i)
+      next_sweep.push_back(i);
+  
+  while (next_sweep.size()) {
+    count_pass_iteration();
+    sweep.clear();
+    for (int i = 0; i < next_sweep.size(); i++)
+      heap_push(sweep, next_sweep[i]);
+    next_sweep.clear();
+    
+    Vector<CompiledRule> compiled;
+    if (jobs > 1) {
+      Vector<int> order(sweep);
+      Vector<Rule *> ahead;
+      while (order.size()) {
+	Rule *rule = _all_rules[heap_pop(order)];
+	if (!(debug_map[rule->basename()] | all_debug))
+	  ahead.push_back(rule);
+      }
+      if (ahead.size() > 1)
+	c->compile_parallel(ahead, jobs, compiled);
+    }
+    
+    int next_compiled = 0;
+    while (sweep.size()) {
+      int i = heap_pop(sweep);
       Rule *rule = _all_rules[i];
-      if (rule->need_gen()) {
+      if (!rule->need_gen())
+	continue;
+      if (next_compiled < compiled.size()
+	  && compiled[next_compiled].rule == rule)
+	c->emit(compiled[next_compiled++]);
+      else {
 	int dv = debug_map[rule->basename()] | all_debug;
 	if (dv && !(dv & (dtNamespace | dtRuleset | dtNode)))
 	  warning(*rule, "compiling `%r'", rule);
 	c->compile(rule, dv & dtNode, dv & dtTarget, dv & dtLocation);
-	done = false;
       }
+      
+      for (int j = 0; j < marked.size(); j++) {
+	int mi = rule_index[marked[j]];
+	while (mi >= 0 && mi < i)
+	  mi = next_index[mi];
+	if (mi > i)
+	  heap_push(sweep, mi);
+	else if (rule_index[marked[j]] >= 0)
+	  next_sweep.push_back(rule_index[marked[j]]);
+      }
+      marked.clear();
     }
   }
+  c->set_gen_queue(0);
   
   // %{ Post-literal code %}
   for (int i = 0; i < _post_literal_code.size(); i++)
@@ -6,6 +6,19 @@ class Expr;
 class Compiler;
 class Rule;
 class CodeBlock;
+class Profile;
+
+
+struct InlineChoice {
+  
+  Rule *rule;
+  int sites;
+  int size;
+  int growth;
+  int benefit;
+  const char *verdict;
+  
+};
 
 
 enum DebugTypes {
@@ -30,6 +43,11 @@ class Program: public Namespace {
   Vector<Rule *> _export_rules;
   
   Vector<Rule *> _all_rules;
+  
+  int _inline_budget;
+  int _inline_export_budget;
+  int _inline_budget_used;
+  Vector<InlineChoice> _inline_choices;
 
   Prototype *_error_prototype;	// to avoid spurious error reports
   
@@ -49,13 +67,21 @@ class Program: public Namespace {
   void resolve_names();
   void analyze_exports();
   void resolve_code();
+  void heat_analysis(Profile *);
+  void plan_inlining(int budget, int export_budget, int max_level);
+  void write_inline_report(Writer &) const;
+  void specialize(int max_clones, int max_level);
+  void scalar_replace(int max_level);
+  void layout(bool hot, Profile *);
+  void write_layout_report(Writer &) const;
   
   Protomodule *find_protomodule(ModuleID) const;
   //void resolve_rule(Rule *) const;
   
   void debug_print(HashMap<PermString, int> &, int);
   void compile_structs(Writer &);
-  void compile_exports(Compiler *, HashMap<PermString, int> &, int);
+  void compile_exports(Compiler *, HashMap<PermString, int> &, int,
+		       int jobs = 1);
   
 };
 
@@ -247,6 +247,12 @@ Protomodule::set_after_frob(Expr *e)
   _after_frob = e;
 }
 
+void
+Protomodule::set_hot_layout()
+{
+  module()->set_hot_layout();
+}
+
 
 /*****
  * resolve
@@ -901,7 +907,7 @@ Protomodule::resolve4_slot(int sloti)
   
   int offset;
   if (NodeOptimizer::to_integer_constant(offset_node, module(), offset)) {
-    _slots[sloti]->set_offset(offset);
+    _slots[sloti]->pin_offset(offset);
     return true;
   } else
     return false;
@@ -958,6 +964,16 @@ Protomodule::resolve5_rule(int ri)
 {
   Rule *rule = _rules[ri];
   if (rule->body()) {
+    // Turn mutual tail recursion into a loop by inlining the other rules.
+    Node *self = new SelfNode(module()->base_type(), *rule);
+    TailCallInliner tail_inliner(rule, self);
+    Node *looped = tail_inliner.inline_tail_calls(rule->body());
+    if (looped != rule->body() && looped->mark_tail_recursions(rule)) {
+      TailRecursionFixer tail_fixer(rule);
+      looped = looped->optimize(&tail_fixer);
+      rule->set_body(new LabelNode(looped));
+    }
+    
     // First, try to turn the body into a static constant. MEMLEAK!
     Node *body = NodeOptimizer::to_static_constant(rule->body(), module());
 
@@ -1005,8 +1021,66 @@ Protomodule::resolve5()
 }
 
 
+/*****
+ * ExceptionWorklist
+ **/
+
+ExceptionWorklist::ExceptionWorklist()
+  : _head(0), _queued(0), _first_reader(-1), _current(0), _recording(false)
+{
+}
+
+void
+ExceptionWorklist::push(Prototype *p)
+{
+  // 0: never queued; 1: queued for its first run; 2: idle; 3: requeued
+  int &state = _queued.find_force(p);
+  if (state == 0 || state == 2) {
+    _queue.push_back(p);
+    state++;
+  }
+}
+
+Prototype *
+ExceptionWorklist::pop()
+{
+  if (_head >= _queue.size()) {
+    _queue.clear();
+    _head = 0;
+    return _current = 0;
+  }
+  _current = _queue[_head++];
+  int &state = _queued.find_force(_current);
+  // The rules a prototype calls don't change between runs, so only its
+  // first run need record them.
+  _recording = (state == 1);
+  state = 2;
+  return _current;
+}
+
+void
+ExceptionWorklist::read(Rule *rule)
+{
+  if (!_recording)
+    return;
+  int &first = _first_reader.find_force(rule);
+  if (first >= 0 && _reader[first] == _current)
+    return;
+  _reader.push_back(_current);
+  _next_reader.push_back(first);
+  first = _reader.size() - 1;
+}
+
+void
+ExceptionWorklist::changed(Rule *rule)
+{
+  for (int i = _first_reader[rule]; i >= 0; i = _next_reader[i])
+    push(_reader[i]);
+}
+
+
 void
-Protomodule::resolve6(bool &changed)
+Protomodule::resolve6(ExceptionWorklist &worklist)
 {
   Module *mod = module();
 
@@ -1015,25 +1089,27 @@ Protomodule::resolve6(bool &changed)
     _imports[i]->resolve5();
   
   // Diddle around with exceptions. Goal: find out which exceptions can reach
-  // where.
+  // where. Whenever a rule's exceptions grow, the prototypes that read them
+  // are queued to run again.
   for (int ri = 0; ri < _real_rule_count; ri++) {
     Rule *rule = _rules[ri];
     if (!rule->body()) continue;
     
     ExceptionSet new_eset;
-    ExceptionCounter comb(new_eset);
+    ExceptionCounter comb(new_eset, &worklist);
     rule->body()->optimize(&comb);
     
     Ruleset *rset = mod->find_ruleset(rule->origin());
     if (Rule *parent = rset->parent_rule(rule->ruleindex())) {
+      worklist.read(parent);
       new_eset += parent->all_exceptions();
       // also must propagate child's exceptions to parent
       if (parent->merge_exceptions(new_eset))
-        changed = true;
+        worklist.changed(parent);
     }
     
     if (rule->merge_exceptions(new_eset))
-      changed = true;
+      worklist.changed(rule);
   }
 }
 
@@ -1197,9 +1273,9 @@ Protofrob::resolve5()
 }
 
 void
-Protofrob::resolve6(bool &changed)
+Protofrob::resolve6(ExceptionWorklist &worklist)
 {
-  _actual->resolve6(changed);
+  _actual->resolve6(worklist);
 }
 
 void
@@ -1287,9 +1363,9 @@ Protoequate::resolve5()
 }
 
 void
-Protoequate::resolve6(bool &changed)
+Protoequate::resolve6(ExceptionWorklist &worklist)
 {
-  _proto->resolve6(changed);
+  _proto->resolve6(worklist);
 }
 
 void
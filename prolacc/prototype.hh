@@ -10,6 +10,37 @@ class NodeOptimizer;
 class Program;
 
 
+// Drives resolve6 to its fixpoint. Each prototype's first run records which
+// rules' exception sets it reads; later, a rule whose set grows wakes only
+// those readers, instead of every prototype being rerun until nothing
+// changes.
+
+class ExceptionWorklist {
+  
+  Vector<Prototype *> _queue;
+  int _head;
+  HashMap<Prototype *, int> _queued;
+  
+  HashMap<RuleID, int> _first_reader;
+  Vector<Prototype *> _reader;
+  Vector<int> _next_reader;
+  
+  Prototype *_current;
+  bool _recording;
+  
+ public:
+  
+  ExceptionWorklist();
+  
+  void push(Prototype *);
+  Prototype *pop();
+  
+  void read(Rule *);
+  void changed(Rule *);
+  
+};
+
+
 class Prototype: public Feature {
   
   ModuleNames *_modnames;
@@ -38,7 +69,7 @@ class Prototype: public Feature {
   virtual bool resolve3() = 0;	// implicit rule path
   virtual bool resolve4() = 0;	// rule bodies
   virtual bool resolve5() = 0;	// create inline levels, count own exceptions
-  virtual void resolve6(bool &) = 0; // combine exceptions
+  virtual void resolve6(ExceptionWorklist &) = 0; // combine exceptions
   virtual void resolve7() = 0;	// check exceptions, copy inline levels
   
   virtual void grep_rules(Vector<Rule *> &) const = 0;
@@ -125,6 +156,7 @@ class Protomodule: public Prototype {
   void add_exception(PermString, Namespace *, const Landmark &);
   
   void set_after_frob(Expr *);
+  void set_hot_layout();
   
   Protofrob *frobbed() const			{ return _frobbed; }
   ModuleNames *outer_modnames() const;
@@ -138,7 +170,7 @@ class Protomodule: public Prototype {
   bool resolve3();
   bool resolve4();
   bool resolve5();
-  void resolve6(bool &);
+  void resolve6(ExceptionWorklist &);
   void resolve7();
 
   void resolve_rule(Rule *);
@@ -173,7 +205,7 @@ class Protofrob: public Prototype {
   bool resolve3();
   bool resolve4();
   bool resolve5();
-  void resolve6(bool &);
+  void resolve6(ExceptionWorklist &);
   void resolve7();
   
   void grep_rules(Vector<Rule *> &) const;
@@ -198,7 +230,7 @@ class Protoequate: public Prototype {
   bool resolve3();
   bool resolve4();
   bool resolve5();
-  void resolve6(bool &);
+  void resolve6(ExceptionWorklist &);
   void resolve7();
   
   void grep_rules(Vector<Rule *> &) const;
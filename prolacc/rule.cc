@@ -7,16 +7,18 @@
 #include "error.hh"
 #include "node.hh"
 #include "prototype.hh"
+#include "optimize.hh"
+#include "field.hh"
 
 
 Rule::Rule(PermString bn, ModuleID mid, Namespace *ns, const Landmark &l)
   : _basename(bn), _origin(mid), _actual(mid), _contextsp(ns), _namesp(0),
-    _return_type(0), _body(0),
+    _return_type(0), _body(0), _specialized_from(0),
     _is_exception(false), _is_static(false), _implicit(false),
     _undefined_implicit(false), _leaf(true),
     _constructor(false), _inlining(false), _compiled(false),
     _dyn_dispatch(false), _receiver_classed(false), _callable(false),
-    _landmark(l)
+    _warm(false), _budget_inline(false), _heat(0), _landmark(l)
 {
 }
 
@@ -130,13 +132,100 @@ Rule::make_body()
       error(*this, "circular method dependency on `%r'", this);
     return 0;
   }
+  // A body made while another rule is being compiled must outlive that
+  // rule's arena.
+  Arena *old_arena = Arena::enter(Arena::persistent());
   set_inlining(true);
   _actual->protomodule()->resolve_rule(this);
   set_inlining(false);
+  Arena::enter(old_arena);
   _compiled = true;
   return _body;
 }
 
+// Returns a copy of this rule, named `bn', for calls passing the constant
+// arguments in `constants'. Its parameters are the others; null entries in
+// `constants' mark them.
+Rule *
+Rule::make_specialization(PermString bn, const Vector<Node *> &constants)
+{
+  Rule *clone = new Rule(*this);
+  clone->_basename = bn;
+  clone->_specialized_from = this;
+  clone->_budget_inline = false;
+  clone->_gen_track = GenTracker();
+  clone->_param.clear();
+  
+  Vector<Node *> param;
+  for (int i = 0; i < _param.size(); i++)
+    if (constants[i])
+      param.push_back(constants[i]);
+    else {
+      ParamNode *p = new ParamNode(param_name(i), clone->_param.size(),
+				   param_type(i), _param[i]->landmark());
+      if (this->param(i)->assigned())
+	p->state_wrap();
+      clone->_param.push_back(p);
+      param.push_back(p);
+    }
+  
+  Node *self = new SelfNode(receiver_class()->default_modnames(), _landmark);
+  ParamSpecializer specializer(self, param);
+  clone->set_body(body()->optimize(&specializer));
+  return clone;
+}
+
+// Returns a static copy of this rule, named `bn', for calls on objects of
+// type `object_type' that don't escape. It takes the object's `fields' as
+// extra parameters and copies them into a local object, which stands in for
+// `self'; the C compiler can then keep that object in registers.
+Rule *
+Rule::make_scalar_replacement(PermString bn, Type *object_type,
+			      const Vector<Field *> &fields)
+{
+  Rule *clone = new Rule(*this);
+  clone->_basename = bn;
+  clone->_specialized_from = this;
+  clone->_object_fields = fields;
+  clone->_is_static = true;
+  clone->_budget_inline = false;
+  clone->_gen_track = GenTracker();
+  clone->_param.clear();
+  
+  Vector<Node *> param;
+  for (int i = 0; i < _param.size(); i++) {
+    ParamNode *p = new ParamNode(param_name(i), i, param_type(i),
+				 _param[i]->landmark());
+    if (this->param(i)->assigned())
+      p->state_wrap();
+    clone->_param.push_back(p);
+    param.push_back(p);
+  }
+  
+  Node *object = new VariableNode("_scalar_T", object_type, _landmark);
+  Node *init = 0;
+  for (int i = 0; i < fields.size(); i++) {
+    Field *f = fields[i];
+    ParamNode *p = new ParamNode(permprintf("_F_%p", f->basename().capsule()),
+				 clone->_param.size(), f->type(), _landmark);
+    clone->_param.push_back(p);
+    Node *slot = new FieldNode(object, f, false, _landmark);
+    Node *assign = new EffectNode(slot, '=', p, f->type(), _landmark);
+    if (init)
+      init = new SemistrictNode(init, ',', assign, assign->type(), _landmark);
+    else
+      init = assign;
+  }
+  
+  ParamReplacer replacer(object, param);
+  Node *new_body = body()->optimize(&replacer);
+  if (init)
+    new_body = new SemistrictNode(init, ',', new_body, new_body->type(),
+				  _landmark);
+  clone->set_body(new_body);
+  return clone;
+}
+
 
 Type *
 Rule::make_type()
@@ -204,6 +293,21 @@ Rule::callable_analysis()
     _body->callable_analysis();
 }
 
+void
+Rule::warm_analysis()
+{
+  _warm = true;
+  if (_body)
+    _body->warm_analysis();
+}
+
+void
+Rule::count_field_accesses(int group, unsigned long weight)
+{
+  if (_body)
+    _body->count_field_accesses(group, weight);
+}
+
 void
 Rule::gen_name(Writer &w) const
 {
@@ -220,6 +324,10 @@ Rule::gen_prototype(Writer &w, bool is_proto) const
   if (is_proto && !gen_proto_if())
     return;
   
+  if (_heat > 0)
+    w << "PROLAC_HOT ";
+  else if (_heat < 0)
+    w << "PROLAC_COLD ";
   if (can_throw())
     int_type->gen(w);
   else
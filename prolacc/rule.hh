@@ -40,6 +40,8 @@ class Rule {
   Node *_body;
   
   ExceptionSet _all_except;
+  Rule *_specialized_from;
+  Vector<Field *> _object_fields;
   
   bool _is_exception: 1;
   bool _is_static: 1;
@@ -52,6 +54,9 @@ class Rule {
   bool _dyn_dispatch: 1;
   bool _receiver_classed: 1;
   bool _callable: 1;
+  bool _warm: 1;
+  bool _budget_inline: 1;
+  signed char _heat;
   
   mutable GenTracker _gen_track;
   Landmark _landmark;
@@ -85,6 +90,12 @@ class Rule {
   bool dyn_dispatch() const		{ return base_rule()->_dyn_dispatch; }
   bool receiver_classed() const		{ return _receiver_classed; }
   bool callable() const			{ return _callable; }
+  bool warm() const			{ return _warm; }
+  int heat() const			{ return _heat; }
+  bool budget_inline() const		{ return _budget_inline; }
+  Rule *specialized_from() const	{ return _specialized_from; }
+  int object_field_count() const	{ return _object_fields.size(); }
+  Field *object_field(int i) const	{ return _object_fields[i]; }
   
   void set_origin(ModuleID o, int ri)	{ _origin = o; _ruleindex = ri; }
   void set_static(bool s)		{ _is_static = s; }
@@ -93,9 +104,13 @@ class Rule {
   void make_constructor()		{ _constructor = true; }
   void set_inlining(bool i)		{ _inlining = i; }
   void mark_dynamic_dispatch()		{ base_rule()->_dyn_dispatch = true; }
+  void set_heat(int h)			{ _heat = h; }
+  void set_budget_inline(bool b)	{ _budget_inline = b; }
   
   void receiver_class_analysis();
   void callable_analysis();
+  void warm_analysis();
+  void count_field_accesses(int group, unsigned long weight);
   
   void make_override(Rule *r);
   
@@ -122,6 +137,8 @@ class Rule {
   Node *make_body();
   Node *body()			{ return _compiled ? _body : make_body(); }
   void set_body(Node *n)	{ _body = n; _compiled = true; }
+  Rule *make_specialization(PermString, const Vector<Node *> &);
+  Rule *make_scalar_replacement(PermString, Type *, const Vector<Field *> &);
   static bool report_circular_dependency_error;
 
   // EXCEPTIONS
@@ -13,7 +13,7 @@ int Target::last_id = 0;
 Target::Target(Node *n, bool vu, Target *s, Target *f, GenCode gc)
   : _id(++last_id), _gen_code(gc),
     _node(n), _betweenliner(n->betweenliner()), _value_used(vu), _alias(false),
-    _succeed(s), _fail(f), _enter(0),
+    _cold(false), _succeed(s), _fail(f), _enter(0), _expect(0),
     _primary_fork(0), _primary_block(0),
     _printed(0)
 {
@@ -50,7 +50,8 @@ Target::connect(BlockLocation *block, Compiler *comp)
   if (_alias)
     return _succeed->connect(block, comp);
   
-  if (_enter > 1 && block) {
+  // A cold target starts its own block, so it can be placed out of line.
+  if (block && (_enter > 1 || (_cold && !block->cold()))) {
     if (!_primary_block)
       connect(0, comp);
     block->make_jump(_primary_block);
@@ -63,6 +64,8 @@ Target::connect(BlockLocation *block, Compiler *comp)
   if (!block) {
     _primary_block = block =
       new BlockLocation(_betweenliner, _id, _label_name);
+    if (_cold)
+      block->make_cold();
     comp->add_block(block);
   }
   
@@ -91,7 +94,7 @@ Target::connect(BlockLocation *block, Compiler *comp)
     else if (fail_block == 0 || fail_block == succeed_block)
       block->make_jump(succeed_block);
     else
-      block->make_branch(succeed_block, fail_block);
+      block->make_branch(succeed_block, fail_block, _expect);
   }
   
   return block;
@@ -134,6 +137,8 @@ Target::print0()
 
   if (_betweenliner.outline_level() > 0)
     errwriter << " out[" << _betweenliner.outline_level() << "]";
+  if (_expect)
+    errwriter << (_expect > 0 ? " likely" : " unlikely");
   
   errwriter << wmendl;
 }
@@ -14,10 +14,12 @@ class Target {
   Betweenliner _betweenliner;
   bool _value_used;
   bool _alias;
+  bool _cold;
   
   Target *_succeed;
   Target *_fail;
   int _enter;
+  int _expect;
   
   Fork *_primary_fork;
   BlockLocation *_primary_block;
@@ -32,15 +34,20 @@ class Target {
  public:
   
   Target(Node *, bool, Target *, Target * = 0, GenCode = gcNormal);
+  void *operator new(size_t size)	{ return Arena::allocate_current(size); }
+  void operator delete(void *)		{ }
   
   int id() const				{ return _id; }
   GenCode gen_code() const			{ return _gen_code; }
   bool value_used() const			{ return _value_used; }
   Target *succeed() const			{ return _succeed; }
   Target *fail() const				{ return _fail; }
+  int expect() const				{ return _expect; }
 
   void make_alias(Target *);
   void set_label_name(PermString ln)		{ _label_name = ln; }
+  void set_expect(int e)			{ _expect = e; }
+  void make_cold()				{ _cold = true; }
   
   int outline_epoch() const	{ return _betweenliner.outline_epoch(); }
   void set_betweenliner(Betweenliner b)		{ _betweenliner = b; }
@@ -11,6 +11,16 @@
 #include <cctype>
 #include <cerrno>
 #include <cstdlib>
+#include <cstring>
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_STAT_H)
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+# if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0
+#  include <sys/mman.h>
+#  define TOKENIZER_MMAP 1
+# endif
+#endif
 
 Token::Token()
   : _kind(0), _cat(catBlank)
@@ -72,6 +82,10 @@ HashMap<PermString, Token> Tokenizer::reserved_words;
 int *Tokenizer::char_class;
 int Tokenizer::char_class_storage[257];
 
+// The characters that end a run of C code which can be copied unexamined,
+// for each CParseState.
+static bool code_stop[5][256];
+
 
 void
 Tokenizer::add_operator(Operator op, PermString name, int precedence,
@@ -213,6 +227,9 @@ Tokenizer::static_initialize()
   ADDOP1("max=", opMaxAssign,	10, right);
   
   ADDOP1("outline", opOutline,	6, prefix|unary|right|optional_arg);
+  ADDOP1("likely", opLikely,	6, prefix|unary|right);
+  ADDOP1("unlikely", opUnlikely, 6, prefix|unary|right);
+  ADDOP1("pure", opPure,	6, prefix|unary|right);
   
   ADDOP(",",	',',		5);
   assert(opprecComma ==		5);
@@ -235,6 +252,7 @@ Tokenizer::static_initialize()
   ADDKW("/*",	opSlashStarComment);
   
   ADDKW("has", opHas);
+  ADDKW("layout", opLayout);
   ADDKW("module", opModule);
   ADDKW("class", opModule);
   ADDKW("field", opField);
@@ -309,6 +327,15 @@ Tokenizer::static_initialize()
   
   // Make sure opNone works out OK.
   assert(opNone == 0 && char_class[opNone] == 0);
+  
+  const unsigned char *cs;
+  for (cs = (const unsigned char *)"{}\'\"/\n"; *cs; cs++)
+    code_stop[cparseNormal][*cs] = true;
+  for (cs = (const unsigned char *)"\'\"\\\n"; *cs; cs++)
+    code_stop[cparseString][*cs] = code_stop[cparseChar][*cs] = true;
+  for (cs = (const unsigned char *)"*\n"; *cs; cs++)
+    code_stop[cparseCComment][*cs] = true;
+  code_stop[cparseEOLComment]['\n'] = true;
 }
 
 
@@ -359,18 +386,80 @@ Tokenizer::tis_punct(int c)
 
 
 Tokenizer::Tokenizer(FILE *f, PermString file, unsigned line)
-  : _f(f), _ungot_pos(0),
+  : _buf(0), _pos(0), _end(0), _mapped_len(0), _eof(false), _ungot_pos(0),
     _s(new char[256]), _slen(0), _scap(256),
-    _file(file), _line(line),
+    _file(file), _line(line), _first_file(file), _first_line(line),
     _column(0), _line_non_ws(0)
 {
   static_initialize();
+  load(f);
 }
 
 
 Tokenizer::~Tokenizer()
 {
   delete[] _s;
+#ifdef TOKENIZER_MMAP
+  if (_mapped_len) {
+    munmap((void *)_buf, _mapped_len);
+    return;
+  }
+#endif
+  free((void *)_buf);
+}
+
+
+void
+Tokenizer::load(FILE *f)
+{
+  size_t len = 0;
+  
+#ifdef TOKENIZER_MMAP
+  // Map regular files.
+  struct stat st;
+  int fd = fileno(f);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+      && ftell(f) == 0) {
+    void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      _buf = (const unsigned char *)p;
+      _mapped_len = len = st.st_size;
+    }
+  }
+#endif
+  
+  // Read anything else, like a pipe from the preprocessor, in large blocks.
+  if (!_buf) {
+    size_t cap = 65536;
+    unsigned char *b = (unsigned char *)malloc(cap);
+    size_t n;
+    while (b && (n = fread(b + len, 1, cap - len, f)) > 0) {
+      len += n;
+      if (len == cap) {
+	cap *= 2;
+	b = (unsigned char *)realloc(b, cap);
+      }
+    }
+    if (!b)
+      len = 0;
+    _buf = b;
+  }
+  
+  _pos = _buf;
+  _end = _buf + len;
+}
+
+
+// Starts over at the beginning of the input.
+void
+Tokenizer::rewind()
+{
+  _pos = _buf;
+  _eof = false;
+  _ungot_pos = 0;
+  _file = _first_file;
+  _line = _first_line;
+  _column = _line_non_ws = 0;
 }
 
 
@@ -391,8 +480,12 @@ Tokenizer::read()
   int c;
   if (_ungot_pos)
     c = _ungot[--_ungot_pos];
-  else
-    c = fgetc(_f);
+  else if (_pos < _end)
+    c = *_pos++;
+  else {
+    _eof = true;
+    c = EOF;
+  }
   if (c == '\n') {
     _line++;
     _column = _line_non_ws = 0;
@@ -430,6 +523,16 @@ Tokenizer::append(int c)
 }
 
 
+void
+Tokenizer::append_run(const unsigned char *s, const unsigned char *e)
+{
+  while (_slen + (e - s) > _scap)
+    increase_s();
+  memcpy(_s + _slen, s, e - s);
+  _slen += e - s;
+}
+
+
 inline void
 Tokenizer::clear()
 {
@@ -437,11 +540,120 @@ Tokenizer::clear()
 }
 
 
+/*****
+ * scanning runs of characters
+ **/
+
+// The scanners below work on the buffer directly, so they do nothing while
+// characters have been unread; read() will get to the rest.
+
+// Counts the newlines in [s, e), a word at a time.
+static unsigned
+count_newlines(const unsigned char *s, const unsigned char *e)
+{
+  const unsigned long ones = ~0UL / 255;
+  const unsigned long low7 = ones * 0x7F;
+  unsigned n = 0;
+  
+  for (; e - s >= (int)sizeof(unsigned long); s += sizeof(unsigned long)) {
+    unsigned long w;
+    memcpy(&w, s, sizeof(w));
+    w ^= ones * '\n';
+    // The high bit of each byte of `z' is set exactly where `w' has a zero
+    // byte, that is, where the input has a newline.
+    unsigned long z = ~(((w & low7) + low7) | w | low7);
+    for (; z; z &= z - 1)
+      n++;
+  }
+  for (; s < e; s++)
+    if (*s == '\n')
+      n++;
+  return n;
+}
+
+// Moves to `p', keeping the line and column up to date.
+void
+Tokenizer::skip_to(const unsigned char *p)
+{
+  if (unsigned nl = count_newlines(_pos, p)) {
+    const unsigned char *last = p;
+    while (last[-1] != '\n')
+      last--;
+    _line += nl;
+    _column = p - last;
+    _line_non_ws = 0;
+  } else
+    _column += p - _pos;
+  _pos = p;
+}
+
+void
+Tokenizer::skip_whitespace()
+{
+  if (_ungot_pos)
+    return;
+  const unsigned char *p = _pos;
+  while (p < _end && tis_whitespace(*p))
+    p++;
+  skip_to(p);
+}
+
+// Skips to the newline ending a `//' comment.
+void
+Tokenizer::skip_eol_comment()
+{
+  if (_ungot_pos)
+    return;
+  const void *nl = memchr(_pos, '\n', _end - _pos);
+  skip_to(nl ? (const unsigned char *)nl : _end);
+}
+
+// Skips to the next `*' in a `/* */' comment.
+void
+Tokenizer::skip_c_comment()
+{
+  if (_ungot_pos)
+    return;
+  const void *star = memchr(_pos, '*', _end - _pos);
+  skip_to(star ? (const unsigned char *)star : _end);
+}
+
+// Appends the characters of C code up to the next one in `stop', which
+// always includes newline.
+void
+Tokenizer::read_code_run(const bool *stop)
+{
+  if (_ungot_pos)
+    return;
+  const unsigned char *p;
+  if (stop == code_stop[cparseEOLComment]) {
+    p = (const unsigned char *)memchr(_pos, '\n', _end - _pos);
+    if (!p)
+      p = _end;
+  } else
+    for (p = _pos; p < _end && !stop[*p]; p++)
+      /* nada */;
+  append_run(_pos, p);
+  _column += p - _pos;
+  _pos = p;
+}
+
+
 bool
 Tokenizer::read_word(int c)
 {
   append(c);
   while (1) {
+    // Letters, digits and underscores need no lookahead.
+    if (!_ungot_pos) {
+      const unsigned char *p = _pos;
+      while (p < _end && (char_class[*p] & (Word | Punct)) == Word)
+	p++;
+      append_run(_pos, p);
+      _column += p - _pos;
+      _pos = p;
+    }
+    
     c = read();
     
     if (tis_word(c)) {
@@ -956,7 +1168,11 @@ Tokenizer::get_code_block(bool is_percent)
     clear();
     CParseState initial_state = c_state;
     
-    for (c = read(); c != EOF && c != '\n'; c = read())
+    while (1) {
+      read_code_run(code_stop[c_state]);
+      c = read();
+      if (c == EOF || c == '\n')
+	break;
       switch (c_state) {
 	
        case cparseChar:
@@ -1029,6 +1245,7 @@ Tokenizer::get_code_block(bool is_percent)
 	assert(0);
 	
       }
+    }
     
    loop_done:
     append('\n');
@@ -1052,6 +1269,7 @@ Tokenizer::get_token()
   while (1) {
     
     clear();
+    skip_whitespace();
     int c = read();
     while (tis_whitespace(c))
       c = read();
@@ -1121,6 +1339,7 @@ Tokenizer::get_token()
     switch (_token_kind) {
       
      case opEOLComment:
+      skip_eol_comment();
       do {
 	c = read();
       } while (c != '\n' && c != EOF);
@@ -1128,6 +1347,10 @@ Tokenizer::get_token()
       
      case opSlashStarComment:
       do {
+	if (c != '*') {
+	  skip_c_comment();
+	  c = read();
+	}
 	while (c != '*' && c != EOF)
 	  c = read();
 	while (c == '*')
@@ -89,7 +89,13 @@ class Tokenizer {
   
   //
   
-  FILE *_f;
+  // The whole input is in memory, mapped from the file or read in large
+  // blocks, so the tokenizer can scan runs of characters directly.
+  const unsigned char *_buf;
+  const unsigned char *_pos;
+  const unsigned char *_end;
+  size_t _mapped_len;
+  bool _eof;
   
   static const int MaxUngot = 30;
   char _ungot[MaxUngot];
@@ -101,19 +107,29 @@ class Tokenizer {
   
   PermString _file;
   unsigned _line;
+  PermString _first_file;
+  unsigned _first_line;
   
   int _token_kind;
   
   unsigned _column;
   unsigned _line_non_ws;
   
+  void load(FILE *);
+  
   void increase_s();
   void append(int);
   void append0(int);
+  void append_run(const unsigned char *, const unsigned char *);
   void clear();
   
   int read();
   void unread(int);
+  void skip_to(const unsigned char *);
+  void skip_whitespace();
+  void skip_eol_comment();
+  void skip_c_comment();
+  void read_code_run(const bool *stop);
   
   bool read_word(int);
   bool read_number(int);
@@ -130,6 +146,10 @@ class Tokenizer {
   Tokenizer(FILE *, PermString, unsigned = 1);
   ~Tokenizer();
   
+  size_t input_size() const		{ return _end - _buf; }
+  bool eof() const			{ return _eof; }
+  void rewind();
+  
   Landmark landmark() const		{ return Landmark(_file, _line); }
   operator Landmark() const		{ return landmark(); }
   
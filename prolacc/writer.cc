@@ -71,7 +71,7 @@ operator<<(Writer& w, void *v)
 
 
 Writer::Writer(FILE *f)
-    : _f(f), _line(1),
+    : _f(f), _line(1), _bytes(0), _capture(0),
       _buf(new char[256]), _buf_pos(0), _buf_cap(256),
       _level(0), _next_hang(0), _next_width(0), _pos(0),
       _extras((void *)0)
@@ -82,7 +82,8 @@ Writer::~Writer()
 {
   if (_pos)
     output_buf_line();
-  fflush(_f);
+  if (_f)
+    fflush(_f);
   delete[] _buf;
 }
 
@@ -131,7 +132,14 @@ inline void
 Writer::output_buf_line()
 {
   bufc('\n');
-  fwrite(_buf, 1, _buf_pos, _f);
+  if (_f)
+    fwrite(_buf, 1, _buf_pos, _f);
+  if (_capture) {
+    int n = _capture->size();
+    _capture->resize(n + _buf_pos);
+    memcpy(_capture->begin() + n, _buf, _buf_pos);
+  }
+  _bytes += _buf_pos;
   _buf_pos = _pos = 0;
   _line++;
 }
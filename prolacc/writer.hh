@@ -53,6 +53,11 @@ class Writer { public:
 
     void *&operator[](PermString x)	{ return _extras.find_force(x); }
     unsigned output_line() const	{ return _line; }
+    unsigned long output_bytes() const	{ return _bytes; }
+
+    // Append each complete output line to `v' as well. A Writer with no
+    // FILE only captures.
+    void set_capture(Vector<char> *v)	{ _capture = v; }
 
     char *steal_buf();
   
@@ -66,6 +71,8 @@ class Writer { public:
 
     FILE *_f;
     unsigned _line;
+    unsigned long _bytes;
+    Vector<char> *_capture;
   
     char *_buf;
     int _buf_pos;
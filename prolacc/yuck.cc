@@ -635,6 +635,17 @@ Yuck::ymodule_def(Namespace *namesp, PermString module_name,
       supertypes = true;
       break;
       
+     case opLayout: {
+       Token t = lex();
+       if (t.is(opIdentifier) && t.vstring() == "hot")
+	 _cmodule->set_hot_layout();
+       else {
+	 error(t, "syntax error (expected `hot' after `layout')");
+	 save(t);
+       }
+       break;
+     }
+      
      case '{':
       goto modulebeginning;
       